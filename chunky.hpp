@@ -17,20 +17,98 @@ limitations under the License.
 #define CHUNKY_HPP
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
 #include <deque>
+#include <limits>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <regex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
+#include <boost/algorithm/string/classification.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/trim.hpp>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/format.hpp>
+#include <boost/intrusive/list.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/utility.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+// x86 SIMD kernels are compiled with function target attributes and
+// selected at runtime, so no special compiler flags are needed.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CHUNKY_X86_SIMD 1
+#endif
+
+// Static tracepoints for perf/bpftrace/systemtap. Define
+// CHUNKY_ENABLE_SDT before including this file to compile USDT probes
+// (provider "chunky") into the application. Otherwise the probe
+// arguments are not evaluated and the probes cost nothing.
+//
+// Compiled-in probes use SDT semaphores, which the tracer increments
+// while attached, so probe arguments (including clock reads) are only
+// evaluated when someone is listening.
+//
+// The first argument of each probe identifies the connection (the
+// address of its Stream object), so events can be correlated across
+// probes.
+#ifdef CHUNKY_ENABLE_SDT
+#ifndef _SDT_HAS_SEMAPHORES
+#define _SDT_HAS_SEMAPHORES 1
+#endif
+#include <sys/sdt.h>
+
+// Semaphores are weak so every translation unit including this file
+// can define them.
+#define CHUNKY_PROBE_SEMAPHORE(name)                                    \
+   extern "C" {                                                         \
+      __attribute__((weak, used, section(".probes")))                   \
+      volatile unsigned short chunky_##name##_semaphore = 0;            \
+   }
+CHUNKY_PROBE_SEMAPHORE(connection__accept)
+CHUNKY_PROBE_SEMAPHORE(connection__close)
+CHUNKY_PROBE_SEMAPHORE(request__head)
+CHUNKY_PROBE_SEMAPHORE(handler__entry)
+CHUNKY_PROBE_SEMAPHORE(handler__return)
+CHUNKY_PROBE_SEMAPHORE(response__write)
+CHUNKY_PROBE_SEMAPHORE(response__finish)
+CHUNKY_PROBE_SEMAPHORE(chunk__decode)
+CHUNKY_PROBE_SEMAPHORE(putback)
+CHUNKY_PROBE_SEMAPHORE(tls__handshake__start)
+CHUNKY_PROBE_SEMAPHORE(tls__handshake__end)
+CHUNKY_PROBE_SEMAPHORE(websocket__frame__send)
+CHUNKY_PROBE_SEMAPHORE(websocket__frame__receive)
+#undef CHUNKY_PROBE_SEMAPHORE
+
+#define CHUNKY_PROBE_ENABLED(name) \
+   __builtin_expect(chunky_##name##_semaphore != 0, 0)
+#define CHUNKY_PROBE(name, ...)                                         \
+   do {                                                                 \
+      if (CHUNKY_PROBE_ENABLED(name))                                   \
+         STAP_PROBEV(chunky, name, __VA_ARGS__);                        \
+   } while (0)
+#else
+#define CHUNKY_PROBE(name, ...) \
+   do { if (false) ::chunky::detail::probe_unused(__VA_ARGS__); } while (0)
+#define CHUNKY_PROBE_ENABLED(name) false
+#endif
 
 namespace chunky {
    namespace detail {
@@ -39,6 +117,241 @@ namespace chunky {
             return boost::ilexicographical_compare(a,b);
          }
       };
+
+      typedef std::chrono::steady_clock Clock;
+
+      // Microseconds elapsed since a time point, e.g. for probe
+      // arguments. An unset time point (see probe_now()) yields 0.
+      inline long long elapsed_us(const Clock::time_point& t) {
+         if (t == Clock::time_point())
+            return 0;
+         return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t).count();
+      }
+
+      // Timestamp used only for probe durations. The clock is not
+      // read unless the probe that will report the duration is
+      // enabled, e.g. probe_now(CHUNKY_PROBE_ENABLED(handler__return)).
+      inline Clock::time_point probe_now(bool enabled) {
+         return enabled ? Clock::now() : Clock::time_point();
+      }
+
+      // Disabled probes reference their arguments here (in dead
+      // code) to avoid unused variable warnings.
+      template<typename... Args>
+      inline void probe_unused(const Args&...) {
+      }
+
+      // CPU time consumed by the calling thread, in nanoseconds.
+      inline uint64_t thread_cpu_ns() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+         timespec ts;
+         if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+            return static_cast<uint64_t>(ts.tv_sec) * 1000000000U + ts.tv_nsec;
+#endif
+         return 0;
+      }
+
+      typedef uint64_t (*AllocationCounter)();
+      inline std::atomic<AllocationCounter>& allocation_counter() {
+         static std::atomic<AllocationCounter> counter(nullptr);
+         return counter;
+      }
+
+      // Resource totals for one route.
+      struct RouteAccount {
+         std::atomic<uint64_t> requests;
+         std::atomic<uint64_t> cpuNanoseconds;
+         std::atomic<uint64_t> allocatedBytes;
+
+         RouteAccount()
+            : requests(0)
+            , cpuNanoseconds(0)
+            , allocatedBytes(0) {
+         }
+      };
+
+      // Receives the time each handler holds an I/O thread (see
+      // LoopMonitor). path is null for completion handlers.
+      class HandlerTimer {
+      public:
+         virtual ~HandlerTimer() {}
+         virtual void record(const Clock::duration& duration, const char* path) = 0;
+      };
+
+      // Charge the CPU time and allocations of the current thread
+      // during the lifetime of this object to a route, and report its
+      // wall time to a timer. Nested scopes (e.g. a handler invoked
+      // from an accounted continuation) are not double counted.
+      class AccountingScope : boost::noncopyable {
+      public:
+         explicit AccountingScope(
+            RouteAccount* account,
+            HandlerTimer* timer = nullptr,
+            const char* path = nullptr)
+            : outermost_((account || timer) && !active())
+            , account_(outermost_ ? account : nullptr)
+            , timer_(outermost_ ? timer : nullptr)
+            , path_(path) {
+            if (outermost_) {
+               active() = true;
+               if (account_) {
+                  allocationCounter_ = allocation_counter().load(std::memory_order_relaxed);
+                  allocatedBytes_ = allocationCounter_ ? allocationCounter_() : 0;
+                  cpuNanoseconds_ = thread_cpu_ns();
+               }
+               if (timer_)
+                  start_ = Clock::now();
+            }
+         }
+
+         ~AccountingScope() {
+            if (outermost_) {
+               if (account_) {
+                  account_->cpuNanoseconds += thread_cpu_ns() - cpuNanoseconds_;
+                  if (allocationCounter_)
+                     account_->allocatedBytes += allocationCounter_() - allocatedBytes_;
+               }
+               if (timer_)
+                  timer_->record(Clock::now() - start_, path_);
+               active() = false;
+            }
+         }
+
+      private:
+         const bool outermost_;
+         RouteAccount* account_;
+         HandlerTimer* timer_;
+         const char* path_;
+         AllocationCounter allocationCounter_;
+         uint64_t allocatedBytes_;
+         uint64_t cpuNanoseconds_;
+         Clock::time_point start_;
+
+         static bool& active() {
+            static thread_local bool value = false;
+            return value;
+         }
+      };
+
+      // Completion handler wrapper that accounts its invocation.
+      template<typename Handler>
+      struct AccountedHandler {
+         std::shared_ptr<RouteAccount> account;
+         std::shared_ptr<HandlerTimer> timer;
+         mutable Handler handler;
+
+         template<typename... Args>
+         void operator()(Args&&... args) const {
+            AccountingScope scope(account.get(), timer.get());
+            handler(std::forward<Args>(args)...);
+         }
+      };
+      
+      // Write a string as a quoted JSON string.
+      inline void write_json_string(std::ostream& os, const std::string& s) {
+         os << '"';
+         for (char c : s) {
+            switch (c) {
+            case '"':  os << "\\\""; break;
+            case '\\': os << "\\\\"; break;
+            case '\n': os << "\\n"; break;
+            case '\r': os << "\\r"; break;
+            case '\t': os << "\\t"; break;
+            default:
+               if (static_cast<unsigned char>(c) < 0x20)
+                  os << boost::format("\\u%04x") % static_cast<unsigned int>(c);
+               else
+                  os << c;
+            }
+         }
+         os << '"';
+      }
+
+      // Get the first nBytes of a buffer sequence.
+      template<typename ConstBufferSequence>
+      std::vector<boost::asio::const_buffer> buffer_prefix(
+         const ConstBufferSequence& buffers,
+         size_t nBytes) {
+         std::vector<boost::asio::const_buffer> result;
+         for (auto i = buffers.begin(); nBytes && i != buffers.end(); ++i) {
+            boost::asio::const_buffer buffer(*i);
+            const size_t size = std::min(boost::asio::buffer_size(buffer), nBytes);
+            result.push_back(boost::asio::buffer(buffer, size));
+            nBytes -= size;
+         }
+         return result;
+      }
+
+      // Non-owning view of a buffer vector, so composed operations
+      // copy a pair of pointers instead of the vector.
+      class BufferView {
+      public:
+         typedef boost::asio::const_buffer value_type;
+         typedef const boost::asio::const_buffer* const_iterator;
+
+         explicit BufferView(const std::vector<boost::asio::const_buffer>& buffers)
+            : begin_(buffers.data())
+            , end_(buffers.data() + buffers.size()) {
+         }
+
+         const_iterator begin() const { return begin_; }
+         const_iterator end() const { return end_; }
+
+      private:
+         const_iterator begin_;
+         const_iterator end_;
+      };
+
+      // Standard reason phrase for a status code, or empty.
+      inline const std::string& reason_phrase(unsigned int status) {
+         static const std::map<unsigned int, std::string> reasons = {
+            { 100, "Continue" },
+            { 101, "Switching Protocols" },
+            { 200, "OK" },
+            { 201, "Created" },
+            { 202, "Accepted" },
+            { 203, "Non-Authoritative Information" },
+            { 204, "No Content" },
+            { 205, "Reset Content" },
+            { 206, "Partial Content" },
+            { 300, "Multiple Choices" },
+            { 301, "Moved Permanently" },
+            { 302, "Found" },
+            { 303, "See Other" },
+            { 304, "Not Modified" },
+            { 305, "Use Proxy" },
+            { 307, "Temporary Redirect" },
+            { 400, "Bad Request" },
+            { 401, "Unauthorized" },
+            { 402, "Payment Required" },
+            { 403, "Forbidden" },
+            { 404, "Not Found" },
+            { 405, "Method Not Allowed" },
+            { 406, "Not Acceptable" },
+            { 407, "Proxy Authentication Required" },
+            { 408, "Request Timeout" },
+            { 409, "Conflict" },
+            { 410, "Gone" },
+            { 411, "Length Required" },
+            { 412, "Precondition Failed" },
+            { 413, "Payload Too Large" },
+            { 414, "URI Too Long" },
+            { 415, "Unsupported Media Type" },
+            { 416, "Range Not Satisfiable" },
+            { 417, "Expectation Failed" },
+            { 426, "Upgrade Required" },
+            { 500, "Internal Server Error" },
+            { 501, "Not Implemented" },
+            { 502, "Bad Gateway" },
+            { 503, "Service Unavailable" },
+            { 504, "Gateway Timeout" },
+            { 505, "HTTP Version Not Supported" }
+         };
+         static const std::string unknown;
+         
+         auto reason = reasons.find(status);
+         return reason != reasons.end() ? reason->second : unknown;
+      }
    }
    
    enum errors {
@@ -47,7 +360,9 @@ namespace chunky {
       unsupported_http_version,
       invalid_content_length,
       invalid_chunk_length,
-      invalid_chunk_delimiter
+      invalid_chunk_delimiter,
+      body_too_large,
+      invalid_multipart
    };
    
    inline boost::system::error_code make_error_code(errors e) {
@@ -72,6 +387,10 @@ namespace chunky {
                return "Invalid chunk length";
             case invalid_chunk_delimiter:
                return "Invalid chunk delimiter";
+            case body_too_large:
+               return "Request body too large";
+            case invalid_multipart:
+               return "Invalid multipart body";
             default:
                return "chunky error";
             }
@@ -83,1256 +402,6439 @@ namespace chunky {
          static_cast<int>(e), category);
    }
 
-   // This is a wrapper for a boost::asio stream class (e.g.
-   // boost::asio::ip::tcp::socket). It provides three features:
-   //
-   // 1. Asynchronous operations are thread-safe via a strand.
-   // 2. A put back buffer is available for overread data.
-   // 3. Stream lifetime is ensured (via shared_ptr) for asynchronous
-   //    operations.
-   template<typename T>
-   class Stream : public std::enable_shared_from_this<Stream<T> >
-                , boost::noncopyable {
+   // Install a function that returns the cumulative number of bytes
+   // allocated by the calling thread (e.g. via jemalloc's
+   // "thread.allocatedp" or a counting operator new). Servers with
+   // accounting enabled report per-route allocations using it.
+   inline void set_allocation_counter(uint64_t (*counter)()) {
+      detail::allocation_counter() = counter;
+   }
+   
+   // Lock-free histogram of durations (or other quantities) in
+   // power-of-two buckets. Bucket i counts values in [2^(i-1), 2^i).
+   class Histogram : boost::noncopyable {
    public:
-      typedef T stream_t;
-      
-      virtual ~Stream() {}
+      enum { Buckets = 40 };
 
-      stream_t& stream() {
-         return stream_;
+      Histogram()
+         : count_(0)
+         , sum_(0)
+         , max_(0) {
+         for (auto& bucket : buckets_)
+            bucket = 0;
       }
-      
-      boost::asio::io_service& get_io_service() {
-         return stream_.get_io_service();
+
+      void record(uint64_t value) {
+         ++buckets_[bucket(value)];
+         ++count_;
+         sum_ += value;
+
+         auto max = max_.load(std::memory_order_relaxed);
+         while (value > max && !max_.compare_exchange_weak(max, value))
+            ;
       }
 
-      template<typename MutableBufferSequence, typename ReadHandler>
-      void async_read_some(
-         const MutableBufferSequence& buffers,
-         ReadHandler&& handler) {
-         if (!readBuffer_.empty()) {
-            // Call the synchronous function. It won't block because
-            // the data are buffered.
-            boost::system::error_code error;
-            const auto nBytes = read_some(buffers, error);
-            get_io_service().post([=]() mutable {
-                  handler(error, nBytes);
-               });
-         }
-         else {
-            auto this_ = this->shared_from_this();
-            strand_.dispatch([=]() mutable {
-                  // Wrapping the handler is unnecessary because the
-                  // call is not a composed operation.
-                  this_->stream_.async_read_some(buffers, handler);
-               });
+      template<typename Rep, typename Period>
+      void record(const std::chrono::duration<Rep, Period>& duration) {
+         const auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+         record(static_cast<uint64_t>(std::max<decltype(us)>(us, 0)));
+      }
+
+      uint64_t count() const { return count_; }
+      uint64_t sum() const { return sum_; }
+      uint64_t max() const { return max_; }
+
+      // Upper bound of the bucket containing the specified fraction
+      // (0 to 1) of recorded values.
+      uint64_t percentile(double fraction) const {
+         const uint64_t n = count_;
+         const uint64_t target = static_cast<uint64_t>(fraction * n + 0.5);
+         uint64_t total = 0;
+         for (size_t i = 0; i < Buckets; ++i) {
+            total += buckets_[i];
+            if (total >= target && total)
+               return std::min(i ? (uint64_t(1) << i) - 1 : uint64_t(0), max());
          }
+         return max();
       }
 
-      template<typename ConstBufferSequence, typename WriteHandler>
-      void async_write_some(
-         const ConstBufferSequence& buffers,
-         WriteHandler&& handler) {
-         auto this_ = this->shared_from_this();
-         strand_.dispatch([=]() mutable {
-               // Wrapping the handler is unnecessary because the call
-               // is not a composed operation.
-               this_->stream_.async_write_some(buffers, handler);
-            });
+      // Write summary statistics as a JSON object. Units are those of
+      // the recorded values (microseconds for durations).
+      void write_json(std::ostream& os) const {
+         const uint64_t n = count_;
+         os << "{\"count\":" << n
+            << ",\"mean\":" << (n ? sum() / n : 0)
+            << ",\"p50\":" << percentile(0.50)
+            << ",\"p90\":" << percentile(0.90)
+            << ",\"p99\":" << percentile(0.99)
+            << ",\"max\":" << max()
+            << "}";
       }
+      
+   private:
+      std::atomic<uint64_t> buckets_[Buckets];
+      std::atomic<uint64_t> count_;
+      std::atomic<uint64_t> sum_;
+      std::atomic<uint64_t> max_;
 
-      template<typename MutableBufferSequence>
-      size_t read_some(
-         const MutableBufferSequence& buffers,
-         boost::system::error_code& error) {
-         if (!readBuffer_.empty()) {
-            const auto nBytes = std::min(readBuffer_.size(), boost::asio::buffer_size(buffers));
-            const auto iBegin = readBuffer_.begin();
-            const auto iEnd = iBegin + nBytes;
-            std::copy(iBegin, iEnd, boost::asio::buffers_begin(buffers));
-            readBuffer_.erase(iBegin, iEnd);
-            return nBytes;
+      static size_t bucket(uint64_t value) {
+         size_t i = 0;
+         while (value && i < Buckets - 1) {
+            value >>= 1;
+            ++i;
          }
-         else
-            return stream_.read_some(buffers, error);
+         return i;
       }
+   };
+   
+   // Hierarchical timer wheel for large numbers of coarse timeouts.
+   // Timers are intrusive, so scheduling and cancelling are O(1)
+   // list operations that never allocate, and a single steady_timer
+   // drives the wheel one tick at a time (only while timers are
+   // pending). Expired callbacks run on the io_service outside the
+   // wheel's lock.
+   class TimerWheel : public std::enable_shared_from_this<TimerWheel>
+                    , boost::noncopyable {
+   public:
+      typedef std::chrono::milliseconds Duration;
+      typedef std::function<void()> Callback;
+
+      class Timer : public boost::intrusive::list_base_hook<>
+                  , boost::noncopyable {
+      public:
+         explicit Timer(const Callback& callback = Callback())
+            : callback_(callback)
+            , slot_(nullptr)
+            , expiry_(0) {
+         }
+
+         ~Timer() {
+            if (wheel_)
+               wheel_->cancel(*this);
+         }
+
+         // Set the callback (only while not scheduled).
+         void set_callback(const Callback& callback) {
+            callback_ = callback;
+         }
+         
+      private:
+         friend class TimerWheel;
+         std::shared_ptr<TimerWheel> wheel_;
+         Callback callback_;
+         boost::intrusive::list<Timer>* slot_;
+         uint64_t expiry_;
+      };
       
-      template<typename MutableBufferSequence>
-      size_t read_some(
-         const MutableBufferSequence& buffers) {
-         boost::system::error_code error;
-         const auto nBytes = read_some(buffers, error);
-         if (error)
-            throw boost::system::system_error(error);
-         return nBytes;
+      static std::shared_ptr<TimerWheel> create(
+         boost::asio::io_service& io,
+         const Duration& tick = Duration(100)) {
+         return std::shared_ptr<TimerWheel>(new TimerWheel(io, tick));
       }
 
-      template<typename ConstBufferSequence>
-      size_t write_some(
-         const ConstBufferSequence& buffers,
-         boost::system::error_code& error) {
-         return stream_.write_some(buffers, error);
-      }
+      // Schedule (or reschedule) a timer. The delay is rounded up to
+      // a whole number of ticks.
+      void schedule(Timer& timer, const Duration& delay) {
+         std::lock_guard<std::mutex> lock(mutex_);
+         if (timer.is_linked())
+            unlink(timer);
+         else if (!size_)
+            now_ = current_tick();
 
-      template<typename ConstBufferSequence>
-      size_t write_some(
-         const ConstBufferSequence& buffers) {
-         boost::system::error_code error;
-         const auto nBytes = write_some(buffers, error);
-         if (error)
-            throw boost::system::system_error(error);
-         return nBytes;
+         const uint64_t ticks = (delay.count() + tick_.count() - 1) / tick_.count();
+         timer.expiry_ = now_ + std::max<uint64_t>(ticks, 1);
+         timer.wheel_ = shared_from_this();
+         insert(timer);
+         ++size_;
+         
+         if (!running_) {
+            running_ = true;
+            run();
+         }
       }
-      
-      template<typename ConstBufferSequence>
-      void put_back(const ConstBufferSequence& buffers) {
-         readBuffer_.insert(
-            readBuffer_.begin(),
-            boost::asio::buffers_begin(buffers), boost::asio::buffers_end(buffers));
+
+      void cancel(Timer& timer) {
+         std::lock_guard<std::mutex> lock(mutex_);
+         if (timer.is_linked()) {
+            unlink(timer);
+            --size_;
+         }
       }
 
-   protected:
-      template<typename... Args>
-      Stream(Args&&... args)
-         : stream_(std::forward<Args>(args)...)
-         , strand_(stream_.get_io_service()) {
+      size_t size() const {
+         std::lock_guard<std::mutex> lock(mutex_);
+         return size_;
       }
 
+      const Duration& tick() const { return tick_; }
+      boost::asio::io_service& get_io_service() { return io_; }
+      
    private:
-      T stream_;
-      boost::asio::io_service::strand strand_;
-      std::deque<char> readBuffer_;
-   };
+      enum {
+         LevelBits = 6,
+         Slots = 1 << LevelBits,
+         Levels = 4
+      };
+      typedef boost::intrusive::list<Timer> Slot;
+      
+      boost::asio::io_service& io_;
+      boost::asio::steady_timer timer_;
+      const Duration tick_;
+      const detail::Clock::time_point epoch_;
 
-   // This is a wrapped boost::asio TCP stream.
-   class TCP : public Stream<boost::asio::ip::tcp::socket> {
-   public:
-      template<typename CreateHandler>
-      static void async_connect(
-         boost::asio::ip::tcp::acceptor& acceptor,
-         CreateHandler handler) {
-         std::shared_ptr<TCP> tcp(new TCP(acceptor.get_io_service()));
-         acceptor.async_accept(
-            tcp->stream(),
-            [=](const boost::system::error_code& error) mutable {
-               if (error)
-                  tcp.reset();
-               handler(error, tcp);
-            });
+      mutable std::mutex mutex_;
+      Slot slots_[Levels][Slots];
+      uint64_t now_;
+      size_t size_;
+      bool running_;
+
+      TimerWheel(boost::asio::io_service& io, const Duration& tick)
+         : io_(io)
+         , timer_(io)
+         , tick_(tick)
+         , epoch_(detail::Clock::now())
+         , now_(0)
+         , size_(0)
+         , running_(false) {
       }
 
-      static std::shared_ptr<TCP> create(boost::asio::ip::tcp::socket&& socket) {
-         return std::shared_ptr<TCP>(new TCP(std::move(socket)));
+      uint64_t current_tick() const {
+         return (detail::Clock::now() - epoch_) / tick_;
       }
 
-      ~TCP() {
-         if (stream().is_open()) {
-            boost::system::error_code error;
-            stream().shutdown(boost::asio::ip::tcp::socket::shutdown_both, error);
-            stream().close(error);
-         }
+      static size_t slot_index(uint64_t expiry, size_t level) {
+         return (expiry >> (LevelBits * level)) & (Slots - 1);
       }
-   private:
-      TCP(boost::asio::io_service& io)
-         : Stream<boost::asio::ip::tcp::socket>(io) {
+      
+      // Place a timer in the level covering its remaining time.
+      void insert(Timer& timer) {
+         const uint64_t delta = timer.expiry_ - now_;
+         size_t level = 0;
+         while (level < Levels - 1 && delta >= (uint64_t(1) << (LevelBits * (level + 1))))
+            ++level;
+         if (delta >= (uint64_t(1) << (LevelBits * Levels)))
+            timer.expiry_ = now_ + (uint64_t(1) << (LevelBits * Levels)) - 1;
+         timer.slot_ = &slots_[level][slot_index(timer.expiry_, level)];
+         timer.slot_->push_back(timer);
       }
 
-      TCP(boost::asio::ip::tcp::socket&& socket)
-         : Stream<boost::asio::ip::tcp::socket>(std::move(socket)) {
+      void unlink(Timer& timer) {
+         timer.slot_->erase(Slot::s_iterator_to(timer));
       }
-   };
-
-#ifdef BOOST_ASIO_SSL_HPP
-   class TLS : public Stream<boost::asio::ssl::stream<boost::asio::ip::tcp::socket> > {
-   public:
-      typedef boost::system::error_code error_code;
       
-      template<typename CreateHandler>
-      static void async_connect(
-         boost::asio::ip::tcp::acceptor& acceptor,
-         boost::asio::ssl::context& context,
-         CreateHandler handler) {
-         // Accept a TCP connection.
-         std::shared_ptr<TLS> tls(new TLS(acceptor.get_io_service(), context));
-         acceptor.async_accept(
-            tls->stream().lowest_layer(),
-            [=](const error_code& error) {
-               if (error) {
-                  handler(error, tls);
+      // Advance one tick, collecting expired callbacks.
+      void advance(std::vector<Callback>& expired) {
+         ++now_;
+
+         // Redistribute higher level slots whose range begins now.
+         for (size_t level = 1; level < Levels; ++level) {
+            if (now_ & ((uint64_t(1) << (LevelBits * level)) - 1))
+               break;
+
+            Slot& slot = slots_[level][slot_index(now_, level)];
+            while (!slot.empty()) {
+               Timer& timer = slot.front();
+               slot.pop_front();
+               insert(timer);
+            }
+         }
+
+         Slot& slot = slots_[0][slot_index(now_, 0)];
+         while (!slot.empty()) {
+            Timer& timer = slot.front();
+            slot.pop_front();
+            --size_;
+            if (timer.callback_)
+               expired.push_back(timer.callback_);
+         }
+      }
+
+      void run() {
+         auto this_ = shared_from_this();
+         timer_.expires_at(epoch_ + (now_ + 1) * tick_);
+         timer_.async_wait([=](const boost::system::error_code& error) {
+               if (error)
                   return;
+               
+               std::vector<Callback> expired;
+               {
+                  std::lock_guard<std::mutex> lock(this_->mutex_);
+                  const auto target = this_->current_tick();
+                  while (this_->now_ < target && this_->size_)
+                     this_->advance(expired);
+                  
+                  if (this_->size_)
+                     this_->run();
+                  else
+                     this_->running_ = false;
                }
 
-               // Perform TLS handshake.
-               tls->stream().async_handshake(
-                  boost::asio::ssl::stream_base::server,
-                  [=](const error_code& error) {
-                        handler(error, tls);
-                  });
+               for (auto& callback : expired)
+                  callback();
             });
       }
+   };
 
-      template<typename ShutdownHandler>
-      void async_shutdown(ShutdownHandler&& handler) {
-         stream().async_shutdown(std::forward<ShutdownHandler>(handler));
+   // Per-phase connection timeouts. A zero duration disables a
+   // timeout.
+   struct ConnectionTimeouts {
+      enum Kind {
+         header_read,
+         body_read,
+         write_stall,
+         keep_alive_idle,
+         kinds
+      };
+
+      // Time allowed for a complete request line and headers.
+      TimerWheel::Duration headerRead;
+
+      // Time allowed for each request body read to make progress.
+      TimerWheel::Duration bodyRead;
+
+      // Time allowed for each write to make progress.
+      TimerWheel::Duration writeStall;
+
+      // Time a keep-alive connection may wait for its next request.
+      TimerWheel::Duration keepAliveIdle;
+
+      ConnectionTimeouts()
+         : headerRead(0)
+         , bodyRead(0)
+         , writeStall(0)
+         , keepAliveIdle(0) {
+      }
+
+      const TimerWheel::Duration& operator[](Kind kind) const {
+         switch (kind) {
+         case header_read: return headerRead;
+         case body_read:   return bodyRead;
+         case write_stall: return writeStall;
+         default:          return keepAliveIdle;
+         }
       }
       
-   private:
-      TLS(boost::asio::io_service& io, boost::asio::ssl::context& context)
-         : Stream<boost::asio::ssl::stream<boost::asio::ip::tcp::socket> >(io, context) {
+      static const char* name(Kind kind) {
+         switch (kind) {
+         case header_read:     return "header_read";
+         case body_read:       return "body_read";
+         case write_stall:     return "write_stall";
+         case keep_alive_idle: return "keep_alive_idle";
+         default:              return "";
+         }
       }
-   
    };
-#endif // BOOST_ASIO_SSL_HPP
 
-   template<typename T>
-   class HTTPTransaction : boost::noncopyable {
+   namespace detail {
+      // Timeout configuration and counters shared by a server and
+      // its connections.
+      struct TimeoutPolicy {
+         std::shared_ptr<TimerWheel> wheel;
+         std::atomic<TimerWheel::Duration::rep> durations[ConnectionTimeouts::kinds];
+         std::atomic<uint64_t> expired[ConnectionTimeouts::kinds];
+
+         explicit TimeoutPolicy(const std::shared_ptr<TimerWheel>& wheel)
+            : wheel(wheel) {
+            set(ConnectionTimeouts());
+            for (auto& n : expired)
+               n = 0;
+         }
+
+         void set(const ConnectionTimeouts& timeouts) {
+            for (int i = 0; i < ConnectionTimeouts::kinds; ++i)
+               durations[i] = timeouts[static_cast<ConnectionTimeouts::Kind>(i)].count();
+         }
+         
+         TimerWheel::Duration get(ConnectionTimeouts::Kind kind) const {
+            return TimerWheel::Duration(durations[kind].load(std::memory_order_relaxed));
+         }
+      };
+   }
+   
+   class ConnectionRegistry;
+
+   // Bookkeeping for a live connection, used by ConnectionRegistry
+   // for introspection. Stream inherits this so the record needs no
+   // separate allocation. Counters and state may be read from any
+   // thread.
+   class Connection : public boost::intrusive::list_base_hook<> {
    public:
-      typedef std::map<std::string, std::string, detail::CaselessCompare> Headers;
-      typedef std::map<std::string, std::string> Query;
-      
-      typedef boost::system::error_code error_code;
-      typedef std::function<void(const error_code&)> Handler;
-      typedef std::function<void(const error_code&, const std::shared_ptr<HTTPTransaction>&)> CreateHandler;
+      enum State {
+         reading_head,
+         in_handler,
+         writing,
+         idle,
+         upgraded
+      };
+
+      static const char* state_name(State state) {
+         switch (state) {
+         case reading_head: return "reading head";
+         case in_handler:   return "handler";
+         case writing:      return "writing";
+         case idle:         return "idle";
+         case upgraded:     return "upgraded";
+         }
+         return "";
+      }
+
+      State state() const { return state_; }
+      // Change state, applying the timeout for the new phase.
+      void set_state(State state) {
+         state_ = state;
+         lastActive_ = detail::Clock::now().time_since_epoch().count();
+
+         switch (state) {
+         case reading_head:
+            start_timeout(ConnectionTimeouts::header_read);
+            break;
+         case idle:
+            start_timeout(ConnectionTimeouts::keep_alive_idle);
+            break;
+         case in_handler:
+         case upgraded:
+            stop_timeout(readKind_);
+            break;
+         case writing:
+            break;
+         }
+      }
+
+      // Use the timeouts and timer wheel of a policy.
+      void set_timeouts(const std::shared_ptr<detail::TimeoutPolicy>& timeouts) {
+         timeouts_ = timeouts;
+
+         std::weak_ptr<Connection> self = self_;
+         readDeadline_.set_callback([=]() {
+               if (auto connection = self.lock())
+                  connection->expire(connection->readKind_);
+            });
+         writeDeadline_.set_callback([=]() {
+               if (auto connection = self.lock())
+                  connection->expire(ConnectionTimeouts::write_stall);
+            });
+      }
+
+      // Start or restart the deadline for a phase. Header, body, and
+      // idle deadlines share one timer; write stalls use another.
+      void start_timeout(ConnectionTimeouts::Kind kind) {
+         if (!timeouts_)
+            return;
+
+         auto& timer = deadline(kind);
+         const auto duration = timeouts_->get(kind);
+         if (duration.count()) {
+            if (kind != ConnectionTimeouts::write_stall)
+               readKind_ = kind;
+            timeouts_->wheel->schedule(timer, duration);
+         }
+         else
+            timeouts_->wheel->cancel(timer);
+      }
+
+      // Stop the deadline for a phase if it is the active one.
+      void stop_timeout(ConnectionTimeouts::Kind kind) {
+         if (!timeouts_)
+            return;
+
+         if (kind == ConnectionTimeouts::write_stall || kind == readKind_)
+            timeouts_->wheel->cancel(deadline(kind));
+      }
+
+      size_t bytes_read() const { return bytesRead_; }
+      size_t bytes_written() const { return bytesWritten_; }
       
-      HTTPTransaction(const std::shared_ptr<T>& stream)
-         : stream_(stream)
-         , streambuf_(buffer_size())
-         , requestBytes_(0)
-         , requestChunksPending_(false)
-         , responseStatus_(0)
-         , responseBytes_(0)
-         , responseChunked_(false) {
+      const boost::asio::ip::tcp::endpoint& peer() const { return peer_; }
+      detail::Clock::time_point created() const { return created_; }
+      detail::Clock::time_point last_active() const {
+         return detail::Clock::time_point(detail::Clock::duration(lastActive_));
       }
 
-      const std::string& request_method() const { return requestMethod_; }
-      const std::string& request_version() const { return requestVersion_; }
-      const std::string& request_resource() const { return requestResource_; }
-      const Headers& request_headers() const { return requestHeaders_; }
-      const std::string request_header(
-         const std::string& key,
-         const std::string& defaultValue = std::string()) const {
-         auto i = request_headers().find(key);
-         return i != request_headers().end() ? i->second : defaultValue;
+      // The path of the current (or most recent) request.
+      std::string path() const {
+         std::lock_guard<std::mutex> lock(pathMutex_);
+         return path_;
+      }
+      void set_path(const std::string& path) {
+         std::lock_guard<std::mutex> lock(pathMutex_);
+         path_ = path;
+      }
+
+      // Shut down the connection from any thread. The shutdown is
+      // posted to the connection's strand so it does not race with
+      // operations being started. Pending operations complete
+      // normally (e.g. with EOF), which releases the connection's
+      // resources.
+      virtual void close_connection() = 0;
+
+      // As close_connection(), but only if the connection is still
+      // idle when the shutdown runs, so a request that has just
+      // started is not cut off.
+      virtual void close_if_idle() = 0;
+
+   protected:
+      Connection()
+         : state_(reading_head)
+         , bytesRead_(0)
+         , bytesWritten_(0)
+         , created_(detail::Clock::now())
+         , lastActive_(created_.time_since_epoch().count())
+         , readKind_(ConnectionTimeouts::header_read) {
       }
       
-      const std::string& request_path() const { return requestPath_; }
-      const std::string& request_fragment() const { return requestFragment_; }
-      const Query& request_query() const { return requestQuery_; }
+      virtual ~Connection();
+
+      void add_bytes_read(size_t nBytes) { bytesRead_ += nBytes; }
+      void add_bytes_written(size_t nBytes) { bytesWritten_ += nBytes; }
       
-      unsigned int& response_status() { return responseStatus_; }
-      Headers& response_headers() { return responseHeaders_; }
-      std::string& response_header(const std::string& key) {
-         return response_headers()[key];
+   private:
+      friend class ConnectionRegistry;
+      std::shared_ptr<ConnectionRegistry> registry_;
+      std::weak_ptr<Connection> self_;
+      boost::asio::ip::tcp::endpoint peer_;
+
+      std::atomic<State> state_;
+      std::atomic<size_t> bytesRead_;
+      std::atomic<size_t> bytesWritten_;
+      const detail::Clock::time_point created_;
+      std::atomic<detail::Clock::rep> lastActive_;
+
+      mutable std::mutex pathMutex_;
+      std::string path_;
+
+      std::shared_ptr<detail::TimeoutPolicy> timeouts_;
+      TimerWheel::Timer readDeadline_;
+      TimerWheel::Timer writeDeadline_;
+      std::atomic<ConnectionTimeouts::Kind> readKind_;
+
+      TimerWheel::Timer& deadline(ConnectionTimeouts::Kind kind) {
+         return kind == ConnectionTimeouts::write_stall ? writeDeadline_ : readDeadline_;
       }
       
-      Headers& response_trailers() { return responseTrailers_; }
-      std::string& response_trailer(const std::string& key) {
-         return response_trailers()[key];
+      void expire(ConnectionTimeouts::Kind kind) {
+         ++timeouts_->expired[kind];
+         close_connection();
       }
+   };
 
-      // Either async_finish() or finish() must be called on each
-      // HTTPTransaction instance to ensure valid I/O on the stream. In
-      // most cases exactly one call should be made with no further
-      // usage of the instance (the exception is for returning 1xx
-      // status).
-      template<typename FinishHandler>
-      void async_finish(FinishHandler&& handler) {
-         // Use shared_ptr lifetime to execute the handler exactly
-         // once when both the final reads and writes (which may
-         // overlap in time) are complete.
-         std::shared_ptr<error_code> result(new error_code, [=](error_code* pointer) {
-               handler(*pointer);
-               delete pointer;
-            });
+   // Intrusive registry of live connections. Adding and removing a
+   // connection is a list splice under a mutex; snapshots take
+   // strong references so records can be examined safely while
+   // connections close concurrently.
+   class ConnectionRegistry : boost::noncopyable
+                            , public std::enable_shared_from_this<ConnectionRegistry> {
+   public:
+      typedef std::vector<std::shared_ptr<Connection> > Snapshot;
+      
+      static std::shared_ptr<ConnectionRegistry> create() {
+         return std::shared_ptr<ConnectionRegistry>(new ConnectionRegistry);
+      }
 
-         assert(response_status() >= 100);
-         if (response_status() >= 200) {
-            async_discard([=](const error_code& error) mutable {
-                  // Replace any unused bytes read by get_line().
-                  putback_buffer();
-                  *result = error;
-               });
-         }
-         else
-            putback_buffer();
-         
-         // Output final empty chunk.
-         async_write_some(
-            boost::asio::null_buffers(),
-            [=](const error_code& error, size_t) {
-               *result = error;
-            });
+      template<typename C>
+      void add(const std::shared_ptr<C>& connection, const boost::asio::ip::tcp::endpoint& peer) {
+         Connection& record = *connection;
+         record.registry_ = shared_from_this();
+         record.self_ = connection;
+         record.peer_ = peer;
+
+         std::lock_guard<std::mutex> lock(mutex_);
+         connections_.push_back(record);
       }
-      
-      // Either async_finish() or finish() must be called on each
-      // HTTPTransaction instance to ensure valid I/O on the stream. In
-      // most cases exactly one call should be made with no further
-      // usage of the instance(the exception is for returning 1xx
-      // status).
-      void finish() {
-         assert(response_status() >= 100);
-         if (response_status() >= 200) {
-            sync_discard([=](const error_code& error) {
-                  if (error)
-                     throw boost::system::system_error(error);
-               
-                  // Replace any unused bytes read by get_line().
-                  putback_buffer();
-               });
-         }
-         else
-            putback_buffer();
-         
-         // Replace any unused bytes read by get_line().
-         if (auto unused = streambuf_.size()) {
-            stream()->put_back(streambuf_.data());
-            streambuf_.consume(unused);
+
+      void remove(Connection& record) {
+         RemoveCallback callback;
+         size_t remaining;
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!record.is_linked())
+               return;
+            connections_.erase(connections_.iterator_to(record));
+            callback = removeCallback_;
+            remaining = connections_.size();
          }
 
-         // Output final empty chunk.
-         write_some(boost::asio::null_buffers());
+         if (callback)
+            callback(remaining);
       }
-      
-      // Either async_finish() or finish() must be called on each
-      // HTTPTransaction instance to ensure valid I/O on the stream. In
-      // most cases exactly one call should be made with no further
-      // usage of the instance(the exception is for returning 1xx
-      // status).
-      void finish(error_code& error) {
-         try {
-            finish();
-         }
-         catch (const boost::system::system_error& e) {
-            error = e.code();
-         }
+
+      // Set a function to call with the remaining number of
+      // connections after one is removed. It is called on the thread
+      // that releases the connection.
+      typedef std::function<void(size_t)> RemoveCallback;
+      void set_remove_callback(const RemoveCallback& callback) {
+         std::lock_guard<std::mutex> lock(mutex_);
+         removeCallback_ = callback;
       }
 
-      boost::asio::io_service& get_io_service() {
-         return stream()->get_io_service();
+      size_t size() const {
+         std::lock_guard<std::mutex> lock(mutex_);
+         return connections_.size();
       }
-      
-      template<typename MutableBufferSequence, typename ReadHandler>
-      void async_read_some(MutableBufferSequence&& buffers, ReadHandler&& handler) {
-         using namespace std::placeholders;
-         auto loadBufferFunc = std::bind(&HTTPTransaction::async_load_buffer, this, _1, _2);
-         if (requestMethod_.empty()) {
-            create(loadBufferFunc, [=](const error_code& error) mutable {
-                  if (error) {
-                     handler(error, 0);
-                     return;
-                  }
 
-                  async_read_some(buffers, handler);
-               });
-            return;
+      Snapshot snapshot() const {
+         Snapshot result;
+         std::lock_guard<std::mutex> lock(mutex_);
+         result.reserve(connections_.size());
+         for (const auto& record : connections_) {
+            // Skip records whose connection is being destroyed.
+            if (auto connection = record.self_.lock())
+               result.push_back(std::move(connection));
          }
+         return result;
+      }
+
+      // Write all connections as a JSON array.
+      void write_json(std::ostream& os) const {
+         using std::chrono::duration_cast;
+         using std::chrono::milliseconds;
+         const auto now = detail::Clock::now();
          
-         // Take data from the streambuf first.
-         size_t nBytesRead = 0;
-         const auto bufferSize = boost::asio::buffer_size(buffers);
-         if (streambuf_.size()) {
-            auto nBytes = boost::asio::buffer_copy(buffers, streambuf_.data(), requestBytes_);
-            streambuf_.consume(nBytes);
-            requestBytes_ -= nBytes;
-            nBytesRead += nBytes;
+         os << "[";
+         const char* separator = "";
+         for (const auto& connection : snapshot()) {
+            os << separator << "{\"peer\":";
+            detail::write_json_string(os, connection->peer().address().to_string());
+            os << ",\"port\":" << connection->peer().port()
+               << ",\"state\":\"" << Connection::state_name(connection->state()) << '"'
+               << ",\"age_ms\":" << duration_cast<milliseconds>(now - connection->created()).count()
+               << ",\"idle_ms\":" << duration_cast<milliseconds>(now - connection->last_active()).count()
+               << ",\"bytes_read\":" << connection->bytes_read()
+               << ",\"bytes_written\":" << connection->bytes_written()
+               << ",\"path\":";
+            detail::write_json_string(os, connection->path());
+            os << "}";
+            separator = ",";
          }
+         os << "]";
+      }
 
-         boost::asio::async_read(
-            *stream(), buffers, boost::asio::transfer_exactly(nBytesRead ? 0 : requestBytes_),
-            [=](const error_code& error, size_t nBytes) mutable {
-               if (error) {
-                  handler(error, nBytesRead);
-                  return;
-               }
+      // Close connections that are idle between requests, e.g. to
+      // shed memory under pressure. Returns the number found idle;
+      // each is closed asynchronously if it is still idle then.
+      template<typename Duration = detail::Clock::duration>
+      size_t close_idle(const Duration& minimumIdle = Duration::zero()) {
+         const auto threshold = detail::Clock::now() - minimumIdle;
+         size_t count = 0;
+         for (const auto& connection : snapshot()) {
+            if (connection->state() == Connection::idle &&
+                connection->last_active() <= threshold) {
+               connection->close_if_idle();
+               ++count;
+            }
+         }
+         return count;
+      }
+      
+   private:
+      ConnectionRegistry() {}
+      
+      mutable std::mutex mutex_;
+      boost::intrusive::list<Connection> connections_;
+      RemoveCallback removeCallback_;
+   };
 
-               // Read the chunk delimiter and next chunk header if chunked.
-               requestBytes_ -= nBytes;
-               nBytesRead += nBytes;
+   inline Connection::~Connection() {
+      if (registry_)
+         registry_->remove(*this);
+   }
+   
+   // This is a wrapper for a boost::asio stream class (e.g.
+   // boost::asio::ip::tcp::socket). It provides three features:
+   //
+   // 1. Asynchronous operations are thread-safe via a strand.
+   // 2. A put back buffer is available for overread data.
+   // 3. Stream lifetime is ensured (via shared_ptr) for asynchronous
+   //    operations.
+   template<typename T>
+   class Stream : public std::enable_shared_from_this<Stream<T> >
+                , public Connection
+                , boost::noncopyable {
+   public:
+      typedef T stream_t;
+      
+      virtual ~Stream() {
+         CHUNKY_PROBE(connection__close, this, detail::elapsed_us(created()));
+      }
+
+      stream_t& stream() {
+         return stream_;
+      }
+      
+      boost::asio::io_service& get_io_service() {
+         return stream_.get_io_service();
+      }
+
+      template<typename MutableBufferSequence, typename ReadHandler>
+      void async_read_some(
+         const MutableBufferSequence& buffers,
+         ReadHandler&& handler) {
+         if (!readBuffer_.empty()) {
+            // Call the synchronous function. It won't block because
+            // the data are buffered.
+            boost::system::error_code error;
+            const auto nBytes = read_some(buffers, error);
+            get_io_service().post([=]() mutable {
+                  handler(error, nBytes);
+               });
+         }
+         else {
+            auto this_ = this->shared_from_this();
+            strand_.dispatch([=]() mutable {
+                  this_->stream_.async_read_some(
+                     buffers,
+                     [=](const boost::system::error_code& error, size_t nBytes) mutable {
+                        this_->read_completed(nBytes);
+                        handler(error, nBytes);
+                     });
+               });
+         }
+      }
+
+      enum {
+         DefaultWriteQuantum = 65536
+      };
+      
+      // Limit the bytes written by each write_some() call. Composed
+      // writes (e.g. boost::asio::async_write()) then return to the
+      // io_service between slices, so a large write cannot
+      // monopolize an I/O thread. Zero is unlimited.
+      void set_write_quantum(size_t nBytes) {
+         writeQuantum_ = nBytes;
+      }
+
+      // Cap the write rate with a token bucket. Asynchronous writes
+      // wait on a timer for tokens. Synchronous writes are never
+      // delayed, because they may be on an I/O thread, but they are
+      // charged to the bucket so later asynchronous writes make up
+      // the difference. Zero bytesPerSecond removes the cap.
+      void set_bandwidth_limit(size_t bytesPerSecond, size_t burst = DefaultWriteQuantum) {
+         writeBurst_ = std::max<size_t>(burst, 1);
+         writeRate_ = bytesPerSecond;
+      }
+      
+      template<typename ConstBufferSequence, typename WriteHandler>
+      void async_write_some(
+         const ConstBufferSequence& buffers,
+         WriteHandler&& handler) {
+         auto this_ = this->shared_from_this();
+         detail::Clock::duration delay;
+         const size_t nBufferBytes = boost::asio::buffer_size(buffers);
+         const size_t nBytes = write_allowance(nBufferBytes, delay);
+         if (!nBytes && nBufferBytes) {
+            throttleTimer_.expires_from_now(delay);
+            throttleTimer_.async_wait([=](const boost::system::error_code&) mutable {
+                  this_->async_write_some(buffers, handler);
+               });
+            return;
+         }
+         
+         start_timeout(ConnectionTimeouts::write_stall);
+         auto completion = [=](const boost::system::error_code& error, size_t nWritten) mutable {
+            this_->stop_timeout(ConnectionTimeouts::write_stall);
+            this_->add_bytes_written(nWritten);
+            this_->refund_allowance(nBytes, nWritten);
+            handler(error, nWritten);
+         };
+         
+         if (nBytes < nBufferBytes) {
+            auto slice = detail::buffer_prefix(buffers, nBytes);
+            strand_.dispatch([=]() mutable {
+                  this_->stream_.async_write_some(slice, completion);
+               });
+         }
+         else {
+            strand_.dispatch([=]() mutable {
+                  this_->stream_.async_write_some(buffers, completion);
+               });
+         }
+      }
+
+      template<typename MutableBufferSequence>
+      size_t read_some(
+         const MutableBufferSequence& buffers,
+         boost::system::error_code& error) {
+         if (!readBuffer_.empty()) {
+            const auto nBytes = std::min(readBuffer_.size(), boost::asio::buffer_size(buffers));
+            const auto iBegin = readBuffer_.begin();
+            const auto iEnd = iBegin + nBytes;
+            std::copy(iBegin, iEnd, boost::asio::buffers_begin(buffers));
+            readBuffer_.erase(iBegin, iEnd);
+            return nBytes;
+         }
+         else {
+            const auto nBytes = stream_.read_some(buffers, error);
+            read_completed(nBytes);
+            return nBytes;
+         }
+      }
+      
+      template<typename MutableBufferSequence>
+      size_t read_some(
+         const MutableBufferSequence& buffers) {
+         boost::system::error_code error;
+         const auto nBytes = read_some(buffers, error);
+         if (error)
+            throw boost::system::system_error(error);
+         return nBytes;
+      }
+
+      template<typename ConstBufferSequence>
+      size_t write_some(
+         const ConstBufferSequence& buffers,
+         boost::system::error_code& error) {
+         const size_t nBufferBytes = boost::asio::buffer_size(buffers);
+         size_t nBytes = nBufferBytes;
+         if (const size_t quantum = writeQuantum_)
+            nBytes = std::min(nBytes, quantum);
+         
+         start_timeout(ConnectionTimeouts::write_stall);
+         const auto nWritten = nBytes < nBufferBytes ?
+            stream_.write_some(detail::buffer_prefix(buffers, nBytes), error) :
+            stream_.write_some(buffers, error);
+         stop_timeout(ConnectionTimeouts::write_stall);
+         add_bytes_written(nWritten);
+         charge_allowance(nWritten);
+         return nWritten;
+      }
+
+      template<typename ConstBufferSequence>
+      size_t write_some(
+         const ConstBufferSequence& buffers) {
+         boost::system::error_code error;
+         const auto nBytes = write_some(buffers, error);
+         if (error)
+            throw boost::system::system_error(error);
+         return nBytes;
+      }
+      
+      template<typename ConstBufferSequence>
+      void put_back(const ConstBufferSequence& buffers) {
+         CHUNKY_PROBE(putback, this, boost::asio::buffer_size(buffers));
+         readBuffer_.insert(
+            readBuffer_.begin(),
+            boost::asio::buffers_begin(buffers), boost::asio::buffers_end(buffers));
+      }
+
+      // Move any put-back bytes to the end of a buffer.
+      void take_put_back(std::string& bytes) {
+         bytes.append(readBuffer_.begin(), readBuffer_.end());
+         readBuffer_.clear();
+      }
+      
+      virtual void close_connection() {
+         post_shutdown(false);
+      }
+
+      virtual void close_if_idle() {
+         post_shutdown(true);
+      }
+
+      // Limit unsent data in the kernel send buffer with
+      // TCP_NOTSENT_LOWAT, so write completions track what the peer
+      // has actually received. Fails where the option is unsupported.
+      void set_notsent_lowat(size_t nBytes, boost::system::error_code& error) {
+#ifdef TCP_NOTSENT_LOWAT
+         typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_NOTSENT_LOWAT> NotSentLowat;
+         stream_.lowest_layer().set_option(NotSentLowat(static_cast<int>(nBytes)), error);
+#else
+         (void)nBytes;
+         error = make_error_code(boost::asio::error::operation_not_supported);
+#endif
+      }
+
+   protected:
+      template<typename... Args>
+      Stream(Args&&... args)
+         : stream_(std::forward<Args>(args)...)
+         , strand_(stream_.get_io_service())
+         , writeQuantum_(DefaultWriteQuantum)
+         , writeRate_(0)
+         , writeBurst_(DefaultWriteQuantum)
+         , writeTokens_(0.0)
+         , throttleTimer_(stream_.get_io_service()) {
+      }
+
+   private:
+      T stream_;
+      boost::asio::io_service::strand strand_;
+      std::deque<char> readBuffer_;
+
+      // Write slicing and throttling. The bucket is only touched by
+      // the (single) outstanding write.
+      std::atomic<size_t> writeQuantum_;
+      std::atomic<size_t> writeRate_;
+      std::atomic<size_t> writeBurst_;
+      double writeTokens_;
+      detail::Clock::time_point writeRefilled_;
+      boost::asio::steady_timer throttleTimer_;
+
+      // Get the number of bytes the next write may take, or zero and
+      // the time to wait for tokens.
+      size_t write_allowance(size_t nBytes, detail::Clock::duration& delay) {
+         if (const size_t quantum = writeQuantum_)
+            nBytes = std::min(nBytes, quantum);
+
+         const size_t rate = writeRate_;
+         if (!rate || !nBytes)
+            return nBytes;
+
+         const size_t burst = writeBurst_;
+         refill_tokens(rate, burst);
+
+         // Wait until a full burst (or the whole write) is available
+         // to avoid many tiny writes.
+         const double needed = std::min(nBytes, burst);
+         if (writeTokens_ < needed) {
+            delay = std::chrono::duration_cast<detail::Clock::duration>(
+               std::chrono::duration<double>((needed - writeTokens_) / rate));
+            return 0;
+         }
+
+         nBytes = std::min(nBytes, static_cast<size_t>(writeTokens_));
+         writeTokens_ -= nBytes;
+         return nBytes;
+      }
+
+      void refill_tokens(size_t rate, size_t burst) {
+         const auto now = detail::Clock::now();
+         writeTokens_ = std::min<double>(
+            burst,
+            writeTokens_ + std::chrono::duration<double>(now - writeRefilled_).count() * rate);
+         writeRefilled_ = now;
+      }
+
+      // Take tokens for a synchronous write. The balance may go
+      // negative, which delays the next asynchronous write.
+      void charge_allowance(size_t nWritten) {
+         if (const size_t rate = writeRate_) {
+            refill_tokens(rate, writeBurst_);
+            writeTokens_ -= nWritten;
+         }
+      }
+
+      // Return tokens for bytes not written.
+      void refund_allowance(size_t nAllowed, size_t nWritten) {
+         if (writeRate_ && nAllowed > nWritten)
+            writeTokens_ += nAllowed - nWritten;
+      }
+
+      void post_shutdown(bool onlyIdle) {
+         auto this_ = this->shared_from_this();
+         strand_.post([=]() {
+               if (onlyIdle && this_->state() != idle)
+                  return;
+               
+               boost::system::error_code error;
+               this_->stream_.lowest_layer().shutdown(boost::asio::socket_base::shutdown_both, error);
+            });
+      }
+
+      void read_completed(size_t nBytes) {
+         add_bytes_read(nBytes);
+
+         // Data on an idle keep-alive connection starts a request.
+         if (nBytes && state() == idle)
+            set_state(reading_head);
+      }
+   };
+
+   // This is a wrapped boost::asio TCP stream.
+   class TCP : public Stream<boost::asio::ip::tcp::socket> {
+   public:
+      template<typename CreateHandler>
+      static void async_connect(
+         boost::asio::ip::tcp::acceptor& acceptor,
+         CreateHandler handler) {
+         std::shared_ptr<TCP> tcp(new TCP(acceptor.get_io_service()));
+         acceptor.async_accept(
+            tcp->stream(),
+            [=](const boost::system::error_code& error) mutable {
+               if (error)
+                  tcp.reset();
+               handler(error, tcp);
+            });
+      }
+
+      static std::shared_ptr<TCP> create(boost::asio::ip::tcp::socket&& socket) {
+         return std::shared_ptr<TCP>(new TCP(std::move(socket)));
+      }
+
+      ~TCP() {
+         if (stream().is_open()) {
+            boost::system::error_code error;
+            stream().shutdown(boost::asio::ip::tcp::socket::shutdown_both, error);
+            stream().close(error);
+         }
+      }
+   private:
+      TCP(boost::asio::io_service& io)
+         : Stream<boost::asio::ip::tcp::socket>(io) {
+      }
+
+      TCP(boost::asio::ip::tcp::socket&& socket)
+         : Stream<boost::asio::ip::tcp::socket>(std::move(socket)) {
+      }
+   };
+
+#ifdef BOOST_ASIO_SSL_HPP
+   class TLS : public Stream<boost::asio::ssl::stream<boost::asio::ip::tcp::socket> > {
+   public:
+      typedef boost::system::error_code error_code;
+      
+      template<typename CreateHandler>
+      static void async_connect(
+         boost::asio::ip::tcp::acceptor& acceptor,
+         boost::asio::ssl::context& context,
+         CreateHandler handler) {
+         // Accept a TCP connection.
+         std::shared_ptr<TLS> tls(new TLS(acceptor.get_io_service(), context));
+         acceptor.async_accept(
+            tls->stream().lowest_layer(),
+            [=](const error_code& error) {
+               if (error) {
+                  handler(error, tls);
+                  return;
+               }
+
+               // Perform TLS handshake.
+               CHUNKY_PROBE(tls__handshake__start, tls.get());
+               const auto start = detail::probe_now(CHUNKY_PROBE_ENABLED(tls__handshake__end));
+               tls->stream().async_handshake(
+                  boost::asio::ssl::stream_base::server,
+                  [=](const error_code& error) {
+                        CHUNKY_PROBE(tls__handshake__end, tls.get(), error.value(), detail::elapsed_us(start));
+                        handler(error, tls);
+                  });
+            });
+      }
+
+      template<typename ShutdownHandler>
+      void async_shutdown(ShutdownHandler&& handler) {
+         stream().async_shutdown(std::forward<ShutdownHandler>(handler));
+      }
+      
+   private:
+      TLS(boost::asio::io_service& io, boost::asio::ssl::context& context)
+         : Stream<boost::asio::ssl::stream<boost::asio::ip::tcp::socket> >(io, context) {
+      }
+   
+   };
+#endif // BOOST_ASIO_SSL_HPP
+
+   template<typename Derived, typename T>
+   class BaseHTTPServer;
+   
+   template<typename T>
+   class HTTPTransaction : public std::enable_shared_from_this<HTTPTransaction<T> >
+                         , boost::noncopyable {
+   public:
+      typedef std::map<std::string, std::string, detail::CaselessCompare> Headers;
+      typedef std::map<std::string, std::string> Query;
+      
+      typedef boost::system::error_code error_code;
+      typedef std::function<void(const error_code&)> Handler;
+      typedef std::function<void(const error_code&, const std::shared_ptr<HTTPTransaction>&)> CreateHandler;
+      typedef std::function<void(const error_code&, const boost::asio::const_buffer&)> BodyHandler;
+      
+      HTTPTransaction(const std::shared_ptr<T>& stream)
+         : stream_(stream)
+         , streambuf_(buffer_size())
+         , requestBytes_(0)
+         , requestChunksPending_(false)
+         , responseStatus_(0)
+         , responseBytes_(0)
+         , responseChunked_(false)
+         , released_(false)
+         , queuedBytes_(0)
+         , writing_(false)
+         , lowWatermark_(DefaultLowWatermark)
+         , highWatermark_(DefaultHighWatermark) {
+      }
+
+      const std::string& request_method() const { return requestMethod_; }
+      const std::string& request_version() const { return requestVersion_; }
+      const std::string& request_resource() const { return requestResource_; }
+      const Headers& request_headers() const { return requestHeaders_; }
+      const std::string request_header(
+         const std::string& key,
+         const std::string& defaultValue = std::string()) const {
+         auto i = request_headers().find(key);
+         return i != request_headers().end() ? i->second : defaultValue;
+      }
+      
+      const std::string& request_path() const { return requestPath_; }
+      const std::string& request_fragment() const { return requestFragment_; }
+      const Query& request_query() const { return requestQuery_; }
+      
+      unsigned int& response_status() { return responseStatus_; }
+      Headers& response_headers() { return responseHeaders_; }
+      std::string& response_header(const std::string& key) {
+         return response_headers()[key];
+      }
+      
+      Headers& response_trailers() { return responseTrailers_; }
+      std::string& response_trailer(const std::string& key) {
+         return response_trailers()[key];
+      }
+
+      enum {
+         DefaultLowWatermark = 16384,
+         DefaultHighWatermark = 65536
+      };
+
+      // Set the queued byte counts at which queue_write() reports
+      // backpressure (high) and async_wait_writable() resumes (low).
+      void set_write_watermarks(size_t low, size_t high) {
+         std::lock_guard<std::mutex> lock(writeMutex_);
+         lowWatermark_ = std::min(low, high);
+         highWatermark_ = high;
+      }
+
+      // Queue body data to be written in order without waiting for
+      // earlier writes; everything queued when a write starts goes out
+      // as one write. Returns false once the bytes queued or in
+      // progress reach the high watermark (the data is still queued),
+      // after which producers should wait with async_wait_writable().
+      // A queued write holds a reference to the transaction until it
+      // completes. Finish with async_finish(), which drains the queue;
+      // finish() and release_stream() fail while bytes are queued.
+      bool queue_write(std::string data) {
+         bool start = false;
+         bool writable;
+         {
+            std::lock_guard<std::mutex> lock(writeMutex_);
+            if (writeError_)
+               return false;
+
+            queuedBytes_ += data.size();
+            if (!data.empty())
+               writeQueue_.push_back(std::move(data));
+            if (!writing_ && !writeQueue_.empty())
+               start = writing_ = true;
+            writable = queuedBytes_ < highWatermark_;
+         }
+
+         if (start)
+            write_queued();
+         return writable;
+      }
+
+      // Invoke the handler when the bytes queued or in progress fall
+      // to the low watermark, or a queued write fails.
+      void async_wait_writable(const Handler& handler) {
+         error_code error;
+         {
+            std::lock_guard<std::mutex> lock(writeMutex_);
+            if (queuedBytes_ > lowWatermark_ && !writeError_) {
+               writeWaiters_.emplace_back(lowWatermark_, handler);
+               return;
+            }
+            error = writeError_;
+         }
+         
+         stream_->get_io_service().post([=]() { handler(error); });
+      }
+
+      // Bytes queued by queue_write() and not yet written.
+      size_t queued_bytes() const {
+         std::lock_guard<std::mutex> lock(writeMutex_);
+         return queuedBytes_;
+      }
+      
+      // Either async_finish() or finish() must be called on each
+      // HTTPTransaction instance to ensure valid I/O on the stream. In
+      // most cases exactly one call should be made with no further
+      // usage of the instance (the exception is for returning 1xx
+      // status).
+      template<typename FinishHandler>
+      void async_finish(FinishHandler&& handler) {
+         // Drain the write queue first.
+         {
+            std::lock_guard<std::mutex> lock(writeMutex_);
+            if (queuedBytes_ && !writeError_) {
+               // Waiters are called from a write completion, which
+               // holds a reference to this transaction.
+               writeWaiters_.emplace_back(0, [=](const error_code&) mutable {
+                     async_finish(handler);
+                  });
+               return;
+            }
+         }
+         
+         // Use shared_ptr lifetime to execute the handler exactly
+         // once when both the final reads and writes (which may
+         // overlap in time) are complete.
+         auto account = account_;
+         auto timer = timer_;
+         std::shared_ptr<error_code> result(new error_code, [=](error_code* pointer) {
+               detail::AccountingScope scope(account.get(), timer.get());
+               handler(*pointer);
+               delete pointer;
+            });
+
+         assert(response_status() >= 100);
+         if (response_status() >= 200) {
+            async_discard([=](const error_code& error) mutable {
+                  // Replace any unused bytes read by get_line().
+                  putback_buffer();
+                  *result = error;
+               });
+         }
+         else
+            putback_buffer();
+         
+         // Output final empty chunk.
+         async_write_some(
+            boost::asio::null_buffers(),
+            [=](const error_code& error, size_t) {
+               CHUNKY_PROBE(response__finish, stream_.get(), responseStatus_, responseBytes_, detail::elapsed_us(requestTime_));
+               finish_state();
+               *result = error;
+            });
+      }
+      
+      // Either async_finish() or finish() must be called on each
+      // HTTPTransaction instance to ensure valid I/O on the stream. In
+      // most cases exactly one call should be made with no further
+      // usage of the instance(the exception is for returning 1xx
+      // status). Throws operation_in_progress if queue_write() data
+      // remain, as the final chunk would be written over them.
+      void finish() {
+         assert(response_status() >= 100);
+         check_write_queue();
+         if (response_status() >= 200) {
+            sync_discard([=](const error_code& error) {
+                  if (error)
+                     throw boost::system::system_error(error);
+               
+                  // Replace any unused bytes read by get_line().
+                  putback_buffer();
+               });
+         }
+         else
+            putback_buffer();
+         
+         // Replace any unused bytes read by get_line().
+         if (auto unused = streambuf_.size()) {
+            stream()->put_back(streambuf_.data());
+            streambuf_.consume(unused);
+         }
+
+         // Output final empty chunk.
+         write_some(boost::asio::null_buffers());
+         CHUNKY_PROBE(response__finish, stream_.get(), responseStatus_, responseBytes_, detail::elapsed_us(requestTime_));
+         finish_state();
+      }
+      
+      // Either async_finish() or finish() must be called on each
+      // HTTPTransaction instance to ensure valid I/O on the stream. In
+      // most cases exactly one call should be made with no further
+      // usage of the instance(the exception is for returning 1xx
+      // status).
+      void finish(error_code& error) {
+         try {
+            finish();
+         }
+         catch (const boost::system::system_error& e) {
+            error = e.code();
+         }
+      }
+
+      // Hand the connection to another protocol (WebSocket, a tunnel,
+      // etc.) in place of finish(), typically after setting 101
+      // Switching Protocols. The response is completed as by
+      // finish(), but bytes already read past the request are moved
+      // to leftover in one contiguous buffer instead of being put
+      // back on the stream, and the new protocol should consume them
+      // before reading from the stream. The server does not read
+      // another request from the connection, and the transaction
+      // must not be used afterwards. Like finish(), fails while
+      // queue_write() data remain.
+      std::shared_ptr<T> release_stream(std::string& leftover) {
+         assert(response_status() >= 100);
+         check_write_queue();
+         if (response_status() >= 200) {
+            sync_discard([=](const error_code& error) {
+                  if (error)
+                     throw boost::system::system_error(error);
+               });
+         }
+
+         write_some(boost::asio::null_buffers());
+         CHUNKY_PROBE(response__finish, stream_.get(), responseStatus_, responseBytes_, detail::elapsed_us(requestTime_));
+         stream_->set_state(Connection::upgraded);
+         released_ = true;
+
+         leftover.assign(
+            boost::asio::buffer_cast<const char*>(streambuf_.data()),
+            streambuf_.size());
+         streambuf_.consume(streambuf_.size());
+         stream_->take_put_back(leftover);
+         return stream_;
+      }
+
+      std::shared_ptr<T> release_stream(std::string& leftover, error_code& error) {
+         try {
+            return release_stream(leftover);
+         }
+         catch (const boost::system::system_error& e) {
+            error = e.code();
+            return stream_;
+         }
+      }
+
+      boost::asio::io_service& get_io_service() {
+         return stream()->get_io_service();
+      }
+      
+      template<typename MutableBufferSequence, typename ReadHandler>
+      void async_read_some(MutableBufferSequence&& buffers, ReadHandler&& handler) {
+         do_async_read_some(buffers, accounted(std::forward<ReadHandler>(handler)));
+      }
+      
+      template<typename ConstBufferSequence, typename WriteHandler>
+      void async_write_some(ConstBufferSequence&& buffers, WriteHandler&& handler) {
+         do_async_write_some(buffers, accounted(std::forward<WriteHandler>(handler)));
+      }
+      
+      template<typename MutableBufferSequence>
+      size_t read_some(MutableBufferSequence&& buffers, error_code& error) {
+         using namespace std::placeholders;
+         auto loadBufferFunc = std::bind(&HTTPTransaction::sync_load_buffer, this, _1, _2);
+         if (requestMethod_.empty()) {
+            create(loadBufferFunc, [&](const error_code& e) {
+                  error = e;
+               });
+            if (error)
+               return 0;
+         }
+         
+         size_t result;
+         auto handler = [&](const error_code& e, size_t n) {
+            error = e;
+            result = n;
+         };
+         
+         // Take data from the streambuf first.
+         size_t nBytesRead = 0;
+         const auto bufferSize = boost::asio::buffer_size(buffers);
+         if (streambuf_.size()) {
+            auto nBytes = boost::asio::buffer_copy(buffers, streambuf_.data(), requestBytes_);
+            streambuf_.consume(nBytes);
+            requestBytes_ -= nBytes;
+            nBytesRead += nBytes;
+         }
+
+         // Jump through some hoops to make the inner lambda exactly
+         // the same as async_read_some().
+         stream_->start_timeout(ConnectionTimeouts::body_read);
+         size_t nBytes = boost::asio::read(
+            *stream(),
+            buffers,
+            boost::asio::transfer_exactly(nBytesRead ? 0 : requestBytes_),
+            error);
+         [=](const std::function<void(const error_code&, size_t)>& f) {
+            f(error, nBytes);
+         }([=](const error_code& error, size_t nBytes) mutable {
+               stream_->stop_timeout(ConnectionTimeouts::body_read);
+               if (error) {
+                  handler(error, nBytesRead);
+                  return;
+               }
+
+               // Read the chunk delimiter and next chunk header if chunked.
+               requestBytes_ -= nBytes;
+               nBytesRead += nBytes;
+               if (bufferSize && requestChunksPending_ && !requestBytes_) {
+                  using namespace std::placeholders;
+                  loadBufferFunc(crlf(), [=](const error_code& error) mutable {
+                        if (error) {
+                           handler(error, nBytesRead);
+                           return;
+                        }
+                        
+                        std::string s = get_line();
+                        if (!s.empty()) {
+                           handler(make_error_code(invalid_chunk_delimiter), nBytesRead);
+                           return;
+                        }
+                        
+                        read_chunk_header(
+                           loadBufferFunc,
+                           [=](const error_code& error) mutable {
+                              handler(error, nBytesRead);
+                           });
+                     });
+               }
+               else {
+                  error_code error;
+                  if (nBytesRead == 0 && bufferSize > 0)
+                     error = make_error_code(boost::asio::error::eof);
+                  handler(error, nBytesRead);
+               }
+            });
+
+         return result;
+      }
+
+      template<typename MutableBufferSequence>
+      size_t read_some(MutableBufferSequence&& buffers) {
+         error_code error;
+         size_t nBytes = read_some(buffers, error);
+         if (error)
+            throw boost::system::system_error(error);
+         return nBytes;
+      }
+
+      // View of the request body bytes already buffered (through the
+      // end of the current chunk, if chunked) for parsing in place.
+      // The view is valid until the next read or consume().
+      boost::asio::const_buffers_1 buffered_body() const {
+         return boost::asio::const_buffers_1(
+            boost::asio::buffer_cast<const char*>(streambuf_.data()),
+            std::min(streambuf_.size(), requestBytes_));
+      }
+
+      // Remove bytes from the front of buffered_body(), as if read.
+      void consume(size_t nBytes) {
+         assert(nBytes <= boost::asio::buffer_size(buffered_body()));
+         streambuf_.consume(nBytes);
+         requestBytes_ -= nBytes;
+      }
+
+      // Asynchronously read the rest of the request body as one
+      // contiguous buffer, failing with body_too_large if it exceeds
+      // maxBytes. A body already buffered with the request head is
+      // viewed in place. Otherwise storage is allocated once from
+      // Content-Length (or grown for chunked bodies) and the body is
+      // read into it. The view is valid until the next read.
+      void async_read_body(size_t maxBytes, const BodyHandler& handler) {
+         if (requestChunksPending_) {
+            body_.clear();
+            read_chunked_body(maxBytes, 0, handler);
+            return;
+         }
+
+         // Results known now are posted, so the handler never runs
+         // inside this call.
+         auto completion = accounted(handler);
+         const size_t nBytes = requestBytes_;
+         if (nBytes > maxBytes) {
+            stream_->get_io_service().post([=]() {
+                  completion(make_error_code(body_too_large), boost::asio::const_buffer());
+               });
+            return;
+         }
+
+         // Consuming leaves the bytes in place until the next read.
+         if (streambuf_.size() >= nBytes) {
+            const boost::asio::const_buffer body(
+               boost::asio::buffer_cast<const char*>(streambuf_.data()), nBytes);
+            consume(nBytes);
+            stream_->get_io_service().post([=]() { completion(error_code(), body); });
+            return;
+         }
+
+         body_.resize(nBytes);
+         boost::asio::async_read(
+            *this, boost::asio::buffer(body_),
+            [=](const error_code& error, size_t nBytes) {
+               handler(error, boost::asio::const_buffer(body_.data(), nBytes));
+            });
+      }
+
+      template<typename ConstBufferSequence>
+      size_t write_some(ConstBufferSequence&& buffers, error_code& error) {
+         // Add prefix (response line, response headers, and chunk
+         // header) and suffix (chunk delimiter) around the client
+         // buffers.
+         auto nBytes = boost::asio::buffer_size(buffers);
+         auto chunk = std::make_shared<std::vector<boost::asio::const_buffer> >();
+         
+         write_state();
+         auto prefix = std::make_shared<std::string>(prepare_write_prefix(nBytes));
+         if (!prefix->empty())
+            chunk->push_back(boost::asio::const_buffer(prefix->data(), prefix->size()));
+
+         for (const auto& buffer : buffers)
+            chunk->push_back(boost::asio::const_buffer(buffer));
+         
+         auto suffix = std::make_shared<std::string>(prepare_write_suffix(nBytes));
+         if (!suffix->empty())
+            chunk->push_back(boost::asio::const_buffer(suffix->data(), suffix->size()));
+
+         boost::asio::write(*stream(), *chunk, error);
+         responseBytes_ += nBytes;
+         CHUNKY_PROBE(response__write, stream_.get(), nBytes, responseStatus_);
+         return nBytes;
+      }
+      
+      template<typename ConstBufferSequence>
+      size_t write_some(ConstBufferSequence&& buffers) {
+         error_code error;
+         size_t nBytes = write_some(buffers, error);
+         if (error)
+            throw boost::system::system_error(error);
+         return nBytes;
+      }
+
+      std::shared_ptr<T>& stream() {
+         return stream_;
+      }
+
+      // Set or get the internal buffer size for all subsequent
+      // HTTPTransaction instances. If the request line and headers
+      // exceed this size then a read error will be returned.
+      static size_t buffer_size(size_t nBytes = 0) {
+         static size_t bufferSize = 10486376;
+         if (nBytes)
+            bufferSize = nBytes;
+         return bufferSize;
+      }
+      
+      // Convert '+' to ' ' and percent decoding.
+      template<typename Iterator>
+      static std::string decode(Iterator&& bgn, Iterator&& end) {
+         std::string result;
+
+         auto i = bgn;
+         std::smatch escapeMatch;
+         static std::regex escapeRegex("^([^+%]*)(?:\\+|(?:%([0-9A-Fa-f]{2})))");
+         while (i != end) {
+            // Look for a '+' or '%HH' where H is a valid hex digit.
+            if (std::regex_search(i, end, escapeMatch, escapeRegex)) {
+               // Concatenate everything up to the special character.
+               result += escapeMatch[1].str();
+
+               // Concatenate the unescaped character.
+               if (escapeMatch[2].matched)
+                  result += static_cast<char>(std::stoi(escapeMatch[2].str(), 0, 16));
+               else
+                  result += ' ';
+
+               // Update the iterator.
+               i = escapeMatch[0].second;
+            }
+            else {
+               // No matches so concatenate the remainder.
+               result += std::string(i, end);
+               i = end;
+            }
+         }
+         
+         return result;
+      }
+
+      static Query parse_query(const std::string& s) {
+         Query query;
+
+         auto i = s.begin();
+         std::smatch paramMatch;
+         static std::regex paramRegex("^([^=&]+)(=)?([^&]*)&?");
+         while (std::regex_search(i, s.end(), paramMatch, paramRegex)) {
+            if (paramMatch[2].matched) {
+               std::string key = decode(paramMatch[1].first, paramMatch[1].second);
+               std::string value = decode(paramMatch[3].first, paramMatch[3].second);
+               query[key] = value;
+            }
+            
+            i = paramMatch[0].second;
+         }
+
+         return query;
+      }
+      
+   private:
+      template<typename, typename> friend class BaseHTTPServer;
+      enum { MaxDiscardBufferSize = 65536 };
+      
+      std::shared_ptr<T> stream_;
+      boost::asio::streambuf streambuf_;
+      
+      std::string requestMethod_;
+      std::string requestVersion_;
+      std::string requestResource_;
+      Headers requestHeaders_;
+
+      std::string requestPath_;
+      std::string requestFragment_;
+      Query requestQuery_;
+      detail::Clock::time_point requestTime_;
+      
+      size_t requestBytes_;
+      bool requestChunksPending_;
+      
+      unsigned int responseStatus_;
+      Headers responseHeaders_;
+      Headers responseTrailers_;
+
+      size_t responseBytes_;
+      bool responseChunked_;
+      bool released_;
+
+      // Storage for async_read_body().
+      std::vector<char> body_;
+
+      // Route totals charged with this transaction's handlers, if
+      // the server has accounting enabled.
+      std::shared_ptr<detail::RouteAccount> account_;
+
+      // Timer for this transaction's handlers, if the server has a
+      // LoopMonitor.
+      std::shared_ptr<detail::HandlerTimer> timer_;
+
+      // Output queue for queue_write().
+      mutable std::mutex writeMutex_;
+      std::vector<std::string> writeQueue_;
+      std::vector<std::string> writeBatch_;
+      std::vector<boost::asio::const_buffer> writeBuffers_;
+      size_t queuedBytes_;
+      bool writing_;
+      error_code writeError_;
+      std::vector<std::pair<size_t, Handler> > writeWaiters_;
+      size_t lowWatermark_;
+      size_t highWatermark_;
+
+      static const std::string& crlf() {
+         static const std::string s("\r\n");
+         return s;
+      }
+
+      static const std::string& crlf2() {
+         static const std::string s("\r\n\r\n");
+         return s;
+      }
+
+      // Synchronous completion cannot wait for queued writes, which
+      // finish on an I/O thread (possibly this one).
+      void check_write_queue() {
+         if (queued_bytes())
+            throw boost::system::system_error(
+               make_error_code(boost::system::errc::operation_in_progress));
+      }
+
+      // Write everything in the queue, then continue while more is
+      // queued. Waiters are notified as the queue drains.
+      void write_queued() {
+         // Only one write is in progress, so the batch and buffer
+         // vectors (and their capacity) are reused.
+         {
+            std::lock_guard<std::mutex> lock(writeMutex_);
+            writeBatch_.swap(writeQueue_);
+         }
+
+         size_t nBatchBytes = 0;
+         writeBuffers_.clear();
+         for (const auto& data : writeBatch_) {
+            writeBuffers_.push_back(boost::asio::buffer(data));
+            nBatchBytes += data.size();
+         }
+         
+         auto this_ = this->shared_from_this();
+         async_write_some(detail::BufferView(writeBuffers_), [=](const error_code& error, size_t) {
+               this_->writeBatch_.clear();
+               
+               std::vector<Handler> ready;
+               bool more;
+               {
+                  std::lock_guard<std::mutex> lock(writeMutex_);
+                  queuedBytes_ -= nBatchBytes;
+                  if (error) {
+                     writeError_ = error;
+                     writeQueue_.clear();
+                     queuedBytes_ = 0;
+                  }
+
+                  auto i = writeWaiters_.begin();
+                  while (i != writeWaiters_.end()) {
+                     if (error || queuedBytes_ <= i->first) {
+                        ready.push_back(std::move(i->second));
+                        i = writeWaiters_.erase(i);
+                     }
+                     else
+                        ++i;
+                  }
+
+                  more = writing_ = !writeQueue_.empty();
+               }
+
+               if (more)
+                  write_queued();
+               for (auto& handler : ready)
+                  handler(error);
+            });
+      }
+      
+      template<typename Handler>
+      detail::AccountedHandler<typename std::decay<Handler>::type> accounted(Handler&& handler) {
+         return { account_, timer_, std::forward<Handler>(handler) };
+      }
+      
+      template<typename MutableBufferSequence, typename ReadHandler>
+      void do_async_read_some(const MutableBufferSequence& buffers, const ReadHandler& handler) {
+         using namespace std::placeholders;
+         auto loadBufferFunc = std::bind(&HTTPTransaction::async_load_buffer, this, _1, _2);
+         if (requestMethod_.empty()) {
+            create(loadBufferFunc, [=](const error_code& error) mutable {
+                  if (error) {
+                     handler(error, 0);
+                     return;
+                  }
+
+                  do_async_read_some(buffers, handler);
+               });
+            return;
+         }
+         
+         // Take data from the streambuf first.
+         size_t nBytesRead = 0;
+         const auto bufferSize = boost::asio::buffer_size(buffers);
+         if (streambuf_.size()) {
+            auto nBytes = boost::asio::buffer_copy(buffers, streambuf_.data(), requestBytes_);
+            streambuf_.consume(nBytes);
+            requestBytes_ -= nBytes;
+            nBytesRead += nBytes;
+         }
+
+         stream_->start_timeout(ConnectionTimeouts::body_read);
+         boost::asio::async_read(
+            *stream(), buffers, boost::asio::transfer_exactly(nBytesRead ? 0 : requestBytes_),
+            [=](const error_code& error, size_t nBytes) mutable {
+               stream_->stop_timeout(ConnectionTimeouts::body_read);
+               if (error) {
+                  handler(error, nBytesRead);
+                  return;
+               }
+
+               // Read the chunk delimiter and next chunk header if chunked.
+               requestBytes_ -= nBytes;
+               nBytesRead += nBytes;
                if (bufferSize && requestChunksPending_ && !requestBytes_) {
                   loadBufferFunc(crlf(), [=](const error_code& error) mutable {
                         if (error) {
-                           handler(error, nBytesRead);
-                           return;
-                        }
-                        
-                        std::string s = get_line();
-                        if (!s.empty()) {
-                           handler(make_error_code(invalid_chunk_delimiter), nBytesRead);
+                           handler(error, nBytesRead);
+                           return;
+                        }
+                        
+                        std::string s = get_line();
+                        if (!s.empty()) {
+                           handler(make_error_code(invalid_chunk_delimiter), nBytesRead);
+                           return;
+                        }
+                        
+                        read_chunk_header(
+                           loadBufferFunc,
+                           [=](const error_code& error) mutable {
+                              handler(error, nBytesRead);
+                           });
+                     });
+               }
+               else {
+                  error_code error;
+                  if (nBytesRead == 0 && bufferSize > 0)
+                     error = make_error_code(boost::asio::error::eof);
+                  handler(error, nBytesRead);
+               }
+            });
+      }
+
+      template<typename ConstBufferSequence, typename WriteHandler>
+      void do_async_write_some(const ConstBufferSequence& buffers, const WriteHandler& handler) {
+         // Add prefix (response line, response headers, and chunk
+         // header) and suffix (chunk delimiter) around the client
+         // buffers.
+         auto nBytes = boost::asio::buffer_size(buffers);
+         auto chunk = std::make_shared<std::vector<boost::asio::const_buffer> >();
+         
+         write_state();
+         auto prefix = std::make_shared<std::string>(prepare_write_prefix(nBytes));
+         if (!prefix->empty())
+            chunk->push_back(boost::asio::const_buffer(prefix->data(), prefix->size()));
+
+         for (const auto& buffer : buffers)
+            chunk->push_back(boost::asio::const_buffer(buffer));
+         
+         auto suffix = std::make_shared<std::string>(prepare_write_suffix(nBytes));
+         if (!suffix->empty())
+            chunk->push_back(boost::asio::const_buffer(suffix->data(), suffix->size()));
+
+         boost::asio::async_write(
+            *stream(), *chunk,
+            [=](const error_code& error, size_t) mutable {
+               if (error) {
+                  handler(error, 0);
+                  return;
+               }
+
+               responseBytes_ += nBytes;
+               CHUNKY_PROBE(response__write, stream_.get(), nBytes, responseStatus_);
+               handler(error, nBytes);
+
+               // References for lifetime extension.
+               prefix.get();
+               suffix.get();
+               chunk.get();
+            });
+      }
+      
+      // Read chunks into body_ until the terminating chunk.
+      void read_chunked_body(size_t maxBytes, size_t nBodyBytes, const BodyHandler& handler) {
+         if (nBodyBytes == body_.size()) {
+            if (nBodyBytes > maxBytes) {
+               handler(make_error_code(body_too_large), boost::asio::const_buffer());
+               return;
+            }
+            // Leave room to detect a body over maxBytes, without
+            // wrapping when maxBytes is SIZE_MAX (no limit).
+            const size_t limit = maxBytes == std::numeric_limits<size_t>::max() ? maxBytes : maxBytes + 1;
+            body_.resize(std::min(std::max<size_t>(2 * nBodyBytes, 4096), limit));
+         }
+
+         async_read_some(
+            boost::asio::buffer(&body_[nBodyBytes], body_.size() - nBodyBytes),
+            [=](const error_code& error, size_t nBytes) {
+               if (error == boost::asio::error::eof) {
+                  handler(error_code(), boost::asio::const_buffer(body_.data(), nBodyBytes));
+                  return;
+               }
+               
+               if (error) {
+                  handler(error, boost::asio::const_buffer());
+                  return;
+               }
+               read_chunked_body(maxBytes, nBodyBytes + nBytes, handler);
+            });
+      }
+      
+      // Asynchronously guarantee that the body buffer contains the
+      // delimiter. This allows subsequent synchronous read_until()
+      // calls to succeed without blocking.
+      void async_load_buffer(const std::string& delimiter, const Handler& handler) {
+         boost::asio::async_read_until(
+            *stream(), streambuf_, delimiter,
+            [=](const error_code& error, size_t) {
+               handler(error);
+            });
+      }
+
+      // Synchronously guarantee that the body buffer contains the
+      // delimiter.
+      void sync_load_buffer(const std::string& delimiter, const Handler& handler) {
+         error_code error;
+         boost::asio::read_until(*stream(), streambuf_, delimiter, error);
+         handler(error);
+      }
+
+      void putback_buffer() {
+         if (auto unused = streambuf_.size()) {
+            stream()->put_back(streambuf_.data());
+            streambuf_.consume(unused);
+         }
+      }
+      
+      // Asynchronously discard any unread body.
+      void async_discard(const Handler& handler) {
+         if (requestBytes_) {
+            auto bufferSize = std::min(requestBytes_, static_cast<size_t>(MaxDiscardBufferSize));
+            auto buffer = std::make_shared<std::vector<char> >(bufferSize);
+            boost::asio::async_read(
+               *this, boost::asio::buffer(*buffer),
+               boost::asio::transfer_exactly(requestBytes_),
+               [=](const error_code& error, size_t) {
+                  if (error) {
+                     handler(error);
+                     return;
+                  }
+
+                  async_discard(handler);
+                  buffer.get();
+               });
+         }
+         else
+            handler(error_code());
+      }
+
+      // Synchronously discard any unread body.
+      void sync_discard(const Handler& handler) {
+         while (requestBytes_) {
+            error_code error;
+            auto bufferSize = std::min(requestBytes_, static_cast<size_t>(MaxDiscardBufferSize));
+            auto buffer = std::make_shared<std::vector<char> >(bufferSize);
+            boost::asio::read(
+               *this, boost::asio::buffer(*buffer),
+               boost::asio::transfer_exactly(requestBytes_),
+               error);
+            if (error) {
+               handler(error);
+               return;
+            }
+
+            buffer.get();
+         }
+
+         handler(error_code());
+      }
+
+      // Get the next line (through CRLF) from the underlying stream.
+      // The read is via the streambuf so it should not block if
+      // the buffer has previously been loaded.
+      std::string get_line() {
+         auto nBytes = boost::asio::read_until(*stream(), streambuf_, crlf());
+         auto i = boost::asio::buffers_begin(streambuf_.data());
+         std::string s(i, i + nBytes - crlf().size());
+         streambuf_.consume(nBytes);
+         return s;
+      }
+
+      // Common synchronous/asynchronous create() helper.
+      typedef std::function<void(const std::string&, const Handler&)> LoadBufferFunc;
+      void create(const LoadBufferFunc& loadBufferFunc, const Handler& handler) {
+         loadBufferFunc(crlf2(), [=](const error_code& error) {
+               if (error) {
+                  handler(error);
+                  return;
+               }
+               
+               if (error_code error = read_request_line()) {
+                  handler(error);
+                  return;
+               }
+                  
+               if (error_code error = read_request_headers()) {
+                  handler(error);
+                  return;
+               }
+
+               requestTime_ = detail::probe_now(CHUNKY_PROBE_ENABLED(response__finish));
+               CHUNKY_PROBE(request__head, stream_.get(), requestMethod_.c_str(), requestPath_.c_str());
+               stream_->set_path(requestPath_);
+               
+               read_length(loadBufferFunc, [=](const error_code& error) {
+                     handler(error);
+                  });
+            });
+      }
+
+      error_code read_request_line() {
+         std::smatch requestMatch;
+         static const std::regex requestRegex("([-!#$%^&*+._'`|~0-9A-Za-z]+) (\\S+) (HTTP/\\d\\.\\d)");
+         if (!std::regex_match(get_line(), requestMatch, requestRegex))
+            return make_error_code(invalid_request_line);
+         
+         requestMethod_   = requestMatch[1];
+         requestResource_ = requestMatch[2];
+         requestVersion_  = requestMatch[3];
+
+         if (requestVersion_ != "HTTP/1.1")
+            return make_error_code(unsupported_http_version);
+
+         std::smatch resourceMatch;
+         static const std::regex resourceRegex("(/[^?#]*)(?:\\?([^#]*))?(?:#(.*))?");
+         if (std::regex_match(requestResource_, resourceMatch, resourceRegex)) {
+            requestPath_ = decode(resourceMatch[1].first, resourceMatch[1].second);
+            requestFragment_ = decode(resourceMatch[3].first, resourceMatch[3].second);
+            requestQuery_ = parse_query(resourceMatch[2].str());
+         }
+         
+         return error_code();
+      }
+
+      error_code read_request_headers() {
+         for (auto s = get_line(); !s.empty(); s = get_line()) {
+            const auto colon = s.find_first_of(':');
+            if (colon == std::string::npos)
+               return make_error_code(invalid_request_header);
+
+            std::string key = s.substr(0, colon);
+            std::string value = s.substr(colon + 1);
+            boost::algorithm::trim_left(value);
+
+            // Coalesce values with the same key.
+            const auto i = requestHeaders_.find(key);
+            if (i != requestHeaders_.end()) {
+               i->second += ", ";
+               i->second += value;
+            }
+            else
+               requestHeaders_.insert({{std::move(key), std::move(value)}});
+         }
+
+         return error_code();
+      }
+      
+      void read_length(const LoadBufferFunc& loadBufferFunc, const Handler& handler) {
+         auto contentLength = requestHeaders_.find("content-length");
+         if (contentLength != requestHeaders_.end()) {
+            boost::iostreams::filtering_istream is(
+               boost::make_iterator_range(
+                  contentLength->second.begin(),
+                  contentLength->second.end()));
+            is >> requestBytes_;
+            if (!is) {
+               handler(make_error_code(invalid_content_length));
+               return;
+            }
+         }
+         
+         auto transferEncoding = requestHeaders_.find("transfer-encoding");
+         if (transferEncoding != requestHeaders_.end() &&
+             transferEncoding->second != "identity") {
+            requestBytes_ = 0U;
+            requestChunksPending_ = true;
+            read_chunk_header(loadBufferFunc, handler);
+         }
+         else
+            handler(error_code());
+      }
+
+      void read_chunk_header(const LoadBufferFunc& loadBufferFunc, const Handler& handler) {
+         assert(requestBytes_ == 0);
+         assert(requestChunksPending_);
+         loadBufferFunc(crlf(), [=](const error_code& error) {
+               if (error) {
+                  handler(error);
+                  return;
+               }
+                  
+               // Chunk header begins with a hexadecimal chunk length.
+               std::istringstream is(get_line());
+               is >> std::hex >> requestBytes_;
+               if (!is) {
+                  handler(make_error_code(invalid_chunk_length));
+                  return;
+               }
+               CHUNKY_PROBE(chunk__decode, stream_.get(), requestBytes_);
+               
+               if (!requestBytes_) {
+                  requestChunksPending_ = false;
+
+                  // Read trailers after the terminating chunk. The
+                  // trailers end with an empty line, i.e. consecutive
+                  // CRLF, but when there are no trailers we have
+                  // already consumed the first CRLF. We restore it
+                  // before loading the buffer through the empty line.
+                  streambuf_.sungetc();
+                  streambuf_.sungetc();
+                  loadBufferFunc(crlf2(), [=](const error_code& error) {
+                        if (error) {
+                           handler(error);
                            return;
                         }
-                        
-                        read_chunk_header(
-                           loadBufferFunc,
-                           [=](const error_code& error) mutable {
-                              handler(error, nBytesRead);
-                           });
+
+                        // Skip the restored CRLF to position the
+                        // stream at the start of trailers.
+                        streambuf_.snextc();
+                        streambuf_.snextc();
+                        handler(read_request_headers());
+                     });
+               }
+               else
+                  handler(error);
+            });
+      }
+
+      // Update the connection state for introspection.
+      void write_state() {
+         if (stream_->state() == Connection::in_handler)
+            stream_->set_state(Connection::writing);
+      }
+      
+      void finish_state() {
+         if (responseStatus_ >= 200)
+            stream_->set_state(responseStatus_ == 101 ? Connection::upgraded : Connection::idle);
+      }
+      
+      std::string prepare_write_prefix(size_t nBytes) {
+         // The prefix includes the status line and headers if this is
+         // the first write.
+         std::ostringstream os;
+         if (responseBytes_ == 0) {
+            // Set Date header if not already present.
+            if (response_headers().find("date") == response_headers().end()) {
+               std::time_t t;
+               std::time(&t);
+               std::tm tm = *std::gmtime(&t);
+               char s[30];
+               auto n = strftime(s, sizeof(s), "%a, %d %b %Y %T GMT", &tm);
+               response_header("Date") = std::string(s, n);
+            }
+
+            // RFC 2616 section 4.4:
+            //  Any response message which "MUST NOT" include a
+            //  message-body (such as the 1xx, 204, and 304 responses
+            //  and any response to a HEAD request) is always
+            //  terminated by the first empty line after the header
+            //  fields, regardless of the entity-header fields present
+            //  in the message.
+            auto status = response_status();
+            static const std::string head = "HEAD";
+            if (status >= 200 && status != 204 && status != 304 &&
+                request_method() != head) {
+               // Determine whether to use chunked transfer.
+               auto transferEncoding = response_headers().find("transfer-encoding");
+               if (transferEncoding != response_headers().end() &&
+                   transferEncoding->second != "identity") {
+                  responseChunked_ = true;
+                  response_headers().erase("content-length");
+               }
+               else if (response_headers().count("content-length") == 0) {
+                  responseChunked_ = true;
+                  response_header("Transfer-Encoding") = "chunked";
+               }
+            }
+
+            write_status(os);
+            write_headers(os, response_headers());
+         }
+
+         if (responseChunked_)
+            os << boost::format("%x%s") % nBytes % crlf();
+         
+         return os.str();
+      }
+
+      std::string prepare_write_suffix(size_t nBytes) {
+         std::ostringstream os;
+         if (responseChunked_) {
+            // Add crlf to all chunks except the final one.
+            if (nBytes)
+               os << crlf();
+            else
+               write_headers(os, response_trailers());
+         }
+
+         return os.str();
+      }
+
+      void write_status(std::ostream& os) {
+         os << boost::format("HTTP/1.1 %d %s%s")
+            % responseStatus_
+            % detail::reason_phrase(responseStatus_)
+            % crlf();
+      }
+
+      void write_headers(std::ostream& os, const Headers& headers) {
+         for (const auto& value : headers) {
+            os << boost::format("%s: %s%s")
+               % value.first
+               % value.second
+               % crlf();
+         }
+         os << crlf();
+      }
+   };
+   
+   typedef HTTPTransaction<TCP> HTTP;
+#ifdef BOOST_ASIO_SSL_HPP
+   typedef HTTPTransaction<TLS> HTTPS;
+#endif
+
+   // Incremental multipart/form-data (RFC 7578) decoder over a fixed
+   // buffer, for streaming uploads in constant memory. Each read
+   // fills the buffer and next() then yields each part's headers,
+   // its body as fragments viewed in place, and its end. Boundaries
+   // are located with a Boyer-Moore-Horspool search, which skips
+   // ahead by up to the delimiter length per comparison.
+   //
+   // Usage:
+   //   http->async_read_some(reader.prepare(), ...);
+   //   reader.commit(nBytes);
+   //   while (reader.next(event, error))
+   //      ...
+   // or async_read_multipart() below.
+   class MultipartReader : boost::noncopyable {
+   public:
+      typedef std::map<std::string, std::string, detail::CaselessCompare> Headers;
+
+      enum {
+         DefaultCapacity = 65536
+      };
+
+      enum EventType {
+         part_begin,            // headers() holds the part headers
+         part_data,             // data and size view body bytes
+         part_end,
+         finished               // the closing delimiter was read
+      };
+      
+      struct Event {
+         EventType type;
+         const char* data;
+         size_t size;
+      };
+      
+      explicit MultipartReader(const std::string& boundary, size_t capacity = DefaultCapacity)
+         : delimiter_("\r\n--" + boundary)
+         , buffer_(std::max<size_t>(capacity, 4 * delimiter_.size()))
+         , begin_(0)
+         , end_(0)
+         , state_(preamble) {
+         // The first delimiter may start the body, so begin with the
+         // CRLF that precedes the others.
+         buffer_[end_++] = '\r';
+         buffer_[end_++] = '\n';
+         
+         const size_t m = delimiter_.size();
+         std::fill(std::begin(skip_), std::end(skip_), m);
+         for (size_t i = 0; i + 1 < m; ++i)
+            skip_[static_cast<unsigned char>(delimiter_[i])] = m - 1 - i;
+      }
+
+      // Get the boundary from a Content-Type header value, or an empty
+      // string if it is not multipart.
+      static std::string boundary(const std::string& contentType) {
+         if (!boost::istarts_with(contentType, "multipart/"))
+            return std::string();
+         return parameter(contentType, "boundary");
+      }
+
+      // Get a parameter from a header value such as Content-Type or
+      // Content-Disposition, e.g. parameter(value, "filename").
+      static std::string parameter(const std::string& value, const std::string& name) {
+         size_t i = value.find(';');
+         while (i != std::string::npos) {
+            size_t begin = value.find_first_not_of(" \t", i + 1);
+            size_t equals = value.find('=', begin);
+            if (begin == std::string::npos || equals == std::string::npos)
+               break;
+
+            std::string key = value.substr(begin, equals - begin);
+            boost::algorithm::trim(key);
+            std::string result;
+            if (equals + 1 < value.size() && value[equals + 1] == '"') {
+               for (i = equals + 2; i < value.size() && value[i] != '"'; ++i) {
+                  if (value[i] == '\\' && i + 1 < value.size())
+                     ++i;
+                  result.push_back(value[i]);
+               }
+               i = value.find(';', i);
+            }
+            else {
+               i = value.find(';', equals);
+               result = value.substr(equals + 1, i == std::string::npos ? i : i - equals - 1);
+               boost::algorithm::trim(result);
+            }
+
+            if (boost::iequals(key, name))
+               return result;
+         }
+         return std::string();
+      }
+      
+      // Get the buffer for the next read.
+      boost::asio::mutable_buffers_1 prepare() {
+         if (begin_) {
+            std::memmove(&buffer_[0], &buffer_[begin_], end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+         }
+         return boost::asio::mutable_buffers_1(&buffer_[end_], buffer_.size() - end_);
+      }
+
+      // Add bytes read into the prepare() buffer.
+      void commit(size_t nBytes) {
+         end_ += nBytes;
+      }
+
+      // Decode the next event, returning false if more data are
+      // needed, after the finished event, or on error. Data views are
+      // valid until the next prepare().
+      bool next(Event& event, boost::system::error_code& error) {
+         error = boost::system::error_code();
+         event.data = nullptr;
+         event.size = 0;
+         const size_t m = delimiter_.size();
+         switch (state_) {
+         case preamble:
+            {
+               const size_t i = find_delimiter();
+               if (i == std::string::npos) {
+                  // Keep only what could begin a delimiter.
+                  begin_ = std::max(begin_, end_ - std::min(end_ - begin_, m - 1));
+                  return false;
+               }
+               begin_ += i + m;
+               state_ = delimiter;
+               return next(event, error);
+            }
+         case delimiter:
+            {
+               // Skip transport padding, then expect CRLF or "--".
+               while (begin_ < end_ && (buffer_[begin_] == ' ' || buffer_[begin_] == '\t'))
+                  ++begin_;
+               if (end_ - begin_ < 2)
+                  return fail_if_full(error);
+
+               if (buffer_[begin_] == '-' && buffer_[begin_ + 1] == '-') {
+                  begin_ = end_;
+                  state_ = done;
+                  event.type = finished;
+                  return true;
+               }
+               if (buffer_[begin_] != '\r' || buffer_[begin_ + 1] != '\n')
+                  return fail(error);
+               begin_ += 2;
+               state_ = head;
+               return next(event, error);
+            }
+         case head:
+            {
+               // Headers end with an empty line, which is the whole
+               // block for a part without headers.
+               const char* data = &buffer_[begin_];
+               const size_t nAvailable = end_ - begin_;
+               size_t nHeadBytes;
+               if (nAvailable >= 2 && data[0] == '\r' && data[1] == '\n')
+                  nHeadBytes = 2;
+               else {
+                  static const char crlf2[] = "\r\n\r\n";
+                  const char* found = std::search(data, data + nAvailable, crlf2, crlf2 + 4);
+                  if (found == data + nAvailable)
+                     return fail_if_full(error);
+                  nHeadBytes = found - data + 4;
+               }
+
+               if (!parse_headers(data, nHeadBytes))
+                  return fail(error);
+               begin_ += nHeadBytes;
+               state_ = body;
+               event.type = part_begin;
+               return true;
+            }
+         case body:
+            {
+               const size_t i = find_delimiter();
+               if (i == 0) {
+                  begin_ += m;
+                  state_ = delimiter;
+                  event.type = part_end;
+                  return true;
+               }
+
+               // Deliver data up to the delimiter or, without one, all
+               // but what could begin a delimiter.
+               size_t nBytes = i;
+               if (i == std::string::npos) {
+                  const size_t nAvailable = end_ - begin_;
+                  if (nAvailable < m)
+                     return false;
+                  nBytes = nAvailable - (m - 1);
+               }
+               event.type = part_data;
+               event.data = &buffer_[begin_];
+               event.size = nBytes;
+               begin_ += nBytes;
+               return true;
+            }
+         case done:
+            begin_ = end_;
+            return false;
+         case invalid:
+            error = make_error_code(invalid_multipart);
+            return false;
+         }
+         return false;
+      }
+
+      // Headers of the current part.
+      const Headers& headers() const { return headers_; }
+
+      bool is_finished() const { return state_ == done; }
+      
+   private:
+      enum State {
+         preamble,
+         delimiter,
+         head,
+         body,
+         done,
+         invalid
+      };
+      
+      const std::string delimiter_;
+      std::vector<char> buffer_;
+      size_t begin_;
+      size_t end_;
+      State state_;
+      size_t skip_[256];
+      Headers headers_;
+
+      // Horspool search for the delimiter in the unread bytes,
+      // returning its offset or npos.
+      size_t find_delimiter() const {
+         const size_t m = delimiter_.size();
+         const char* data = &buffer_[begin_];
+         const size_t n = end_ - begin_;
+         const char last = delimiter_[m - 1];
+         for (size_t i = 0; i + m <= n; i += skip_[static_cast<unsigned char>(data[i + m - 1])]) {
+            if (data[i + m - 1] == last && std::memcmp(data + i, delimiter_.data(), m - 1) == 0)
+               return i;
+         }
+         return std::string::npos;
+      }
+
+      bool parse_headers(const char* data, size_t nBytes) {
+         headers_.clear();
+         const char* end = data + nBytes - 2;
+         while (data < end) {
+            const char* eol = std::search(data, end + 2, "\r\n", "\r\n" + 2);
+            const char* colon = std::find(data, eol, ':');
+            if (colon == eol)
+               return false;
+
+            std::string key(data, colon);
+            std::string value(colon + 1, eol);
+            boost::algorithm::trim(value);
+            headers_[key] = value;
+            data = eol + 2;
+         }
+         return true;
+      }
+
+      bool fail(boost::system::error_code& error) {
+         state_ = invalid;
+         error = make_error_code(invalid_multipart);
+         return false;
+      }
+
+      // Fail if more data cannot fit in the buffer.
+      bool fail_if_full(boost::system::error_code& error) {
+         if (begin_ == 0 && end_ == buffer_.size())
+            return fail(error);
+         return false;
+      }
+   };
+
+   // Decode a multipart request body, calling the event handler for
+   // each MultipartReader event and then the completion handler once.
+   // A body that ends before the closing delimiter fails with
+   // invalid_multipart.
+   template<typename T>
+   void async_read_multipart(
+      const std::shared_ptr<HTTPTransaction<T> >& http,
+      const std::shared_ptr<MultipartReader>& reader,
+      const std::function<void(const MultipartReader::Event&)>& eventHandler,
+      const std::function<void(const boost::system::error_code&)>& handler) {
+      http->async_read_some(
+         reader->prepare(),
+         [=](const boost::system::error_code& error, size_t nBytes) {
+            if (error) {
+               handler(error == boost::asio::error::eof ? make_error_code(invalid_multipart) : error);
+               return;
+            }
+
+            reader->commit(nBytes);
+            MultipartReader::Event event;
+            boost::system::error_code readerError;
+            while (reader->next(event, readerError))
+               eventHandler(event);
+
+            if (readerError)
+               handler(readerError);
+            else if (reader->is_finished())
+               handler(boost::system::error_code());
+            else
+               async_read_multipart(http, reader, eventHandler, handler);
+         });
+   }
+
+   // Threads for blocking file I/O, so that disk stalls delay only
+   // the transfers waiting on them and not the I/O threads serving
+   // connections. The pool must not be released by one of its own
+   // threads; async_receive_to_file() releases its reference on the
+   // connection's io_service, so a temporary pool may be passed.
+   class FileIOPool : boost::noncopyable {
+   public:
+      static std::shared_ptr<FileIOPool> create(size_t nThreads = 2) {
+         return std::shared_ptr<FileIOPool>(new FileIOPool(nThreads));
+      }
+
+      ~FileIOPool() {
+         work_.reset();
+         for (auto& thread : threads_) {
+            assert(thread.get_id() != std::this_thread::get_id());
+            thread.join();
+         }
+      }
+
+      // Run a function on a pool thread.
+      template<typename Function>
+      void post(Function&& function) {
+         io_.post(std::forward<Function>(function));
+      }
+      
+   private:
+      boost::asio::io_service io_;
+      std::unique_ptr<boost::asio::io_service::work> work_;
+      std::vector<std::thread> threads_;
+
+      FileIOPool(size_t nThreads)
+         : work_(new boost::asio::io_service::work(io_)) {
+         for (size_t i = 0; i < std::max<size_t>(nThreads, 1); ++i)
+            threads_.emplace_back([this]() { io_.run(); });
+      }
+   };
+
+   // Settings for async_receive_to_file().
+   struct FileReceiveOptions {
+      // How the file is made durable before completion.
+      enum SyncPolicy {
+         no_sync,               // leave it to the operating system
+         sync_data,             // fdatasync() before closing
+         sync_all               // fsync() before closing
+      };
+
+      SyncPolicy sync;
+
+      // Reserve disk space from Content-Length (where supported), so
+      // the file is allocated once and a full disk fails early.
+      bool preallocate;
+
+      // Size of each of the two buffers alternating between network
+      // reads and file writes.
+      size_t bufferSize;
+
+      // Maximum body size, or zero for no limit. A larger
+      // Content-Length fails immediately, before the file is opened.
+      uint64_t maxBytes;
+
+      // Permission bits for a created file.
+      int mode;
+
+      FileReceiveOptions()
+         : sync(no_sync)
+         , preallocate(true)
+         , bufferSize(262144)
+         , maxBytes(0)
+         , mode(0644) {
+      }
+   };
+
+   namespace detail {
+      // State of one async_receive_to_file(). Two buffers alternate
+      // so the next network read fills one while the pool writes the
+      // other. Network reads, file operations, and the completion
+      // are each serialized; transitions happen under the mutex.
+      template<typename T>
+      class FileReceive : public std::enable_shared_from_this<FileReceive<T> >
+                        , boost::noncopyable {
+      public:
+         typedef boost::system::error_code error_code;
+         typedef std::function<void(const error_code&, uint64_t)> Handler;
+
+         FileReceive(
+            const std::shared_ptr<HTTPTransaction<T> >& http,
+            const std::string& path,
+            const std::shared_ptr<FileIOPool>& pool,
+            const FileReceiveOptions& options,
+            const Handler& handler)
+            : http_(http)
+            , path_(path)
+            , pool_(pool)
+            , options_(options)
+            , handler_(handler)
+            , fd_(-1)
+            , nFull_(0)
+            , readIndex_(0)
+            , writeIndex_(0)
+            , reading_(false)
+            , writing_(true)
+            , eof_(false)
+            , done_(false)
+            , nBytesRead_(0)
+            , nBytesWritten_(0) {
+            for (auto& buffer : buffers_)
+               buffer.first.resize(std::max<size_t>(options.bufferSize, 1));
+         }
+
+         void start() {
+            auto this_ = this->shared_from_this();
+            uint64_t nExpected = 0;
+            const std::string contentLength = http_->request_header("Content-Length");
+            if (!contentLength.empty())
+               nExpected = std::strtoull(contentLength.c_str(), nullptr, 10);
+
+            // Refuse a declared length over the limit before touching
+            // the file system.
+            if (options_.maxBytes && nExpected > options_.maxBytes) {
+               pool_.reset();
+               http_->get_io_service().post([=]() {
+                     this_->handler_(make_error_code(body_too_large), 0);
+                     this_->handler_ = nullptr;
+                  });
+               return;
+            }
+            if (!options_.preallocate)
+               nExpected = 0;
+
+            // Open the file while the first buffer is read.
+            pool_->post([=]() {
+                  error_code error;
+                  this_->fd_ = ::open(
+                     this_->path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, this_->options_.mode);
+                  if (this_->fd_ < 0)
+                     error = error_code(errno, boost::system::system_category());
+#if defined(__linux__)
+                  else if (nExpected) {
+                     if (const int result = ::posix_fallocate(this_->fd_, 0, static_cast<off_t>(nExpected)))
+                        if (result != EOPNOTSUPP && result != EINVAL)
+                           error = error_code(result, boost::system::system_category());
+                  }
+#endif
+                  this_->written(error, 0);
+               });
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            step();
+         }
+
+      private:
+         std::shared_ptr<HTTPTransaction<T> > http_;
+         const std::string path_;
+         std::shared_ptr<FileIOPool> pool_;
+         const FileReceiveOptions options_;
+         Handler handler_;
+         int fd_;
+
+         std::mutex mutex_;
+         std::pair<std::vector<char>, size_t> buffers_[2];
+         size_t nFull_;
+         size_t readIndex_;
+         size_t writeIndex_;
+         bool reading_;
+         bool writing_;
+         bool eof_;
+         bool done_;
+         error_code error_;
+         uint64_t nBytesRead_;
+         uint64_t nBytesWritten_;
+
+         // Start whatever reads, writes, or completion the state
+         // allows. The mutex must be held.
+         void step() {
+            auto this_ = this->shared_from_this();
+            if (!writing_ && nFull_ && !error_) {
+               writing_ = true;
+               const auto& buffer = buffers_[writeIndex_];
+               const char* data = buffer.first.data();
+               const size_t nBytes = buffer.second;
+               const uint64_t offset = nBytesWritten_;
+               pool_->post([=]() {
+                     error_code error;
+                     for (size_t nWritten = 0; nWritten < nBytes && !error;) {
+                        const ssize_t result = ::pwrite(
+                           this_->fd_, data + nWritten, nBytes - nWritten,
+                           static_cast<off_t>(offset + nWritten));
+                        if (result >= 0)
+                           nWritten += static_cast<size_t>(result);
+                        else if (errno != EINTR)
+                           error = error_code(errno, boost::system::system_category());
+                     }
+                     this_->written(error, nBytes);
+                  });
+            }
+
+            if (!reading_ && !eof_ && !error_ && nFull_ < 2) {
+               reading_ = true;
+               boost::asio::async_read(
+                  *http_, boost::asio::buffer(buffers_[readIndex_].first),
+                  [=](const error_code& error, size_t nBytes) {
+                     this_->read(error, nBytes);
+                  });
+            }
+
+            if (!reading_ && !writing_ && !done_ && (error_ || (eof_ && !nFull_))) {
+               done_ = true;
+               pool_->post([=]() { this_->close(); });
+            }
+         }
+
+         void read(const error_code& error, size_t nBytes) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            reading_ = false;
+            nBytesRead_ += nBytes;
+            if (nBytes) {
+               buffers_[readIndex_].second = nBytes;
+               readIndex_ ^= 1;
+               ++nFull_;
+            }
+
+            if (error == boost::asio::error::eof)
+               eof_ = true;
+            else if (error && !error_)
+               error_ = error;
+            if (options_.maxBytes && nBytesRead_ > options_.maxBytes && !error_)
+               error_ = make_error_code(body_too_large);
+            step();
+         }
+
+         // Completion of a file operation (on a pool thread), handled
+         // on the connection's io_service.
+         void written(const error_code& error, size_t nBytes) {
+            auto this_ = this->shared_from_this();
+            http_->get_io_service().post([=]() {
+                  std::lock_guard<std::mutex> lock(this_->mutex_);
+                  this_->writing_ = false;
+                  if (nBytes) {
+                     this_->nBytesWritten_ += nBytes;
+                     this_->writeIndex_ ^= 1;
+                     --this_->nFull_;
+                  }
+                  if (error && !this_->error_)
+                     this_->error_ = error;
+                  this_->step();
+               });
+         }
+
+         // Sync and close the file (on a pool thread), removing it on
+         // failure, then call the handler on the connection's
+         // io_service.
+         void close() {
+            error_code error = error_;
+            if (fd_ >= 0) {
+               if (!error && options_.sync != FileReceiveOptions::no_sync) {
+                  const int result = options_.sync == FileReceiveOptions::sync_data ? ::fdatasync(fd_) : ::fsync(fd_);
+                  if (result < 0)
+                     error = error_code(errno, boost::system::system_category());
+               }
+               if (!error && nBytesWritten_ < nBytesRead_)
+                  error = make_error_code(boost::asio::error::broken_pipe);
+               if (!error && ::ftruncate(fd_, static_cast<off_t>(nBytesWritten_)) < 0)
+                  error = error_code(errno, boost::system::system_category());
+               if (::close(fd_) < 0 && !error)
+                  error = error_code(errno, boost::system::system_category());
+               if (error)
+                  ::unlink(path_.c_str());
+            }
+
+            // This is the last pool operation. Release the pool on
+            // the io_service, so that if this holds its last reference
+            // it is not destroyed (joining itself) on a pool thread.
+            auto this_ = this->shared_from_this();
+            http_->get_io_service().post([=]() {
+                  this_->pool_.reset();
+                  this_->handler_(error, this_->nBytesWritten_);
+                  this_->handler_ = nullptr;
+               });
+         }
+      };
+   }
+
+   // Receive a request body into a file, created or truncated at
+   // path. Network reads alternate between two buffers while the
+   // pool writes the other, so socket and disk transfers overlap and
+   // disk stalls block only pool threads. On failure the file is
+   // removed. The handler is called on the connection's io_service
+   // with the number of bytes written.
+   template<typename T>
+   void async_receive_to_file(
+      const std::shared_ptr<HTTPTransaction<T> >& http,
+      const std::string& path,
+      const std::shared_ptr<FileIOPool>& pool,
+      const FileReceiveOptions& options,
+      const std::function<void(const boost::system::error_code&, uint64_t)>& handler) {
+      std::make_shared<detail::FileReceive<T> >(http, path, pool, options, handler)->start();
+   }
+
+   // This monitors io_service responsiveness. A periodic probe is
+   // scheduled on each monitored io_service (e.g. the shared
+   // io_service of a thread pool, or each worker's io_service) and
+   // its scheduling delay is recorded. A server with a monitor also
+   // reports handlers that block an I/O thread too long.
+   class LoopMonitor : public std::enable_shared_from_this<LoopMonitor>
+                     , boost::noncopyable {
+   public:
+      typedef std::chrono::microseconds Duration;
+      
+      static std::shared_ptr<LoopMonitor> create(const Duration& interval = Duration(100000)) {
+         return std::shared_ptr<LoopMonitor>(new LoopMonitor(interval));
+      }
+
+      // Start probing an io_service. The returned index identifies
+      // its histogram.
+      size_t monitor(boost::asio::io_service& io) {
+         std::lock_guard<std::mutex> lock(mutex_);
+         probes_.emplace_back(new Probe(io));
+         schedule(probes_.back().get());
+         return probes_.size() - 1;
+      }
+
+      // Cancel all probes. The monitor is released when the
+      // cancellations complete.
+      void stop() {
+         auto this_ = shared_from_this();
+         std::lock_guard<std::mutex> lock(mutex_);
+         stopped_ = true;
+         for (auto& probe : probes_) {
+            Probe* p = probe.get();
+            p->io.post([=]() {
+                  boost::system::error_code error;
+                  p->timer.cancel(error);
+                  this_.get();
+               });
+         }
+      }
+
+      // Set the time a handler may hold an I/O thread before it is
+      // counted (and optionally logged by the server) as blocking.
+      void set_blocking_threshold(const Duration& threshold, bool log = false) {
+         blockingThreshold_ = threshold.count();
+         logBlocking_ = log;
+      }
+
+      // Record the duration of a handler invocation on an I/O thread.
+      // Returns true if the server should log it as blocking.
+      bool record_handler(const Duration& duration) {
+         handlerTime_.record(duration);
+         if (duration.count() > blockingThreshold_) {
+            ++blockingHandlers_;
+            return logBlocking_;
+         }
+         return false;
+      }
+
+      const Histogram& lag(size_t index) const {
+         std::lock_guard<std::mutex> lock(mutex_);
+         return probes_.at(index)->lag;
+      }
+
+      const Histogram& handler_time() const { return handlerTime_; }
+      uint64_t blocking_handlers() const { return blockingHandlers_; }
+
+      // Write statistics as a JSON object. Durations are in
+      // microseconds.
+      void write_json(std::ostream& os) const {
+         std::lock_guard<std::mutex> lock(mutex_);
+         os << "{\"lag_us\":[";
+         const char* separator = "";
+         for (const auto& probe : probes_) {
+            os << separator;
+            probe->lag.write_json(os);
+            separator = ",";
+         }
+         os << "],\"handler_us\":";
+         handlerTime_.write_json(os);
+         os << ",\"blocking_handlers\":" << blockingHandlers_ << "}";
+      }
+      
+   private:
+      struct Probe {
+         boost::asio::io_service& io;
+         boost::asio::steady_timer timer;
+         Histogram lag;
+
+         Probe(boost::asio::io_service& io)
+            : io(io)
+            , timer(io) {
+         }
+      };
+
+      const Duration interval_;
+      mutable std::mutex mutex_;
+      std::vector<std::unique_ptr<Probe> > probes_;
+      bool stopped_;
+      
+      std::atomic<Duration::rep> blockingThreshold_;
+      std::atomic<bool> logBlocking_;
+      std::atomic<uint64_t> blockingHandlers_;
+      Histogram handlerTime_;
+
+      LoopMonitor(const Duration& interval)
+         : interval_(interval)
+         , stopped_(false)
+         , blockingThreshold_(Duration(10000).count())
+         , logBlocking_(false)
+         , blockingHandlers_(0) {
+      }
+
+      void schedule(Probe* probe) {
+         if (stopped_)
+            return;
+         
+         // When the timer expires, post the probe itself so its delay
+         // includes both timer dispatch and queueing behind other
+         // ready handlers.
+         auto this_ = shared_from_this();
+         probe->timer.expires_from_now(interval_);
+         probe->timer.async_wait([=](const boost::system::error_code& error) {
+               if (error)
+                  return;
+               
+               const auto expiry = probe->timer.expires_at();
+               probe->io.post([=]() {
+                     probe->lag.record(boost::asio::steady_timer::clock_type::now() - expiry);
+
+                     std::lock_guard<std::mutex> lock(this_->mutex_);
+                     this_->schedule(probe);
+                  });
+            });
+      }
+   };
+   
+   // Token-bucket rate limiter keyed by client address and, if
+   // enabled, route. Buckets live in a fixed-size set-associative
+   // table split into independently locked shards. When a set is
+   // full the least recently used bucket is replaced; a bucket idle
+   // long enough to refill completely loses nothing by eviction, so
+   // memory stays bounded with any number of clients.
+   class RateLimiter : boost::noncopyable {
+   public:
+      // Allow rate requests per second on average with bursts of up
+      // to burst requests, tracking about capacity buckets.
+      static std::shared_ptr<RateLimiter> create(
+         double rate,
+         double burst,
+         size_t capacity = 4096,
+         bool perRoute = false) {
+         return std::shared_ptr<RateLimiter>(new RateLimiter(rate, burst, capacity, perRoute));
+      }
+
+      // Take a token for a request, returning false if the client is
+      // over its rate.
+      bool allow(const boost::asio::ip::address& address, const std::string& route = std::string()) {
+         const uint64_t key = hash(address, perRoute_ ? route : std::string());
+         Shard& shard = shards_[key % Shards];
+         const size_t nSets = shard.buckets.size() / Ways;
+         Bucket* set = &shard.buckets[(key / Shards) % nSets * Ways];
+         const auto now = detail::Clock::now().time_since_epoch().count();
+         
+         std::lock_guard<std::mutex> lock(shard.mutex);
+         Bucket* bucket = nullptr;
+         Bucket* oldest = set;
+         for (size_t i = 0; i < Ways; ++i) {
+            if (set[i].key == key) {
+               bucket = &set[i];
+               break;
+            }
+            if (set[i].updated < oldest->updated)
+               oldest = &set[i];
+         }
+
+         if (bucket) {
+            const double elapsed = std::chrono::duration<double>(
+               detail::Clock::duration(now - bucket->updated)).count();
+            bucket->tokens = std::min(burst_, bucket->tokens + elapsed * rate_);
+         }
+         else {
+            bucket = oldest;
+            bucket->key = key;
+            bucket->tokens = burst_;
+         }
+         bucket->updated = now;
+
+         if (bucket->tokens >= 1.0) {
+            bucket->tokens -= 1.0;
+            return true;
+         }
+
+         ++limited_;
+         return false;
+      }
+
+      double rate() const { return rate_; }
+      double burst() const { return burst_; }
+      bool per_route() const { return perRoute_; }
+
+      // Number of requests refused.
+      uint64_t limited() const { return limited_; }
+      
+   private:
+      enum {
+         Shards = 16,
+         Ways = 4
+      };
+
+      struct Bucket {
+         uint64_t key;
+         double tokens;
+         detail::Clock::rep updated;
+      };
+
+      struct Shard {
+         std::mutex mutex;
+         std::vector<Bucket> buckets;
+      };
+      
+      const double rate_;
+      const double burst_;
+      const bool perRoute_;
+      Shard shards_[Shards];
+      std::atomic<uint64_t> limited_;
+
+      RateLimiter(double rate, double burst, size_t capacity, bool perRoute)
+         : rate_(rate)
+         , burst_(std::max(burst, 1.0))
+         , perRoute_(perRoute)
+         , limited_(0) {
+         const size_t nSets = std::max<size_t>(capacity / (Shards * Ways), 1);
+         for (auto& shard : shards_)
+            shard.buckets.assign(nSets * Ways, Bucket{ 0, 0.0, 0 });
+      }
+
+      // FNV-1a over the address bytes and route. Zero marks an empty
+      // bucket so it is never returned.
+      static uint64_t hash(const boost::asio::ip::address& address, const std::string& route) {
+         uint64_t h = 14695981039346656037ULL;
+         auto mix = [&](const unsigned char* p, size_t n) {
+            while (n--) {
+               h ^= *p++;
+               h *= 1099511628211ULL;
+            }
+         };
+
+         if (address.is_v4()) {
+            const auto bytes = address.to_v4().to_bytes();
+            mix(bytes.data(), bytes.size());
+         }
+         else {
+            const auto bytes = address.to_v6().to_bytes();
+            mix(bytes.data(), bytes.size());
+         }
+         mix(reinterpret_cast<const unsigned char*>(route.data()), route.size());
+         return h ? h : 1;
+      }
+   };
+   
+   // Server overload limits. A zero limit is unlimited.
+   struct AdmissionLimits {
+      // What to do with connections beyond maxConnections.
+      enum Policy {
+         pause_accept,  // stop accepting, leaving them in the kernel backlog
+         reject         // accept and answer 503 Service Unavailable
+      };
+
+      // Maximum number of open connections.
+      size_t maxConnections;
+
+      // Maximum number of requests dispatched to handlers but not yet
+      // released. Requests beyond this are always answered with 503.
+      size_t maxRequests;
+
+      Policy policy;
+
+      // Value of the Retry-After header on 503 responses.
+      std::chrono::seconds retryAfter;
+
+      AdmissionLimits()
+         : maxConnections(0)
+         , maxRequests(0)
+         , policy(pause_accept)
+         , retryAfter(1) {
+      }
+   };
+   
+   // A complete response (status line, headers, and body) serialized
+   // once and written as-is to any number of transactions, e.g. by
+   // BaseHTTPServer::notify().
+   struct PreparedResponse {
+      unsigned int status;
+      std::string data;
+
+      static std::shared_ptr<const PreparedResponse> create(
+         unsigned int status,
+         const std::string& body = std::string(),
+         const std::string& contentType = "text/plain") {
+         auto response = std::make_shared<PreparedResponse>();
+         response->status = status;
+
+         std::ostringstream os;
+         os << "HTTP/1.1 " << status << ' ' << detail::reason_phrase(status) << "\r\n";
+         if (!body.empty())
+            os << "Content-Type: " << contentType << "\r\n";
+         if (status >= 200 && status != 204 && status != 304)
+            os << "Content-Length: " << body.size() << "\r\n";
+         os << "\r\n" << body;
+         response->data = os.str();
+         return response;
+      }
+   };
+   
+   template<typename Derived, typename T>
+   class BaseHTTPServer : public std::enable_shared_from_this<BaseHTTPServer<Derived, T> > {
+   public:
+      typedef boost::system::error_code error_code;
+      typedef HTTPTransaction<T> Transaction;
+      typedef std::function<void(const std::shared_ptr<Transaction>&)> Handler;
+
+      // Create and start a new server.
+      template<typename... Args>
+      static std::shared_ptr<Derived> create(Args&&... args) {
+         return std::shared_ptr<Derived>(new Derived(std::forward<Args>(args)...));
+      }
+
+      // Stop accepting new connections. References to the server will
+      // be dropped when all existing connections close.
+      void destroy() {
+         for (auto& acceptor : acceptors_)
+            strand_.dispatch([&]() { acceptor.cancel(); });
+         strand_.dispatch([this]() { pausedAcceptors_.clear(); });
+      }
+      
+      // Add a local address/port to bind and listen.
+      virtual unsigned short listen(const boost::asio::ip::tcp::acceptor::endpoint_type& endpoint) {
+         acceptors_.emplace_back(io_, endpoint);
+         accept(acceptors_.back());
+         return acceptors_.back().local_endpoint().port();
+      }
+
+      // Set the handler to invoke on an HTTP URI path.
+      virtual void set_handler(const std::string& path, const Handler& handler) {
+         auto this_ = this->shared_from_this();
+         strand_.dispatch([=]() {
+               this_.get();
+               if (handler)
+                  handlers_[path] = handler;
+               else
+                  handlers_.erase(path);
+            });
+      }
+      
+      typedef std::function<void(const std::string&)> LogCallback;
+      virtual void set_logger(const LogCallback& logCallback) {
+         logCallback_ = logCallback;
+      }
+      
+      virtual void log(const std::string& message) {
+         if (logCallback_)
+            logCallback_(message);
+      }
+
+      virtual void log(const error_code& e) {
+         log(e.message());
+      }
+
+      // Registry of this server's live connections.
+      const std::shared_ptr<ConnectionRegistry>& registry() const {
+         return registry_;
+      }
+
+      // Close keep-alive connections that have been idle for at least
+      // the specified time, returning the number found (see
+      // ConnectionRegistry::close_idle()).
+      template<typename Duration = detail::Clock::duration>
+      size_t close_idle_connections(const Duration& minimumIdle = Duration::zero()) {
+         return registry_->close_idle(minimumIdle);
+      }
+
+      // Set per-phase connection timeouts. Connections that exceed
+      // one are closed. Changes apply to deadlines started afterwards.
+      void set_timeouts(const ConnectionTimeouts& timeouts) {
+         timeoutPolicy_->set(timeouts);
+      }
+
+      // The timer wheel driving connection timeouts, which may also
+      // be used for application timers.
+      const std::shared_ptr<TimerWheel>& timer_wheel() const {
+         return timeoutPolicy_->wheel;
+      }
+      
+      // Set overload limits. Requests and connections that are shed
+      // get a fixed 503 response written without dispatching to a
+      // handler.
+      void set_admission_limits(const AdmissionLimits& limits) {
+         std::atomic_store(
+            &overloadResponse_,
+            std::make_shared<const std::string>(
+               (boost::format("HTTP/1.1 503 Service Unavailable\r\n"
+                              "Retry-After: %d\r\n"
+                              "Content-Length: 0\r\n"
+                              "Connection: close\r\n"
+                              "\r\n") % limits.retryAfter.count()).str()));
+         policy_ = limits.policy;
+         maxRequests_ = limits.maxRequests;
+         maxConnections_ = limits.maxConnections;
+
+         // Resume paused acceptors when connections close.
+         std::weak_ptr<BaseHTTPServer> weak = this->shared_from_this();
+         registry_->set_remove_callback([=](size_t remaining) {
+               auto this_ = weak.lock();
+               if (this_ && !this_->connection_limited(remaining))
+                  this_->strand_.post([=]() { this_->resume_accept(); });
+            });
+         strand_.post([=]() {
+               if (auto this_ = weak.lock())
+                  this_->resume_accept();
+            });
+      }
+
+      // Limit the request rate of each client. Requests over the rate
+      // get a fixed 429 response without dispatching to a handler.
+      void set_rate_limiter(const std::shared_ptr<RateLimiter>& limiter) {
+         if (limiter) {
+            const auto retryAfter = static_cast<long>(std::ceil(1.0 / limiter->rate()));
+            std::atomic_store(
+               &rateLimitedResponse_,
+               std::make_shared<const std::string>(
+                  (boost::format("HTTP/1.1 429 Too Many Requests\r\n"
+                                 "Retry-After: %d\r\n"
+                                 "Content-Length: 0\r\n"
+                                 "\r\n") % std::max(retryAfter, 1L)).str()));
+         }
+         std::atomic_store(&rateLimiter_, limiter);
+      }
+
+      std::shared_ptr<RateLimiter> rate_limiter() const {
+         return std::atomic_load(&rateLimiter_);
+      }
+      
+      // Set the default write queue watermarks for transactions (see
+      // HTTPTransaction::queue_write()).
+      void set_write_watermarks(size_t low, size_t high) {
+         lowWatermark_ = low;
+         highWatermark_ = high;
+      }
+
+      // Set the write quantum and bandwidth limit for accepted
+      // connections (see Stream::set_write_quantum() and
+      // Stream::set_bandwidth_limit()).
+      void set_write_quantum(size_t nBytes) {
+         writeQuantum_ = nBytes;
+      }
+
+      void set_bandwidth_limit(size_t bytesPerSecond, size_t burst = Transport::DefaultWriteQuantum) {
+         writeBurst_ = burst;
+         writeRate_ = bytesPerSecond;
+      }
+      
+      // Set TCP_NOTSENT_LOWAT on accepted connections so queued
+      // response data is produced just in time for slow clients.
+      // Zero (the default) leaves the system setting.
+      void set_notsent_lowat(size_t nBytes) {
+         notSentLowat_ = nBytes;
+      }
+      
+      // Number of requests dispatched to handlers and not released
+      // (excluding parked requests).
+      size_t requests_in_flight() const {
+         return inFlight_;
+      }
+
+      // Hold a request (e.g. a long poll) under a key until notify()
+      // is called for the key or the timeout expires, when it is
+      // answered with the timeout response (by default 204 No
+      // Content). Timeouts run on the server's timer wheel. Parked
+      // requests do not count against the in-flight limit.
+      void park(
+         const std::string& key,
+         const std::shared_ptr<Transaction>& http,
+         const TimerWheel::Duration& timeout,
+         const std::shared_ptr<const PreparedResponse>& timeoutResponse = nullptr) {
+         static const auto noContent = PreparedResponse::create(204);
+         auto parked = std::make_shared<Parked>();
+         parked->http = http;
+         parked->timeoutResponse = timeoutResponse ? timeoutResponse : noContent;
+         parked->key = key;
+
+         std::weak_ptr<BaseHTTPServer> weakServer = this->shared_from_this();
+         std::weak_ptr<Parked> weakParked = parked;
+         parked->timer.set_callback([=]() {
+               auto this_ = weakServer.lock();
+               auto parked = weakParked.lock();
+               if (this_ && parked)
+                  this_->expire(parked);
+            });
+
+         --inFlight_;
+         std::lock_guard<std::mutex> lock(parkingMutex_);
+         auto& waiting = parking_[key];
+         parked->position = waiting.insert(waiting.end(), parked);
+         ++nParked_;
+         timer_wheel()->schedule(parked->timer, timeout);
+      }
+
+      // Answer every request parked under a key with a shared
+      // response, returning the number answered.
+      size_t notify(const std::string& key, const std::shared_ptr<const PreparedResponse>& response) {
+         ParkedList woken;
+         {
+            std::lock_guard<std::mutex> lock(parkingMutex_);
+            auto i = parking_.find(key);
+            if (i == parking_.end())
+               return 0;
+
+            woken.swap(i->second);
+            parking_.erase(i);
+            nParked_ -= woken.size();
+            for (auto& parked : woken) {
+               parked->waiting = false;
+               timer_wheel()->cancel(parked->timer);
+            }
+         }
+
+         for (auto& parked : woken)
+            wake(parked->http, response);
+         return woken.size();
+      }
+
+      // Number of parked requests.
+      size_t parked() const {
+         std::lock_guard<std::mutex> lock(parkingMutex_);
+         return nParked_;
+      }
+      
+      // Enable or disable measuring thread CPU time and allocations
+      // (see set_allocation_counter()) per route. Handler invocations
+      // and completion handlers for their transactions' I/O are
+      // charged to the route.
+      void set_accounting(bool enable) {
+         accounting_ = enable;
+      }
+
+      // Write server metrics as a JSON object.
+      virtual void write_metrics(std::ostream& os) {
+         os << "{\"routes\":{";
+         {
+            std::lock_guard<std::mutex> lock(accountsMutex_);
+            const char* separator = "";
+            for (const auto& value : accounts_) {
+               os << separator;
+               detail::write_json_string(os, value.first);
+               os << ":{\"requests\":" << value.second->requests
+                  << ",\"cpu_us\":" << value.second->cpuNanoseconds / 1000
+                  << ",\"allocated_bytes\":" << value.second->allocatedBytes
+                  << "}";
+               separator = ",";
+            }
+         }
+         os << "}";
+
+         os << ",\"timeouts\":{";
+         for (int i = 0; i < ConnectionTimeouts::kinds; ++i) {
+            const auto kind = static_cast<ConnectionTimeouts::Kind>(i);
+            os << (i ? "," : "")
+               << '"' << ConnectionTimeouts::name(kind) << "\":"
+               << timeoutPolicy_->expired[kind];
+         }
+         os << "}";
+
+         os << ",\"admission\":{\"connections\":" << registry_->size()
+            << ",\"in_flight\":" << inFlight_
+            << ",\"shed_connections\":" << shedConnections_
+            << ",\"shed_requests\":" << shedRequests_
+            << ",\"accept_pauses\":" << acceptPauses_;
+         if (auto limiter = rate_limiter())
+            os << ",\"rate_limited\":" << limiter->limited();
+         os << "}";
+
+         if (auto monitor = loop_monitor()) {
+            os << ",\"loop\":";
+            monitor->write_json(os);
+         }
+         os << "}";
+      }
+
+      // Report handler durations to a LoopMonitor. This includes
+      // request handlers and the completion handlers of a
+      // transaction's async_read_some(), async_write_some() and
+      // async_finish(). The monitor is not started or stopped by the
+      // server.
+      void set_loop_monitor(const std::shared_ptr<LoopMonitor>& monitor) {
+         std::shared_ptr<detail::HandlerTimer> timer;
+         if (monitor)
+            timer = std::make_shared<MonitorTimer>(monitor, this->shared_from_this());
+         
+         std::lock_guard<std::mutex> lock(accountsMutex_);
+         loopMonitor_ = monitor;
+         handlerTimer_ = timer;
+      }
+
+      std::shared_ptr<LoopMonitor> loop_monitor() {
+         std::lock_guard<std::mutex> lock(accountsMutex_);
+         return loopMonitor_;
+      }
+      
+      // Get a handler that responds with write_metrics() output, e.g.
+      // for set_handler("/debug/metrics").
+      Handler metrics_handler() {
+         return [this](const std::shared_ptr<Transaction>& http) {
+            std::ostringstream os;
+            write_metrics(os);
+            send_response(http, 200, "application/json", os.str());
+         };
+      }
+      
+      // Get a handler that responds with a JSON array describing the
+      // live connections, e.g. for set_handler("/debug/connections").
+      Handler connections_handler() {
+         auto registry = registry_;
+         return [=](const std::shared_ptr<Transaction>& http) {
+            std::ostringstream os;
+            registry->write_json(os);
+            send_response(http, 200, "application/json", os.str());
+         };
+      }
+      
+   protected:
+      typedef T Transport;
+      
+      BaseHTTPServer(boost::asio::io_service& io)
+         : io_(io)
+         , strand_(io_)
+         , registry_(ConnectionRegistry::create())
+         , timeoutPolicy_(std::make_shared<detail::TimeoutPolicy>(TimerWheel::create(io)))
+         , maxConnections_(0)
+         , maxRequests_(0)
+         , policy_(AdmissionLimits::pause_accept)
+         , inFlight_(0)
+         , shedConnections_(0)
+         , shedRequests_(0)
+         , acceptPauses_(0)
+         , lowWatermark_(Transaction::DefaultLowWatermark)
+         , highWatermark_(Transaction::DefaultHighWatermark)
+         , notSentLowat_(0)
+         , writeQuantum_(Transport::DefaultWriteQuantum)
+         , writeRate_(0)
+         , writeBurst_(Transport::DefaultWriteQuantum)
+         , accounting_(false)
+         , nParked_(0) {
+         handlers_[std::string()] = [this](const std::shared_ptr<Transaction>& http) {
+            default_handler(http);
+         };
+      }
+
+      virtual ~BaseHTTPServer() {
+      }
+
+      virtual boost::asio::io_service& get_io_service() { return io_; }
+      
+      virtual void connect_transport(
+         boost::asio::ip::tcp::acceptor& acceptor,
+         const std::function<void(const error_code&, const std::shared_ptr<Transport>&)>& handler) = 0;
+
+      virtual void disconnect_transport(
+         const std::shared_ptr<Transport>&,
+         boost::system::error_code&) {
+      }
+      
+      // Asynchronously send a complete response with a fixed body.
+      void send_response(
+         const std::shared_ptr<Transaction>& http,
+         unsigned int status,
+         const std::string& contentType,
+         std::string&& content) {
+         auto body = std::make_shared<std::string>(std::move(content));
+         http->response_status() = status;
+         http->response_header("Content-Type") = contentType;
+         http->response_header("Content-Length") = std::to_string(body->size());
+         boost::asio::async_write(
+            *http, boost::asio::buffer(*body),
+            [=](const boost::system::error_code& error, size_t) {
+               if (error) {
+                  log(error);
+                  return;
+               }
+
+               http->async_finish([=](const boost::system::error_code& error) {
+                     if (error) {
+                        log(error);
+                        return;
+                     }
+
+                     http.get();
+                     body.get();
+                  });
+            });
+      }
+      
+      virtual void default_handler(const std::shared_ptr<Transaction>& http) {
+         http->response_status() = 404;
+         http->response_header("Content-Type") = "text/html";
+         
+         static std::string NotFound("<title>404 - Not Found</title><h1>404 - Not Found</h1>");
+         boost::asio::async_write(
+            *http, boost::asio::buffer(NotFound),
+            [=](const boost::system::error_code& error, size_t) {
+               if (error) {
+                  log(error);
+                  return;
+               }
+
+               http->async_finish([=](const boost::system::error_code& error) {
+                     if (error) {
+                        log(error);
+                        return;
+                     }
+
+                     http.get();
+                  });
+            });
+      }
+
+   private:
+      boost::asio::io_service& io_;
+      boost::asio::io_service::strand strand_;
+      std::list<boost::asio::ip::tcp::acceptor> acceptors_;
+      
+      std::map<std::string, Handler> handlers_;
+      LogCallback logCallback_;
+
+      std::shared_ptr<ConnectionRegistry> registry_;
+      std::shared_ptr<detail::TimeoutPolicy> timeoutPolicy_;
+
+      std::atomic<size_t> maxConnections_;
+      std::atomic<size_t> maxRequests_;
+      std::atomic<AdmissionLimits::Policy> policy_;
+      std::shared_ptr<const std::string> overloadResponse_;
+      std::shared_ptr<RateLimiter> rateLimiter_;
+      std::shared_ptr<const std::string> rateLimitedResponse_;
+      std::vector<boost::asio::ip::tcp::acceptor*> pausedAcceptors_;
+      std::atomic<size_t> inFlight_;
+      std::atomic<uint64_t> shedConnections_;
+      std::atomic<uint64_t> shedRequests_;
+      std::atomic<uint64_t> acceptPauses_;
+
+      std::atomic<size_t> lowWatermark_;
+      std::atomic<size_t> highWatermark_;
+      std::atomic<size_t> notSentLowat_;
+      std::atomic<size_t> writeQuantum_;
+      std::atomic<size_t> writeRate_;
+      std::atomic<size_t> writeBurst_;
+
+      // Per-transaction flags shared with the transaction deleter.
+      struct TransactionState {
+         bool keepalive = true;
+         bool admitted = false;
+      };
+      
+      std::atomic<bool> accounting_;
+      std::mutex accountsMutex_;
+      std::map<std::string, std::shared_ptr<detail::RouteAccount> > accounts_;
+      std::shared_ptr<LoopMonitor> loopMonitor_;
+      std::shared_ptr<detail::HandlerTimer> handlerTimer_;
+
+      // Records handler durations in a LoopMonitor and logs those
+      // the monitor reports as blocking.
+      class MonitorTimer : public detail::HandlerTimer {
+      public:
+         MonitorTimer(
+            const std::shared_ptr<LoopMonitor>& monitor,
+            const std::weak_ptr<BaseHTTPServer>& server)
+            : monitor_(monitor)
+            , server_(server) {
+         }
+
+         void record(const detail::Clock::duration& duration, const char* path) override {
+            const auto us = std::chrono::duration_cast<LoopMonitor::Duration>(duration);
+            if (!monitor_->record_handler(us))
+               return;
+            
+            if (auto server = server_.lock()) {
+               if (path)
+                  server->log((boost::format("handler for %s blocked for %d us") % path % us.count()).str());
+               else
+                  server->log((boost::format("completion handler blocked for %d us") % us.count()).str());
+            }
+         }
+
+      private:
+         const std::shared_ptr<LoopMonitor> monitor_;
+         const std::weak_ptr<BaseHTTPServer> server_;
+      };
+
+      std::shared_ptr<detail::HandlerTimer> handler_timer() {
+         std::lock_guard<std::mutex> lock(accountsMutex_);
+         return handlerTimer_;
+      }
+
+      // A request waiting in park().
+      struct Parked;
+      typedef std::list<std::shared_ptr<Parked> > ParkedList;
+      struct Parked {
+         std::shared_ptr<Transaction> http;
+         std::shared_ptr<const PreparedResponse> timeoutResponse;
+         TimerWheel::Timer timer;
+         std::string key;
+         typename ParkedList::iterator position;
+         bool waiting = true;
+      };
+
+      mutable std::mutex parkingMutex_;
+      std::unordered_map<std::string, ParkedList> parking_;
+      size_t nParked_;
+      
+      void accept(boost::asio::ip::tcp::acceptor& acceptor) {
+         auto this_ = this->shared_from_this();
+         connect_transport(
+            acceptor,
+            [=, &acceptor](const error_code& error, const std::shared_ptr<Transport>& transport) {
+               if (!error) {
+                  error_code peerError;
+                  registry_->add(transport, transport->stream().lowest_layer().remote_endpoint(peerError));
+                  transport->set_timeouts(timeoutPolicy_);
+                  transport->set_state(Connection::reading_head);
+                  transport->set_write_quantum(writeQuantum_);
+                  transport->set_bandwidth_limit(writeRate_, writeBurst_);
+                  if (const size_t notSentLowat = notSentLowat_) {
+                     error_code optionError;
+                     transport->set_notsent_lowat(notSentLowat, optionError);
+                  }
+                  CHUNKY_PROBE(
+                     connection__accept, transport.get(),
+                     transport->stream().lowest_layer().native_handle(),
+                     transport->stream().lowest_layer().remote_endpoint().port());
+                  log((boost::format("connect %s:%d")
+                       % transport->stream().lowest_layer().remote_endpoint().address().to_string()
+                       % transport->stream().lowest_layer().remote_endpoint().port()).str());
+                  create_transaction(transport, connection_limited(registry_->size() - 1));
+               }
+               else {
+                  log(error);
+
+                  // Stop accepting on system errors to avoid runaway.
+                  if (error == make_error_code(boost::asio::error::operation_aborted) ||
+                      error.category() == boost::asio::error::get_system_category())
+                     return;
+               }
+
+               strand_.dispatch([=, &acceptor]() {
+                     // Leave further connections in the kernel backlog
+                     // until enough connections close.
+                     if (policy_ == AdmissionLimits::pause_accept &&
+                         connection_limited(registry_->size())) {
+                        pausedAcceptors_.push_back(&acceptor);
+                        ++acceptPauses_;
+                        return;
+                     }
+                     
+                     this_->accept(acceptor);
+                  });
+            });
+      }
+
+      // Check whether another connection would exceed the limit.
+      bool connection_limited(size_t nConnections) const {
+         const size_t limit = maxConnections_;
+         return limit && nConnections >= limit;
+      }
+
+      // Restart paused acceptors (on the strand).
+      void resume_accept() {
+         if (connection_limited(registry_->size()))
+            return;
+
+         std::vector<boost::asio::ip::tcp::acceptor*> acceptors;
+         acceptors.swap(pausedAcceptors_);
+         for (auto acceptor : acceptors)
+            accept(*acceptor);
+      }
+
+      // Count a request against the in-flight limit, returning false
+      // if it must be shed.
+      bool admit() {
+         const size_t limit = maxRequests_;
+         if (++inFlight_ > limit && limit) {
+            --inFlight_;
+            return false;
+         }
+         return true;
+      }
+
+      // Answer with a pre-serialized response, keeping the connection
+      // alive after discarding any request body.
+      void respond(
+         const std::shared_ptr<Transaction>& http,
+         unsigned int status,
+         const std::shared_ptr<const std::string>& response) {
+         http->responseStatus_ = status;
+         http->stream()->set_state(Connection::writing);
+         http->async_discard([=](const error_code& error) {
+               if (error) {
+                  log(error);
+                  return;
+               }
+
+               http->putback_buffer();
+               boost::asio::async_write(
+                  *http->stream(), boost::asio::buffer(*response),
+                  [=](const error_code& error, size_t) {
+                     if (error) {
+                        log(error);
+                        return;
+                     }
+                     
+                     http->finish_state();
+                     response.get();
+                  });
+            });
+      }
+      
+      void expire(const std::shared_ptr<Parked>& parked) {
+         {
+            std::lock_guard<std::mutex> lock(parkingMutex_);
+            if (!parked->waiting)
+               return;
+
+            parked->waiting = false;
+            auto i = parking_.find(parked->key);
+            i->second.erase(parked->position);
+            if (i->second.empty())
+               parking_.erase(i);
+            --nParked_;
+         }
+
+         wake(parked->http, parked->timeoutResponse);
+      }
+
+      // Answer a parked request, counting it in flight again until
+      // the transaction is released.
+      void wake(
+         const std::shared_ptr<Transaction>& http,
+         const std::shared_ptr<const PreparedResponse>& response) {
+         ++inFlight_;
+         respond(http, response->status, std::shared_ptr<const std::string>(response, &response->data));
+      }
+      
+      // Answer with the pre-serialized 503 response and close.
+      enum {
+         ShedLingerBytes = 65536,
+         ShedLingerMilliseconds = 1000
+      };
+      
+      // Send the overload response without reading the request. The
+      // send side is then shut down and whatever the client already
+      // sent is read and discarded (bounded in bytes and time), so
+      // closing does not reset the connection before the client
+      // reads the response.
+      void shed(const std::shared_ptr<Transaction>& http) {
+         auto response = std::atomic_load(&overloadResponse_);
+         auto transport = http->stream();
+         transport->set_state(Connection::writing);
+         boost::asio::async_write(
+            *transport, boost::asio::buffer(*response),
+            [=](const error_code& error, size_t) {
+               http.get();
+               response.get();
+               if (error) {
+                  log(error);
+                  return;
+               }
+
+               error_code ignored;
+               transport->stream().lowest_layer().shutdown(boost::asio::socket_base::shutdown_send, ignored);
+
+               auto timer = std::make_shared<boost::asio::steady_timer>(transport->get_io_service());
+               timer->expires_from_now(std::chrono::milliseconds(ShedLingerMilliseconds));
+               timer->async_wait([=](const error_code& error) {
+                     if (!error)
+                        transport->close_connection();
+                  });
+               linger(transport, timer, std::make_shared<std::vector<char> >(4096), ShedLingerBytes);
+            });
+      }
+
+      // Discard input until EOF, an error, or the byte limit. The
+      // connection closes when the last reference is released.
+      void linger(
+         const std::shared_ptr<Transport>& transport,
+         const std::shared_ptr<boost::asio::steady_timer>& timer,
+         const std::shared_ptr<std::vector<char> >& buffer,
+         size_t remaining) {
+         auto this_ = this->shared_from_this();
+         transport->async_read_some(
+            boost::asio::buffer(*buffer),
+            [=](const error_code& error, size_t nBytes) {
+               if (error || nBytes >= remaining) {
+                  error_code ignored;
+                  timer->cancel(ignored);
+                  return;
+               }
+
+               this_->linger(transport, timer, buffer, remaining - nBytes);
+            });
+      }
+
+      void create_transaction(const std::shared_ptr<Transport>& transport, bool overLimit = false) {
+         auto this_ = this->shared_from_this();
+         auto state = std::make_shared<TransactionState>();
+         std::shared_ptr<Transaction> http(
+            new Transaction(transport),
+            [=](Transaction* pointer) {
+               if (state->admitted)
+                  --inFlight_;
+               
+               state->keepalive &= keep_alive(*pointer);
+               if (state->keepalive) {
+                  get_io_service().post([=]() {
+                        this_.get();
+                        create_transaction(transport);
                      });
                }
-               else {
-                  error_code error;
-                  if (nBytesRead == 0 && bufferSize > 0)
-                     error = make_error_code(boost::asio::error::eof);
-                  handler(error, nBytesRead);
+
+               delete pointer;
+            });
+         http->set_write_watermarks(lowWatermark_, highWatermark_);
+
+         // For convenience, issue a null read so that request
+         // metadata is already valid for the callback.
+         http->async_read_some(
+            boost::asio::null_buffers(),
+            [=](boost::system::error_code error, size_t) {
+               if (error) {
+                  disconnect_transport(http->stream(), error);
+                  log(error);
+                  state->keepalive = false;
+                  return;
+               }
+
+               // Shed load without dispatching to a handler.
+               if (overLimit || !admit()) {
+                  ++(overLimit ? shedConnections_ : shedRequests_);
+                  state->keepalive = false;
+                  shed(http);
+                  return;
                }
+               state->admitted = true;
+               
+               strand_.dispatch([=]() { dispatch_transaction(http); });
             });
       }
+      
+      void dispatch_transaction(const std::shared_ptr<Transaction>& transaction) {
+         auto i = handlers_.find(transaction->request_path());
+         if (i == handlers_.end())
+            i = handlers_.find(std::string());
 
-      template<typename MutableBufferSequence>
-      size_t read_some(MutableBufferSequence&& buffers, error_code& error) {
-         using namespace std::placeholders;
-         auto loadBufferFunc = std::bind(&HTTPTransaction::sync_load_buffer, this, _1, _2);
-         if (requestMethod_.empty()) {
-            create(loadBufferFunc, [&](const error_code& e) {
-                  error = e;
-               });
-            if (error)
-               return 0;
+         if (auto limiter = rate_limiter()) {
+            if (!limiter->allow(transaction->stream()->peer().address(), i->first)) {
+               respond(transaction, 429, std::atomic_load(&rateLimitedResponse_));
+               return;
+            }
+         }
+
+         if (accounting_) {
+            std::lock_guard<std::mutex> lock(accountsMutex_);
+            auto& account = accounts_[i->first];
+            if (!account)
+               account = std::make_shared<detail::RouteAccount>();
+            ++account->requests;
+            transaction->account_ = account;
+         }
+
+         transaction->stream()->set_state(Connection::in_handler);
+         transaction->timer_ = handler_timer();
+         CHUNKY_PROBE(handler__entry, transaction->stream().get(), transaction->request_path().c_str());
+         const auto start = detail::probe_now(CHUNKY_PROBE_ENABLED(handler__return));
+         {
+            detail::AccountingScope scope(
+               transaction->account_.get(),
+               transaction->timer_.get(),
+               transaction->request_path().c_str());
+            i->second(transaction);
          }
+         CHUNKY_PROBE(handler__return, transaction->stream().get(), detail::elapsed_us(start));
+      }
+      
+      bool keep_alive(Transaction& http) {
+         if (http.response_status() == 101 || http.released_)
+            return false;
          
-         size_t result;
-         auto handler = [&](const error_code& e, size_t n) {
-            error = e;
-            result = n;
-         };
+         static const std::string connection("Connection");
+         static const std::string close("close");
+         auto requestConnection = http.request_headers().find(connection);
+         if (requestConnection != http.request_headers().end() &&
+             requestConnection->second == close)
+            return false;
+
+         auto responseConnection = http.response_headers().find(connection);
+         if (responseConnection != http.response_headers().end() &&
+             responseConnection->second == close)
+            return false;
+
+         return true;
+      }
+   };
+
+   class SimpleHTTPServer : public BaseHTTPServer<SimpleHTTPServer, TCP> {
+   private:
+      friend class BaseHTTPServer<SimpleHTTPServer, TCP>;
+      
+      SimpleHTTPServer(boost::asio::io_service& io)
+         : BaseHTTPServer<SimpleHTTPServer, TCP>(io) {
+      }
+      
+      virtual void connect_transport(
+         boost::asio::ip::tcp::acceptor& acceptor,
+         const std::function<void(const error_code&, const std::shared_ptr<Transport>&)>& handler) {
+         Transport::async_connect(acceptor, handler);
+      }
+   };
+
+#ifdef BOOST_ASIO_SSL_HPP
+   class SimpleHTTPSServer : public BaseHTTPServer<SimpleHTTPSServer, TLS> {
+   private:
+      friend class BaseHTTPServer<SimpleHTTPSServer, TLS>;
+      
+      SimpleHTTPSServer(boost::asio::io_service& io, boost::asio::ssl::context& context)
+         : BaseHTTPServer<SimpleHTTPSServer, TLS>(io)
+         , context_(context) {
+      }
+
+      boost::asio::ssl::context& context_;
+      
+      virtual void connect_transport(
+         boost::asio::ip::tcp::acceptor& acceptor,
+         const std::function<void(const error_code&, const std::shared_ptr<Transport>&)>& handler) {
+         Transport::async_connect(acceptor, context_, handler);
+      }
+
+      virtual void disconnect_transport(
+         const std::shared_ptr<Transport>& transport,
+         boost::system::error_code& error) {
+         // Cleanly terminate TLS if necessary.
+         if (error.category() == boost::asio::error::get_ssl_category()) {
+            transport->stream().async_shutdown([=](const error_code&) {
+                  transport.get();
+               });
+         }
+                  
+         // Convert short read error into EOF for consistency
+         // with TCP.
+         if (error.category() == boost::asio::error::get_ssl_category() &&
+             error.value() == ERR_PACK(ERR_LIB_SSL, 0, SSL_R_SHORT_READ))
+            error = make_error_code(boost::asio::error::eof);
+      }
+   };
+#endif
+
+   // Server-Sent Events (text/event-stream) fan-out. A handler
+   // subscribes its transaction to a named channel, and each
+   // published event is serialized once, including its chunk framing,
+   // into an immutable shared buffer that is written directly to the
+   // stream of every subscriber. Subscribers are sharded by
+   // io_service, and writes are started on each shard's io_service in
+   // batches (as WebSocketHub does), so a publish costs the caller one
+   // queue entry per subscriber.
+   //
+   // Each channel keeps a bounded ring of recent events, which is
+   // replayed to a subscriber whose request carries Last-Event-ID (as
+   // browsers send when reconnecting). A subscriber with more than
+   // the limit of unwritten bytes is disconnected rather than
+   // buffered without bound; its client can reconnect and catch up
+   // from the ring.
+   template<typename T>
+   class EventStreamHub : public std::enable_shared_from_this<EventStreamHub<T> >
+                        , boost::noncopyable {
+   public:
+      typedef boost::system::error_code error_code;
+      typedef HTTPTransaction<T> Transaction;
+      typedef std::shared_ptr<const std::string> SharedEvent;
+
+      enum {
+         DefaultReplayCapacity = 256,
+         DefaultSubscriberLimit = 1 << 20,
+         DefaultBatchSize = 64
+      };
+      
+      static std::shared_ptr<EventStreamHub> create(
+         size_t replayCapacity = DefaultReplayCapacity,
+         size_t batchSize = DefaultBatchSize) {
+         return std::shared_ptr<EventStreamHub>(new EventStreamHub(replayCapacity, batchSize));
+      }
+
+      // Set the unwritten bytes at which a subscriber is disconnected.
+      void set_subscriber_limit(size_t nBytes) {
+         subscriberLimit_ = nBytes;
+      }
+
+      // Respond to a request with the event stream of a channel. The
+      // response head is written immediately, followed by any events
+      // in the ring after the request's Last-Event-ID. The hub keeps
+      // the transaction until the client disconnects or the channel
+      // is closed.
+      void subscribe(const std::string& channel, const std::shared_ptr<Transaction>& http) {
+         http->response_status() = 200;
+         http->response_header("Content-Type") = "text/event-stream";
+         http->response_header("Cache-Control") = "no-cache";
+         http->response_header("Connection") = "close";
          
-         // Take data from the streambuf first.
-         size_t nBytesRead = 0;
-         const auto bufferSize = boost::asio::buffer_size(buffers);
-         if (streambuf_.size()) {
-            auto nBytes = boost::asio::buffer_copy(buffers, streambuf_.data(), requestBytes_);
-            streambuf_.consume(nBytes);
-            requestBytes_ -= nBytes;
-            nBytesRead += nBytes;
+         auto subscriber = std::make_shared<Subscriber>(channel, http);
+         const std::string lastEventId = http->request_header("Last-Event-ID");
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& state = channels_[channel];
+            if (!lastEventId.empty()) {
+               char* end;
+               const uint64_t lastId = std::strtoull(lastEventId.c_str(), &end, 10);
+               if (*end == '\0') {
+                  for (const auto& event : state.ring) {
+                     if (event.first > lastId) {
+                        subscriber->queue.push_back(event.second);
+                        subscriber->queuedBytes += event.second->size();
+                        ++replayed_;
+                     }
+                  }
+               }
+            }
+            
+            add(state, subscriber);
          }
 
-         // Jump through some hoops to make the inner lambda exactly
-         // the same as async_read_some().
-         size_t nBytes = boost::asio::read(
-            *stream(),
-            buffers,
-            boost::asio::transfer_exactly(nBytesRead ? 0 : requestBytes_),
-            error);
-         [=](const std::function<void(const error_code&, size_t)>& f) {
-            f(error, nBytes);
-         }([=](const error_code& error, size_t nBytes) mutable {
+         // Write the head through the transaction, which selects
+         // chunked encoding, then switch to pre-framed events.
+         static const std::string comment(":\n\n");
+         auto this_ = this->shared_from_this();
+         http->async_write_some(
+            boost::asio::buffer(comment),
+            [=](const error_code& error, size_t) {
                if (error) {
-                  handler(error, nBytesRead);
+                  this_->drop(subscriber);
                   return;
                }
 
-               // Read the chunk delimiter and next chunk header if chunked.
-               requestBytes_ -= nBytes;
-               nBytesRead += nBytes;
-               if (bufferSize && requestChunksPending_ && !requestBytes_) {
-                  using namespace std::placeholders;
-                  loadBufferFunc(crlf(), [=](const error_code& error) mutable {
-                        if (error) {
-                           handler(error, nBytesRead);
-                           return;
-                        }
-                        
-                        std::string s = get_line();
-                        if (!s.empty()) {
-                           handler(make_error_code(invalid_chunk_delimiter), nBytesRead);
-                           return;
-                        }
-                        
-                        read_chunk_header(
-                           loadBufferFunc,
-                           [=](const error_code& error) mutable {
-                              handler(error, nBytesRead);
-                           });
-                     });
-               }
-               else {
-                  error_code error;
-                  if (nBytesRead == 0 && bufferSize > 0)
-                     error = make_error_code(boost::asio::error::eof);
-                  handler(error, nBytesRead);
-               }
+               std::lock_guard<std::mutex> lock(subscriber->mutex);
+               subscriber->ready = true;
+               this_->write_next(subscriber);
             });
 
-         return result;
+         // The client sends nothing more, so a read completes only
+         // when it disconnects.
+         watch(subscriber);
+      }
+
+      // Publish an event to a channel, returning its id. Data with
+      // multiple lines is sent as multiple data fields.
+      uint64_t publish(
+         const std::string& channel,
+         const std::string& data,
+         const std::string& event = std::string()) {
+         ++published_;
+         const size_t limit = subscriberLimit_;
+         std::vector<std::shared_ptr<Subscriber> > slow;
+         std::vector<Shard> shards;
+         uint64_t id;
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& state = channels_[channel];
+            id = ++state.lastId;
+            auto chunk = std::make_shared<const std::string>(encode_event(id, event, data));
+            state.ring.emplace_back(id, chunk);
+            if (state.ring.size() > replayCapacity_)
+               state.ring.pop_front();
+
+            // Queue under the hub lock so concurrent publishes reach
+            // every subscriber in id order. Writes start later.
+            for (const auto& shard : state.shards) {
+               for (const auto& subscriber : *shard.subscribers) {
+                  std::lock_guard<std::mutex> subscriberLock(subscriber->mutex);
+                  if (subscriber->closed)
+                     continue;
+            
+                  if (limit && subscriber->queuedBytes + chunk->size() > limit) {
+                     slow.push_back(subscriber);
+                     continue;
+                  }
+
+                  subscriber->queue.push_back(chunk);
+                  subscriber->queuedBytes += chunk->size();
+                  ++delivered_;
+               }
+            }
+
+            for (const auto& subscriber : slow)
+               remove(state, subscriber);
+            shards = state.shards;
+         }
+
+         for (const auto& subscriber : slow) {
+            ++dropped_;
+            disconnect(subscriber);
+         }
+
+         auto this_ = this->shared_from_this();
+         for (const auto& shard : shards) {
+            std::shared_ptr<const Subscribers> subscribers = shard.subscribers;
+            for (size_t i = 0; i < subscribers->size(); i += batchSize_) {
+               const size_t end = std::min(i + batchSize_, subscribers->size());
+               shard.io->post([=]() {
+                     this_->start_writes(*subscribers, i, end);
+                  });
+            }
+         }
+         return id;
+      }
+
+      // End the response of every subscriber to a channel after its
+      // queued events, and forget the channel's history.
+      void close(const std::string& channel) {
+         static const SharedEvent last = std::make_shared<const std::string>("0\r\n\r\n");
+         std::vector<Shard> shards;
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto i = channels_.find(channel);
+            if (i == channels_.end())
+               return;
+
+            shards.swap(i->second.shards);
+            for (const auto& shard : shards)
+               nSubscribers_ -= shard.subscribers->size();
+            channels_.erase(i);
+         }
+
+         for (const auto& shard : shards) {
+            for (const auto& subscriber : *shard.subscribers) {
+               std::lock_guard<std::mutex> lock(subscriber->mutex);
+               if (subscriber->closed)
+                  continue;
+            
+               subscriber->closed = true;
+               subscriber->queue.push_back(last);
+               write_next(subscriber);
+            }
+         }
+      }
+
+      size_t subscribers() const {
+         std::lock_guard<std::mutex> lock(mutex_);
+         return nSubscribers_;
+      }
+
+      // Events published, events queued to subscribers (live and
+      // replayed), and subscribers disconnected for falling behind.
+      size_t published() const { return published_; }
+      size_t delivered() const { return delivered_; }
+      size_t replayed() const { return replayed_; }
+      size_t dropped() const { return dropped_; }
+
+      // Serialize an event as a response chunk.
+      static std::string encode_event(
+         uint64_t id,
+         const std::string& event,
+         const std::string& data) {
+         std::ostringstream body;
+         body << "id: " << id << '\n';
+         if (!event.empty())
+            body << "event: " << event << '\n';
+
+         size_t begin = 0;
+         do {
+            size_t end = data.find('\n', begin);
+            if (end == std::string::npos)
+               end = data.size();
+
+            size_t lineEnd = end;
+            if (lineEnd > begin && data[lineEnd - 1] == '\r')
+               --lineEnd;
+            body << "data: ";
+            body.write(data.data() + begin, lineEnd - begin);
+            body << '\n';
+            begin = end + 1;
+         } while (begin <= data.size());
+         body << '\n';
+
+         const std::string payload = body.str();
+         std::ostringstream chunk;
+         chunk << std::hex << payload.size() << "\r\n" << payload << "\r\n";
+         return chunk.str();
+      }
+      
+   private:
+      struct Subscriber : boost::noncopyable {
+         const std::string channel;
+         const std::shared_ptr<Transaction> http;
+         std::mutex mutex;
+         std::vector<SharedEvent> queue;
+         std::vector<SharedEvent> writing;
+         std::vector<boost::asio::const_buffer> buffers;
+         size_t queuedBytes;
+         bool ready;            // response head written
+         bool closed;           // no more events will be queued
+         char discard[64];
+
+         Subscriber(const std::string& channel, const std::shared_ptr<Transaction>& http)
+            : channel(channel)
+            , http(http)
+            , queuedBytes(0)
+            , ready(false)
+            , closed(false) {
+         }
+      };
+      
+      typedef std::vector<std::shared_ptr<Subscriber> > Subscribers;
+
+      // Subscribers of a channel on one io_service. The list is
+      // copied on changes so writes can be started and close() can
+      // use it without the hub lock.
+      struct Shard {
+         boost::asio::io_service* io;
+         std::shared_ptr<const Subscribers> subscribers;
+
+         Shard(boost::asio::io_service* io)
+            : io(io)
+            , subscribers(std::make_shared<Subscribers>()) {
+         }
+      };
+      
+      struct Channel {
+         uint64_t lastId;
+         std::deque<std::pair<uint64_t, SharedEvent> > ring;
+         std::vector<Shard> shards;
+
+         Channel()
+            : lastId(0) {
+         }
+      };
+
+      const size_t replayCapacity_;
+      const size_t batchSize_;
+      mutable std::mutex mutex_;
+      std::map<std::string, Channel> channels_;
+      size_t nSubscribers_;
+      std::atomic<size_t> subscriberLimit_;
+      std::atomic<size_t> published_;
+      std::atomic<size_t> delivered_;
+      std::atomic<size_t> replayed_;
+      std::atomic<size_t> dropped_;
+
+      EventStreamHub(size_t replayCapacity, size_t batchSize)
+         : replayCapacity_(replayCapacity)
+         , batchSize_(std::max<size_t>(batchSize, 1))
+         , nSubscribers_(0)
+         , subscriberLimit_(DefaultSubscriberLimit)
+         , published_(0)
+         , delivered_(0)
+         , replayed_(0)
+         , dropped_(0) {
       }
 
-      template<typename MutableBufferSequence>
-      size_t read_some(MutableBufferSequence&& buffers) {
-         error_code error;
-         size_t nBytes = read_some(buffers, error);
-         if (error)
-            throw boost::system::system_error(error);
-         return nBytes;
+      // Start writes for a batch of subscribers on their io_service.
+      void start_writes(const Subscribers& subscribers, size_t begin, size_t end) {
+         for (size_t i = begin; i < end; ++i) {
+            std::lock_guard<std::mutex> lock(subscribers[i]->mutex);
+            write_next(subscribers[i]);
+         }
       }
 
-      template<typename ConstBufferSequence, typename WriteHandler>
-      void async_write_some(ConstBufferSequence&& buffers, WriteHandler&& handler) {
-         // Add prefix (response line, response headers, and chunk
-         // header) and suffix (chunk delimiter) around the client
-         // buffers.
-         auto nBytes = boost::asio::buffer_size(buffers);
-         auto chunk = std::make_shared<std::vector<boost::asio::const_buffer> >();
-         
-         auto prefix = std::make_shared<std::string>(prepare_write_prefix(nBytes));
-         if (!prefix->empty())
-            chunk->push_back(boost::asio::const_buffer(prefix->data(), prefix->size()));
+      // Start a gather write of the queued events. The subscriber
+      // mutex must be held.
+      void write_next(const std::shared_ptr<Subscriber>& subscriber) {
+         if (!subscriber->ready || !subscriber->writing.empty() || subscriber->queue.empty())
+            return;
 
-         for (const auto& buffer : buffers)
-            chunk->push_back(boost::asio::const_buffer(buffer));
-         
-         auto suffix = std::make_shared<std::string>(prepare_write_suffix(nBytes));
-         if (!suffix->empty())
-            chunk->push_back(boost::asio::const_buffer(suffix->data(), suffix->size()));
+         subscriber->writing.swap(subscriber->queue);
+         subscriber->buffers.clear();
+         for (const auto& event : subscriber->writing)
+            subscriber->buffers.push_back(boost::asio::buffer(*event));
 
+         auto this_ = this->shared_from_this();
          boost::asio::async_write(
-            *stream(), *chunk,
-            [=](const error_code& error, size_t) mutable {
+            *subscriber->http->stream(), detail::BufferView(subscriber->buffers),
+            [=](const error_code& error, size_t nBytes) {
                if (error) {
-                  handler(error, 0);
+                  this_->drop(subscriber);
                   return;
                }
+               
+               std::lock_guard<std::mutex> lock(subscriber->mutex);
+               subscriber->queuedBytes -= nBytes;
+               subscriber->writing.clear();
+               if (subscriber->closed && subscriber->queue.empty())
+                  subscriber->http->stream()->close_connection();
+               else
+                  this_->write_next(subscriber);
+            });
+      }
 
-               responseBytes_ += nBytes;
-               handler(error, nBytes);
+      void watch(const std::shared_ptr<Subscriber>& subscriber) {
+         auto this_ = this->shared_from_this();
+         subscriber->http->stream()->async_read_some(
+            boost::asio::buffer(subscriber->discard),
+            [=](const error_code& error, size_t) {
+               if (error)
+                  this_->drop(subscriber);
+               else
+                  this_->watch(subscriber);
+            });
+      }
 
-               // References for lifetime extension.
-               prefix.get();
-               suffix.get();
-               chunk.get();
+      // Unsubscribe after a client disconnect or I/O error.
+      void drop(const std::shared_ptr<Subscriber>& subscriber) {
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto i = channels_.find(subscriber->channel);
+            if (i != channels_.end())
+               remove(i->second, subscriber);
+         }
+         disconnect(subscriber);
+      }
+
+      // Add a subscriber to the shard for its io_service. The hub
+      // mutex must be held.
+      void add(Channel& state, const std::shared_ptr<Subscriber>& subscriber) {
+         boost::asio::io_service* io = &subscriber->http->get_io_service();
+         auto i = std::find_if(state.shards.begin(), state.shards.end(), [=](const Shard& shard) {
+               return shard.io == io;
             });
+         if (i == state.shards.end())
+            i = state.shards.insert(state.shards.end(), Shard(io));
+
+         auto subscribers = std::make_shared<Subscribers>(*i->subscribers);
+         subscribers->push_back(subscriber);
+         i->subscribers = subscribers;
+         ++nSubscribers_;
       }
       
-      template<typename ConstBufferSequence>
-      size_t write_some(ConstBufferSequence&& buffers, error_code& error) {
-         // Add prefix (response line, response headers, and chunk
-         // header) and suffix (chunk delimiter) around the client
-         // buffers.
-         auto nBytes = boost::asio::buffer_size(buffers);
-         auto chunk = std::make_shared<std::vector<boost::asio::const_buffer> >();
-         
-         auto prefix = std::make_shared<std::string>(prepare_write_prefix(nBytes));
-         if (!prefix->empty())
-            chunk->push_back(boost::asio::const_buffer(prefix->data(), prefix->size()));
+      // Remove a subscriber from a channel. The hub mutex must be held.
+      void remove(Channel& state, const std::shared_ptr<Subscriber>& subscriber) {
+         for (auto& shard : state.shards) {
+            auto i = std::find(shard.subscribers->begin(), shard.subscribers->end(), subscriber);
+            if (i != shard.subscribers->end()) {
+               auto subscribers = std::make_shared<Subscribers>(*shard.subscribers);
+               subscribers->erase(subscribers->begin() + (i - shard.subscribers->begin()));
+               shard.subscribers = subscribers;
+               --nSubscribers_;
+               return;
+            }
+         }
+      }
 
-         for (const auto& buffer : buffers)
-            chunk->push_back(boost::asio::const_buffer(buffer));
+      void disconnect(const std::shared_ptr<Subscriber>& subscriber) {
+         std::lock_guard<std::mutex> lock(subscriber->mutex);
+         subscriber->closed = true;
+         subscriber->queue.clear();
+         subscriber->http->stream()->close_connection();
+      }
+   };
+
+   // WebSocket protocol support.
+   namespace websocket {
+      // Function applying a 4-byte masking key to data starting at a
+      // key phase (offset modulo 4), returning the phase following
+      // the data.
+      typedef size_t (*MaskFunction)(char* data, size_t size, const char* key, size_t phase);
+
+      namespace detail {
+         // Repeat the key, starting at a phase, into a word.
+         template<typename Word>
+         inline Word mask_pattern(const char* key, size_t phase) {
+            unsigned char bytes[sizeof(Word)];
+            for (size_t i = 0; i < sizeof(Word); ++i)
+               bytes[i] = static_cast<unsigned char>(key[(phase + i) & 0x3]);
+
+            Word word;
+            std::memcpy(&word, bytes, sizeof(word));
+            return word;
+         }
+      }
+      
+      // Reference implementation, one byte at a time.
+      inline size_t mask_bytewise(char* data, size_t size, const char* key, size_t phase) {
+         for (size_t i = 0; i < size; ++i)
+            data[i] ^= key[phase++ & 0x3];
+         return phase & 0x3;
+      }
+
+      // Portable implementation using 64-bit words. Unaligned data
+      // is accessed with memcpy, which compiles to plain loads and
+      // stores where the CPU allows.
+      inline size_t mask_word(char* data, size_t size, const char* key, size_t phase) {
+         const uint64_t pattern = detail::mask_pattern<uint64_t>(key, phase);
+         for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            word ^= pattern;
+            std::memcpy(data, &word, sizeof(word));
+         }
+         return mask_bytewise(data, size, key, phase);
+      }
+
+#ifdef CHUNKY_X86_SIMD
+      // The SIMD kernels use unaligned loads and stores, which cost
+      // little on current CPUs, and finish the tail with the next
+      // narrower kernel. Whole vectors leave the phase unchanged.
+      __attribute__((target("sse2")))
+      inline size_t mask_sse2(char* data, size_t size, const char* key, size_t phase) {
+         const __m128i pattern = _mm_set1_epi32(detail::mask_pattern<int32_t>(key, phase));
+         for (; size >= 4 * sizeof(__m128i); data += 4 * sizeof(__m128i), size -= 4 * sizeof(__m128i)) {
+            __m128i* p = reinterpret_cast<__m128i*>(data);
+            _mm_storeu_si128(p + 0, _mm_xor_si128(_mm_loadu_si128(p + 0), pattern));
+            _mm_storeu_si128(p + 1, _mm_xor_si128(_mm_loadu_si128(p + 1), pattern));
+            _mm_storeu_si128(p + 2, _mm_xor_si128(_mm_loadu_si128(p + 2), pattern));
+            _mm_storeu_si128(p + 3, _mm_xor_si128(_mm_loadu_si128(p + 3), pattern));
+         }
+         for (; size >= sizeof(__m128i); data += sizeof(__m128i), size -= sizeof(__m128i)) {
+            __m128i* p = reinterpret_cast<__m128i*>(data);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), pattern));
+         }
+         return mask_word(data, size, key, phase);
+      }
+
+      __attribute__((target("avx2")))
+      inline size_t mask_avx2(char* data, size_t size, const char* key, size_t phase) {
+         const __m256i pattern = _mm256_set1_epi32(detail::mask_pattern<int32_t>(key, phase));
+         for (; size >= 4 * sizeof(__m256i); data += 4 * sizeof(__m256i), size -= 4 * sizeof(__m256i)) {
+            __m256i* p = reinterpret_cast<__m256i*>(data);
+            _mm256_storeu_si256(p + 0, _mm256_xor_si256(_mm256_loadu_si256(p + 0), pattern));
+            _mm256_storeu_si256(p + 1, _mm256_xor_si256(_mm256_loadu_si256(p + 1), pattern));
+            _mm256_storeu_si256(p + 2, _mm256_xor_si256(_mm256_loadu_si256(p + 2), pattern));
+            _mm256_storeu_si256(p + 3, _mm256_xor_si256(_mm256_loadu_si256(p + 3), pattern));
+         }
+         for (; size >= sizeof(__m256i); data += sizeof(__m256i), size -= sizeof(__m256i)) {
+            __m256i* p = reinterpret_cast<__m256i*>(data);
+            _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), pattern));
+         }
+         return mask_sse2(data, size, key, phase);
+      }
+#endif
+
+      // Get the mask implementations usable on this CPU, slowest
+      // first, e.g. for testing and benchmarking.
+      inline const std::vector<std::pair<const char*, MaskFunction> >& mask_functions() {
+         static const std::vector<std::pair<const char*, MaskFunction> > functions = []() {
+            std::vector<std::pair<const char*, MaskFunction> > result;
+            result.emplace_back("bytewise", &mask_bytewise);
+            result.emplace_back("word", &mask_word);
+#ifdef CHUNKY_X86_SIMD
+            if (__builtin_cpu_supports("sse2"))
+               result.emplace_back("sse2", &mask_sse2);
+            if (__builtin_cpu_supports("avx2"))
+               result.emplace_back("avx2", &mask_avx2);
+#endif
+            return result;
+         }();
+         return functions;
+      }
+      
+      // Mask or unmask data in place with the fastest implementation.
+      // Pass the returned phase to continue a payload in a later
+      // buffer.
+      inline size_t mask(char* data, size_t size, const char* key, size_t phase = 0) {
+         // Vector setup does not pay off for short payloads.
+         if (size < 64)
+            return mask_word(data, size, key, phase);
          
-         auto suffix = std::make_shared<std::string>(prepare_write_suffix(nBytes));
-         if (!suffix->empty())
-            chunk->push_back(boost::asio::const_buffer(suffix->data(), suffix->size()));
+         static const MaskFunction function = mask_functions().back().second;
+         return function(data, size, key, phase);
+      }
 
-         boost::asio::write(*stream(), *chunk, error);
-         responseBytes_ += nBytes;
-         return nBytes;
+      // Function returning the length of the ASCII prefix of data.
+      typedef size_t (*AsciiFunction)(const char* data, size_t size);
+
+      // Function masking like MaskFunction that also reports whether
+      // every resulting byte is ASCII, so a text payload can be
+      // unmasked and screened for validation in one pass.
+      typedef size_t (*MaskAsciiFunction)(char* data, size_t size, const char* key, size_t phase, bool* ascii);
+      
+      inline size_t ascii_bytewise(const char* data, size_t size) {
+         size_t i = 0;
+         while (i < size && !(data[i] & 0x80))
+            ++i;
+         return i;
       }
       
-      template<typename ConstBufferSequence>
-      size_t write_some(ConstBufferSequence&& buffers) {
-         error_code error;
-         size_t nBytes = write_some(buffers, error);
-         if (error)
-            throw boost::system::system_error(error);
-         return nBytes;
+      inline size_t ascii_word(const char* data, size_t size) {
+         size_t i = 0;
+         for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            if (word & UINT64_C(0x8080808080808080))
+               break;
+         }
+         return i + ascii_bytewise(data + i, size - i);
       }
 
-      std::shared_ptr<T>& stream() {
-         return stream_;
+      inline size_t mask_ascii_word(char* data, size_t size, const char* key, size_t phase, bool* ascii) {
+         const uint64_t pattern = detail::mask_pattern<uint64_t>(key, phase);
+         uint64_t bits = 0;
+         for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            word ^= pattern;
+            bits |= word;
+            std::memcpy(data, &word, sizeof(word));
+         }
+         for (size_t i = 0; i < size; ++i) {
+            data[i] ^= key[phase++ & 0x3];
+            bits |= static_cast<unsigned char>(data[i]);
+         }
+         *ascii = !(bits & UINT64_C(0x8080808080808080));
+         return phase & 0x3;
+      }
+      
+#ifdef CHUNKY_X86_SIMD
+      __attribute__((target("sse2")))
+      inline size_t ascii_sse2(const char* data, size_t size) {
+         size_t i = 0;
+         for (; i + sizeof(__m128i) <= size; i += sizeof(__m128i)) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            if (_mm_movemask_epi8(v))
+               break;
+         }
+         return i + ascii_word(data + i, size - i);
       }
 
-      // Set or get the internal buffer size for all subsequent
-      // HTTPTransaction instances. If the request line and headers
-      // exceed this size then a read error will be returned.
-      static size_t buffer_size(size_t nBytes = 0) {
-         static size_t bufferSize = 10486376;
-         if (nBytes)
-            bufferSize = nBytes;
-         return bufferSize;
+      __attribute__((target("avx2")))
+      inline size_t ascii_avx2(const char* data, size_t size) {
+         size_t i = 0;
+         for (; i + sizeof(__m256i) <= size; i += sizeof(__m256i)) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            if (_mm256_movemask_epi8(v))
+               break;
+         }
+         return i + ascii_sse2(data + i, size - i);
+      }
+
+      __attribute__((target("sse2")))
+      inline size_t mask_ascii_sse2(char* data, size_t size, const char* key, size_t phase, bool* ascii) {
+         const __m128i pattern = _mm_set1_epi32(detail::mask_pattern<int32_t>(key, phase));
+         __m128i bits = _mm_setzero_si128();
+         for (; size >= sizeof(__m128i); data += sizeof(__m128i), size -= sizeof(__m128i)) {
+            __m128i* p = reinterpret_cast<__m128i*>(data);
+            const __m128i v = _mm_xor_si128(_mm_loadu_si128(p), pattern);
+            bits = _mm_or_si128(bits, v);
+            _mm_storeu_si128(p, v);
+         }
+         phase = mask_ascii_word(data, size, key, phase, ascii);
+         *ascii = *ascii && !_mm_movemask_epi8(bits);
+         return phase;
+      }
+
+      __attribute__((target("avx2")))
+      inline size_t mask_ascii_avx2(char* data, size_t size, const char* key, size_t phase, bool* ascii) {
+         const __m256i pattern = _mm256_set1_epi32(detail::mask_pattern<int32_t>(key, phase));
+         __m256i bits = _mm256_setzero_si256();
+         for (; size >= sizeof(__m256i); data += sizeof(__m256i), size -= sizeof(__m256i)) {
+            __m256i* p = reinterpret_cast<__m256i*>(data);
+            const __m256i v = _mm256_xor_si256(_mm256_loadu_si256(p), pattern);
+            bits = _mm256_or_si256(bits, v);
+            _mm256_storeu_si256(p, v);
+         }
+         phase = mask_ascii_sse2(data, size, key, phase, ascii);
+         *ascii = *ascii && !_mm256_movemask_epi8(bits);
+         return phase;
+      }
+#endif
+
+      // Get the ASCII scan and fused mask implementations usable on
+      // this CPU, slowest first.
+      inline const std::vector<std::pair<const char*, AsciiFunction> >& ascii_functions() {
+         static const std::vector<std::pair<const char*, AsciiFunction> > functions = []() {
+            std::vector<std::pair<const char*, AsciiFunction> > result;
+            result.emplace_back("bytewise", &ascii_bytewise);
+            result.emplace_back("word", &ascii_word);
+#ifdef CHUNKY_X86_SIMD
+            if (__builtin_cpu_supports("sse2"))
+               result.emplace_back("sse2", &ascii_sse2);
+            if (__builtin_cpu_supports("avx2"))
+               result.emplace_back("avx2", &ascii_avx2);
+#endif
+            return result;
+         }();
+         return functions;
+      }
+
+      inline const std::vector<std::pair<const char*, MaskAsciiFunction> >& mask_ascii_functions() {
+         static const std::vector<std::pair<const char*, MaskAsciiFunction> > functions = []() {
+            std::vector<std::pair<const char*, MaskAsciiFunction> > result;
+            result.emplace_back("word", &mask_ascii_word);
+#ifdef CHUNKY_X86_SIMD
+            if (__builtin_cpu_supports("sse2"))
+               result.emplace_back("sse2", &mask_ascii_sse2);
+            if (__builtin_cpu_supports("avx2"))
+               result.emplace_back("avx2", &mask_ascii_avx2);
+#endif
+            return result;
+         }();
+         return functions;
+      }
+
+      // Get the length of the ASCII prefix of data.
+      inline size_t ascii_prefix(const char* data, size_t size) {
+         if (size < 16)
+            return ascii_bytewise(data, size);
+         
+         static const AsciiFunction function = ascii_functions().back().second;
+         return function(data, size);
       }
       
-      // Convert '+' to ' ' and percent decoding.
-      template<typename Iterator>
-      static std::string decode(Iterator&& bgn, Iterator&& end) {
-         std::string result;
+      // Mask or unmask data in place like mask(), setting ascii to
+      // whether all the unmasked bytes are ASCII.
+      inline size_t mask_ascii(char* data, size_t size, const char* key, size_t phase, bool& ascii) {
+         if (size < 64)
+            return mask_ascii_word(data, size, key, phase, &ascii);
+         
+         static const MaskAsciiFunction function = mask_ascii_functions().back().second;
+         return function(data, size, key, phase, &ascii);
+      }
+      
+      // Streaming UTF-8 validator (RFC 3629, as required for text
+      // messages by RFC 6455). Input may be split anywhere, e.g.
+      // across fragments; runs of ASCII are skipped with the vector
+      // scan and only multibyte sequences step the state machine.
+      class Utf8Validator {
+      public:
+         Utf8Validator() {
+            reset();
+         }
 
-         auto i = bgn;
-         std::smatch escapeMatch;
-         static std::regex escapeRegex("^([^+%]*)(?:\\+|(?:%([0-9A-Fa-f]{2})))");
-         while (i != end) {
-            // Look for a '+' or '%HH' where H is a valid hex digit.
-            if (std::regex_search(i, end, escapeMatch, escapeRegex)) {
-               // Concatenate everything up to the special character.
-               result += escapeMatch[1].str();
+         void reset() {
+            valid_ = true;
+            needed_ = 0;
+            lower_ = 0x80;
+            upper_ = 0xbf;
+         }
 
-               // Concatenate the unescaped character.
-               if (escapeMatch[2].matched)
-                  result += static_cast<char>(std::stoi(escapeMatch[2].str(), 0, 16));
-               else
-                  result += ' ';
+         // Validate more input, returning false once any input is
+         // invalid.
+         bool update(const char* data, size_t size) {
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+            const unsigned char* end = p + size;
+            while (valid_ && p != end) {
+               if (!needed_ && *p < 0x80) {
+                  p += ascii_prefix(reinterpret_cast<const char*>(p), end - p);
+                  continue;
+               }
+               valid_ = step(*p++);
+            }
+            return valid_;
+         }
 
-               // Update the iterator.
-               i = escapeMatch[0].second;
+         // Unmask and validate in one pass over the data, rescanning
+         // (while still in cache) only blocks that are not all ASCII.
+         // Returns the key phase following the data.
+         size_t update_masked(char* data, size_t size, const char* key, size_t phase) {
+            const size_t BlockSize = 4096;
+            while (size) {
+               const size_t n = std::min(size, BlockSize);
+               bool ascii;
+               phase = mask_ascii(data, n, key, phase, ascii);
+               if (!ascii || needed_)
+                  update(data, n);
+               data += n;
+               size -= n;
+            }
+            return phase;
+         }
+         
+         // Returns true if the input so far is valid and does not end
+         // within a character.
+         bool complete() const {
+            return valid_ && !needed_;
+         }
+
+         bool valid() const {
+            return valid_;
+         }
+         
+      private:
+         bool valid_;
+         unsigned int needed_;
+         unsigned char lower_;
+         unsigned char upper_;
+         
+         bool step(unsigned char c) {
+            if (needed_) {
+               if (c < lower_ || c > upper_)
+                  return false;
+               lower_ = 0x80;
+               upper_ = 0xbf;
+               --needed_;
+            }
+            else if (c >= 0xc2 && c <= 0xdf)
+               needed_ = 1;
+            else if (c >= 0xe0 && c <= 0xef) {
+               // Exclude overlong forms and surrogates.
+               needed_ = 2;
+               lower_ = c == 0xe0 ? 0xa0 : 0x80;
+               upper_ = c == 0xed ? 0x9f : 0xbf;
+            }
+            else if (c >= 0xf0 && c <= 0xf4) {
+               // Exclude overlong forms and code points past U+10FFFF.
+               needed_ = 3;
+               lower_ = c == 0xf0 ? 0x90 : 0x80;
+               upper_ = c == 0xf4 ? 0x8f : 0xbf;
+            }
+            else
+               return c < 0x80;
+            return true;
+         }
+      };
+      
+      // Frame type byte values (RFC 6455 section 5.2), combining the
+      // FIN bit and opcode.
+      enum FrameType {
+         continuation = 0x0,
+         text         = 0x1,
+         binary       = 0x2,
+         close        = 0x8,
+         ping         = 0x9,
+         pong         = 0xa,
+         rsv1         = 0x40,
+         fin          = 0x80
+      };
+
+      // A decoded frame. The unmasked payload is a view into reader
+      // storage, valid until the reader is next filled. Unmasking
+      // also notes whether the payload is all ASCII (false if
+      // unknown), which spares text validation. masked is the MASK
+      // bit, which every client frame must set (RFC 6455 section
+      // 5.1).
+      struct Frame {
+         uint8_t type;
+         char* data;
+         size_t size;
+         bool ascii;
+         bool masked;
+
+         Frame()
+            : type(0)
+            , data(nullptr)
+            , size(0)
+            , ascii(false)
+            , masked(false) {
+         }
+
+         uint8_t opcode() const { return type & 0x0f; }
+         bool is_fin() const { return (type & fin) != 0; }
+         bool is_control() const { return (type & 0x08) != 0; }
+      };
+      
+      // Incremental frame decoder over a per-connection buffer. Each
+      // socket read fills as much of the buffer as is available and
+      // next() then decodes every complete frame in place, so a burst
+      // of small frames costs one read and no allocation. A frame too
+      // large for the buffer is collected in separate storage, which
+      // grows as its bytes arrive and is reused for later frames.
+      //
+      // Usage:
+      //   stream.async_read_some(reader.prepare(), ...);
+      //   reader.commit(nBytes);
+      //   while (reader.next(frame, error))
+      //      ...
+      class FrameReader : boost::noncopyable {
+      public:
+         enum {
+            DefaultCapacity = 65536,
+            DefaultMaxPayload = 64 << 20
+         };
+
+         explicit FrameReader(
+            size_t capacity = DefaultCapacity,
+            size_t maxPayload = DefaultMaxPayload)
+            : buffer_(std::max<size_t>(capacity, MaxHeaderSize))
+            , input_(nullptr)
+            , begin_(0)
+            , end_(0)
+            , maxPayload_(maxPayload)
+            , largeSize_(0)
+            , largeFilled_(0)
+            , largeType_(0)
+            , largeMasked_(false)
+            , largePending_(false) {
+         }
+
+         // Get the buffer for the next read.
+         boost::asio::mutable_buffers_1 prepare() {
+            if (largeFilled_ < largeSize_) {
+               // Grow large payload storage only as bytes arrive, so
+               // a declared length alone does not commit memory.
+               if (largeFilled_ == large_.size())
+                  large_.resize(std::min(largeSize_, std::max(2 * large_.size(), buffer_.size())));
+               return boost::asio::mutable_buffers_1(&large_[largeFilled_], large_.size() - largeFilled_);
+            }
+
+            // Move any partial frame to the front.
+            if (begin_) {
+               std::memmove(&buffer_[0], &buffer_[begin_], end_ - begin_);
+               end_ -= begin_;
+               begin_ = 0;
+            }
+            return boost::asio::mutable_buffers_1(&buffer_[end_], buffer_.size() - end_);
+         }
+
+         // Add bytes read into the prepare() buffer.
+         void commit(size_t nBytes) {
+            if (largeFilled_ < largeSize_)
+               largeFilled_ += nBytes;
+            else
+               end_ += nBytes;
+         }
+
+         // Decode frames in place from caller-owned bytes, e.g. read
+         // past a WebSocket handshake, before reading into the buffer.
+         // Call this before any reads. The bytes must stay valid until
+         // next() returns false, when an incomplete frame at their end
+         // is copied into the buffer.
+         void assign(char* data, size_t size) {
+            assert(begin_ == end_ && !largeSize_);
+            input_ = data;
+            begin_ = 0;
+            end_ = size;
+         }
+         
+         // Decode the next complete frame, returning false if more
+         // data are needed or on error.
+         bool next(Frame& frame, boost::system::error_code& error) {
+            if (decode(frame, error))
+               return true;
+
+            // Switch from assigned bytes to the buffer.
+            if (input_ && !error) {
+               std::memcpy(&buffer_[0], input_ + begin_, end_ - begin_);
+               end_ -= begin_;
+               begin_ = 0;
+               input_ = nullptr;
+            }
+            return false;
+         }
+
+         // Bytes buffered but not yet decoded.
+         size_t buffered() const {
+            return end_ - begin_ + (largeFilled_ < largeSize_ ? largeFilled_ : 0);
+         }
+         
+      private:
+         enum { MaxHeaderSize = 14 };
+         
+         std::vector<char> buffer_;
+         char* input_;          // assigned bytes, decoded before buffer_
+         size_t begin_;
+         size_t end_;
+         const size_t maxPayload_;
+
+         // Storage for a payload that does not fit in the buffer. It
+         // grows to at most the largest payload received and is kept
+         // for reuse.
+         std::vector<char> large_;
+         size_t largeSize_;
+         size_t largeFilled_;
+         uint8_t largeType_;
+         bool largeMasked_;
+         bool largePending_;
+         char largeKey_[4];
+
+         // Decode from the assigned bytes or the buffer.
+         bool decode(Frame& frame, boost::system::error_code& error) {
+            error = boost::system::error_code();
+            if (largeSize_) {
+               if (largeFilled_ < largeSize_)
+                  return false;
+
+               // Deliver the large frame, releasing it (but keeping
+               // its storage for the next one) on the following call.
+               if (largePending_) {
+                  frame.ascii = false;
+                  if (largeKey_[0] | largeKey_[1] | largeKey_[2] | largeKey_[3])
+                     mask_ascii(&large_[0], largeSize_, largeKey_, 0, frame.ascii);
+                  frame.type = largeType_;
+                  frame.masked = largeMasked_;
+                  frame.data = &large_[0];
+                  frame.size = largeSize_;
+                  largePending_ = false;
+                  return true;
+               }
+               
+               large_.clear();
+               largeSize_ = largeFilled_ = 0;
+            }
+            
+            const size_t nAvailable = end_ - begin_;
+            if (nAvailable < 2)
+               return false;
+
+            char* const data = input_ ? input_ : &buffer_[0];
+            const unsigned char* header = reinterpret_cast<unsigned char*>(data + begin_);
+            size_t nLengthBytes = 0;
+            uint64_t nPayloadBytes = header[1] & 0x7f;
+            switch (nPayloadBytes) {
+            case 126:
+               nLengthBytes = 2;
+               break;
+            case 127:
+               nLengthBytes = 8;
+               break;
+            }
+            const size_t nMaskBytes = (header[1] & 0x80) ? 4 : 0;
+            const size_t nHeaderBytes = 2 + nLengthBytes + nMaskBytes;
+            if (nAvailable < nHeaderBytes)
+               return false;
+
+            if (nLengthBytes) {
+               nPayloadBytes = 0;
+               for (size_t i = 0; i < nLengthBytes; ++i)
+                  nPayloadBytes = (nPayloadBytes << 8) | header[2 + i];
+            }
+            if (nPayloadBytes > maxPayload_) {
+               error = make_error_code(boost::asio::error::message_size);
+               return false;
+            }
+
+            char key[4] = { 0, 0, 0, 0 };
+            if (nMaskBytes)
+               std::memcpy(key, &header[2 + nLengthBytes], sizeof(key));
+
+            const uint8_t type = header[0];
+            char* payload = data + begin_ + nHeaderBytes;
+            const size_t nPayload = static_cast<size_t>(nPayloadBytes);
+            if (nAvailable < nHeaderBytes + nPayload &&
+                nHeaderBytes + nPayload > buffer_.size()) {
+               // Collect a large payload outside the buffer.
+               const size_t nBuffered = nAvailable - nHeaderBytes;
+               large_.assign(payload, payload + nBuffered);
+               largeSize_ = nPayload;
+               largeFilled_ = nBuffered;
+               largeType_ = type;
+               largeMasked_ = nMaskBytes != 0;
+               largePending_ = true;
+               std::memcpy(largeKey_, key, sizeof(key));
+               begin_ = end_ = 0;
+               input_ = nullptr;
+               return decode(frame, error);
+            }
+            
+            if (nAvailable < nHeaderBytes + nPayload)
+               return false;
+
+            frame.ascii = false;
+            if (nMaskBytes)
+               mask_ascii(payload, nPayload, key, 0, frame.ascii);
+            frame.type = type;
+            frame.masked = nMaskBytes != 0;
+            frame.data = payload;
+            frame.size = nPayload;
+            begin_ += nHeaderBytes + nPayload;
+            return true;
+         }
+      };
+
+      enum {
+         MaxControlPayload = 125,
+         MaxServerHeader = 10,
+         MaxClientHeader = 14
+      };
+      
+      // Write an unmasked (server) frame header, returning its size.
+      inline size_t encode_header(char* header, uint8_t type, uint64_t nPayloadBytes) {
+         header[0] = static_cast<char>(type);
+         if (nPayloadBytes < 126) {
+            header[1] = static_cast<char>(nPayloadBytes);
+            return 2;
+         }
+         else if (nPayloadBytes < 65536) {
+            header[1] = static_cast<char>(126);
+            header[2] = static_cast<char>((nPayloadBytes >> 8) & 0xff);
+            header[3] = static_cast<char>((nPayloadBytes >> 0) & 0xff);
+            return 4;
+         }
+
+         header[1] = static_cast<char>(127);
+         for (size_t i = 0; i < 8; ++i)
+            header[2 + i] = static_cast<char>((nPayloadBytes >> (56 - 8*i)) & 0xff);
+         return 10;
+      }
+
+      // Write a masked (client) frame header, returning its size. The
+      // payload must be masked with the same key (see mask()).
+      inline size_t encode_client_header(
+         char* header,
+         uint8_t type,
+         uint64_t nPayloadBytes,
+         const char* key) {
+         const size_t nBytes = encode_header(header, type, nPayloadBytes);
+         header[1] = static_cast<char>(header[1] | 0x80);
+         std::memcpy(header + nBytes, key, 4);
+         return nBytes + 4;
+      }
+
+#ifdef ZLIB_H
+      // permessage-deflate (RFC 7692) parameters, used both for
+      // server configuration and for the result of negotiation.
+      struct DeflateOptions {
+         // Reset the compressor (server) or decompressor (client)
+         // after each message, trading ratio for memory.
+         bool serverNoContextTakeover;
+         bool clientNoContextTakeover;
+
+         // LZ77 window sizes (9 to 15; zlib cannot produce 8).
+         int serverMaxWindowBits;
+         int clientMaxWindowBits;
+
+         // zlib compression level (0 to 9) and memory level (1 to 9).
+         int level;
+         int memLevel;
+
+         // Messages shorter than this are sent uncompressed.
+         size_t threshold;
+
+         DeflateOptions()
+            : serverNoContextTakeover(false)
+            , clientNoContextTakeover(false)
+            , serverMaxWindowBits(15)
+            , clientMaxWindowBits(15)
+            , level(Z_DEFAULT_COMPRESSION)
+            , memLevel(8)
+            , threshold(256) {
+         }
+      };
+
+      // Choose the first acceptable permessage-deflate offer in a
+      // Sec-WebSocket-Extensions request header. Returns the response
+      // header value (empty if no offer is acceptable) and sets the
+      // agreed parameters.
+      inline std::string negotiate_deflate(
+         const std::string& offers,
+         const DeflateOptions& config,
+         DeflateOptions& agreed) {
+         std::vector<std::string> extensions;
+         boost::split(extensions, offers, boost::is_any_of(","));
+         for (const auto& extension : extensions) {
+            std::vector<std::string> params;
+            boost::split(params, extension, boost::is_any_of(";"));
+            for (auto& param : params)
+               boost::trim(param);
+            if (params[0] != "permessage-deflate")
+               continue;
+
+            agreed = config;
+            bool valid = true;
+            bool clientBitsOffered = false;
+            for (size_t i = 1; valid && i < params.size(); ++i) {
+               const auto equals = params[i].find('=');
+               const std::string name = boost::trim_copy(params[i].substr(0, equals));
+               std::string value;
+               if (equals != std::string::npos)
+                  value = boost::trim_copy_if(params[i].substr(equals + 1), boost::is_any_of(" \t\""));
+               const int bits = value.empty() ? 0 : std::atoi(value.c_str());
+               
+               if (name == "server_no_context_takeover" && value.empty())
+                  agreed.serverNoContextTakeover = true;
+               else if (name == "client_no_context_takeover" && value.empty())
+                  agreed.clientNoContextTakeover = true;
+               else if (name == "server_max_window_bits" && bits >= 9 && bits <= 15)
+                  agreed.serverMaxWindowBits = std::min(agreed.serverMaxWindowBits, bits);
+               else if (name == "client_max_window_bits" && (value.empty() || (bits >= 8 && bits <= 15))) {
+                  clientBitsOffered = true;
+                  if (bits)
+                     agreed.clientMaxWindowBits = std::max(9, std::min(agreed.clientMaxWindowBits, bits));
+               }
+               else
+                  valid = false;
             }
-            else {
-               // No matches so concatenate the remainder.
-               result += std::string(i, end);
-               i = end;
+            if (!valid)
+               continue;
+
+            // A client that does not offer client_max_window_bits may
+            // use the full window.
+            if (!clientBitsOffered)
+               agreed.clientMaxWindowBits = 15;
+            
+            std::string response("permessage-deflate");
+            if (agreed.serverNoContextTakeover)
+               response += "; server_no_context_takeover";
+            if (agreed.clientNoContextTakeover)
+               response += "; client_no_context_takeover";
+            if (agreed.serverMaxWindowBits < 15)
+               response += "; server_max_window_bits=" + std::to_string(agreed.serverMaxWindowBits);
+            if (clientBitsOffered && agreed.clientMaxWindowBits < 15)
+               response += "; client_max_window_bits=" + std::to_string(agreed.clientMaxWindowBits);
+            return response;
+         }
+         return std::string();
+      }
+
+      // Per-session permessage-deflate compressor and decompressor,
+      // configured with negotiated parameters.
+      class Deflate : boost::noncopyable {
+      public:
+         explicit Deflate(const DeflateOptions& options)
+            : options_(options) {
+            std::memset(&deflate_, 0, sizeof(deflate_));
+            std::memset(&inflate_, 0, sizeof(inflate_));
+            if (deflateInit2(
+                   &deflate_, options.level, Z_DEFLATED,
+                   -options.serverMaxWindowBits, options.memLevel,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+               throw std::bad_alloc();
+            if (inflateInit2(&inflate_, -options.clientMaxWindowBits) != Z_OK) {
+               deflateEnd(&deflate_);
+               throw std::bad_alloc();
             }
          }
+
+         ~Deflate() {
+            deflateEnd(&deflate_);
+            inflateEnd(&inflate_);
+         }
+
+         const DeflateOptions& options() const {
+            return options_;
+         }
+
+         // Compress a message into a frame payload.
+         void compress(const char* data, size_t size, std::string& out) {
+            out.clear();
+            deflate_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            deflate_.avail_in = static_cast<uInt>(size);
+            do {
+               const size_t nUsed = out.size();
+               out.resize(nUsed + size/2 + 64);
+               deflate_.next_out = reinterpret_cast<Bytef*>(&out[nUsed]);
+               deflate_.avail_out = static_cast<uInt>(out.size() - nUsed);
+               deflate(&deflate_, Z_SYNC_FLUSH);
+               out.resize(out.size() - deflate_.avail_out);
+            } while (deflate_.avail_out == 0);
+
+            // Remove the empty block trailer (0x00 0x00 0xff 0xff).
+            out.resize(out.size() - 4);
+            if (options_.serverNoContextTakeover)
+               deflateReset(&deflate_);
+         }
+
+         // Discard compressor history, e.g. after a compressed message
+         // is not sent.
+         void reset_compressor() {
+            deflateReset(&deflate_);
+         }
          
-         return result;
-      }
+         // Decompress a message payload, failing with message_size if
+         // the result would exceed maxSize.
+         bool decompress(
+            const char* data, size_t size,
+            std::vector<char>& out, size_t maxSize,
+            boost::system::error_code& error) {
+            static const char trailer[] = { 0x00, 0x00, '\xff', '\xff' };
+            out.clear();
+            const bool result =
+               inflate_some(data, size, out, maxSize, error) &&
+               inflate_some(trailer, sizeof(trailer), out, maxSize, error);
+            if (!result || options_.clientNoContextTakeover)
+               inflateReset(&inflate_);
+            return result;
+         }
 
-      static Query parse_query(const std::string& s) {
-         Query query;
+      private:
+         DeflateOptions options_;
+         z_stream deflate_;
+         z_stream inflate_;
 
-         auto i = s.begin();
-         std::smatch paramMatch;
-         static std::regex paramRegex("^([^=&]+)(=)?([^&]*)&?");
-         while (std::regex_search(i, s.end(), paramMatch, paramRegex)) {
-            if (paramMatch[2].matched) {
-               std::string key = decode(paramMatch[1].first, paramMatch[1].second);
-               std::string value = decode(paramMatch[3].first, paramMatch[3].second);
-               query[key] = value;
-            }
-            
-            i = paramMatch[0].second;
+         bool inflate_some(
+            const char* data, size_t size,
+            std::vector<char>& out, size_t maxSize,
+            boost::system::error_code& error) {
+            inflate_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            inflate_.avail_in = static_cast<uInt>(size);
+            do {
+               const size_t nUsed = out.size();
+               out.resize(nUsed + std::max<size_t>(4096, 2*size));
+               inflate_.next_out = reinterpret_cast<Bytef*>(&out[nUsed]);
+               inflate_.avail_out = static_cast<uInt>(out.size() - nUsed);
+               const int status = inflate(&inflate_, Z_SYNC_FLUSH);
+               out.resize(out.size() - inflate_.avail_out);
+               if (status != Z_OK && status != Z_BUF_ERROR && status != Z_STREAM_END) {
+                  error = make_error_code(boost::system::errc::bad_message);
+                  return false;
+               }
+               if (out.size() > maxSize) {
+                  error = make_error_code(boost::asio::error::message_size);
+                  return false;
+               }
+            } while (inflate_.avail_out == 0);
+            return true;
          }
+      };
+#endif // ZLIB_H
+      
+      // An encoded frame that can be queued to any number of sessions.
+      typedef std::shared_ptr<const std::string> SharedFrame;
 
-         return query;
+      // Whether sessions on a stream type copy small frames together
+      // before writing. Asio SSL streams write only the first buffer
+      // of a sequence per call, each as a separate TLS record, so a
+      // gather write of many small frames costs a record and a
+      // system call per buffer.
+      template<typename T>
+      struct CoalesceWrites : std::false_type {};
+#ifdef BOOST_ASIO_SSL_HPP
+      template<>
+      struct CoalesceWrites<TLS> : std::true_type {};
+#endif
+
+      // Encode a server frame once for sharing.
+      inline SharedFrame make_frame(uint8_t type, const boost::asio::const_buffer& payload) {
+         const size_t nPayloadBytes = boost::asio::buffer_size(payload);
+         auto frame = std::make_shared<std::string>(MaxServerHeader + nPayloadBytes, '\0');
+         const size_t nHeaderBytes = encode_header(&(*frame)[0], type, nPayloadBytes);
+         std::memcpy(&(*frame)[nHeaderBytes], boost::asio::buffer_cast<const char*>(payload), nPayloadBytes);
+         frame->resize(nHeaderBytes + nPayloadBytes);
+         return frame;
       }
-      
-   private:
-      enum { MaxDiscardBufferSize = 65536 };
-      
-      std::shared_ptr<T> stream_;
-      boost::asio::streambuf streambuf_;
-      
-      std::string requestMethod_;
-      std::string requestVersion_;
-      std::string requestResource_;
-      Headers requestHeaders_;
+   }
 
-      std::string requestPath_;
-      std::string requestFragment_;
-      Query requestQuery_;
-      
-      size_t requestBytes_;
-      bool requestChunksPending_;
-      
-      unsigned int responseStatus_;
-      Headers responseHeaders_;
-      Headers responseTrailers_;
+   // Server side of a WebSocket connection, created from an
+   // HTTPTransaction after its 101 response has been finished (the
+   // application performs the handshake). The transaction may be HTTP
+   // (ws://) or HTTPS (wss://); bytes it read past the request are
+   // put back on the stream, so frames sent along with the handshake
+   // are received by the session. The session owns the
+   // per-connection read and write state: frames are decoded in place
+   // by a FrameReader, fragmented messages are reassembled into a
+   // reused buffer, pings are answered, and the close handshake is
+   // completed. Receive buffers grow only as bytes arrive and are
+   // kept, so once they have reached the largest frame and message
+   // received, frame I/O does not allocate.
+   //
+   // Sends may be made from any thread without waiting for earlier
+   // sends. Frames queued while a write is in progress go out
+   // together in the next gather write, so many small messages cost
+   // one system call.
+   template<typename T>
+   class WebSocketSession : public std::enable_shared_from_this<WebSocketSession<T> >
+                          , boost::noncopyable {
+   public:
+      typedef boost::system::error_code error_code;
+      typedef std::function<void(const error_code&)> Handler;
+      typedef std::function<void(const error_code&, uint8_t, const char*, size_t)> MessageHandler;
+      typedef std::function<void(const char*, size_t)> PongHandler;
 
-      size_t responseBytes_;
-      bool responseChunked_;
+      // Close status codes (RFC 6455 section 7.4.1).
+      enum CloseCode {
+         normal_closure   = 1000,
+         going_away       = 1001,
+         protocol_error   = 1002,
+         unsupported_data = 1003,
+         invalid_payload  = 1007,
+         policy_violation = 1008,
+         message_too_big  = 1009,
+         internal_error   = 1011
+      };
 
-      static const std::string& crlf() {
-         static const std::string s("\r\n");
-         return s;
+      enum {
+         DefaultMaxMessage = 16 << 20
+      };
+      
+      static std::shared_ptr<WebSocketSession> create(
+         const std::shared_ptr<HTTPTransaction<T> >& http,
+         size_t bufferSize = websocket::FrameReader::DefaultCapacity,
+         size_t maxMessage = DefaultMaxMessage) {
+         return std::shared_ptr<WebSocketSession>(
+            new WebSocketSession(http->stream(), bufferSize, maxMessage));
       }
 
-      static const std::string& crlf2() {
-         static const std::string s("\r\n\r\n");
-         return s;
+      // Create a session on a stream from
+      // HTTPTransaction::release_stream(), taking ownership of the
+      // bytes read past the request.
+      static std::shared_ptr<WebSocketSession> create(
+         const std::shared_ptr<T>& stream,
+         std::string leftover,
+         size_t bufferSize = websocket::FrameReader::DefaultCapacity,
+         size_t maxMessage = DefaultMaxMessage) {
+         std::shared_ptr<WebSocketSession> session(new WebSocketSession(stream, bufferSize, maxMessage));
+         session->leftover_.swap(leftover);
+         return session;
       }
 
-      // Asynchronously guarantee that the body buffer contains the
-      // delimiter. This allows subsequent synchronous read_until()
-      // calls to succeed without blocking.
-      void async_load_buffer(const std::string& delimiter, const Handler& handler) {
-         boost::asio::async_read_until(
-            *stream(), streambuf_, delimiter,
-            [=](const error_code& error, size_t) {
-               handler(error);
+      const std::shared_ptr<T>& stream() const {
+         return stream_;
+      }
+
+      // Start receiving messages. The handler is called with the
+      // opcode (text or binary) and payload of each complete message;
+      // the payload is only valid until the handler returns. When the
+      // connection ends the handler is called once more with an error,
+      // boost::asio::error::eof for a close frame (see close_code()).
+      void start(MessageHandler handler) {
+         messageHandler_ = std::move(handler);
+         if (leftover_.empty()) {
+            read();
+            return;
+         }
+
+         auto this_ = this->shared_from_this();
+         stream_->get_io_service().post([=]() {
+               this_->receive_leftover();
             });
       }
 
-      // Synchronously guarantee that the body buffer contains the
-      // delimiter.
-      void sync_load_buffer(const std::string& delimiter, const Handler& handler) {
-         error_code error;
-         boost::asio::read_until(*stream(), streambuf_, delimiter, error);
-         handler(error);
+      // What to do with a send that would exceed the queue limit.
+      enum OverflowPolicy {
+         drop_newest,           // reject the new message
+         drop_oldest,           // discard unsent whole messages, oldest first
+         close_session          // close with status 1008
+      };
+
+      enum {
+         DefaultLowWatermark = 16384,
+         DefaultHighWatermark = 65536,
+         DefaultCoalesceLimit = 16384
+      };
+      
+      // Set the queued byte counts at which queue_send() reports
+      // backpressure (high) and async_wait_writable() resumes (low).
+      void set_send_watermarks(size_t low, size_t high) {
+         std::lock_guard<std::mutex> lock(writeMutex_);
+         lowWatermark_ = std::min(low, high);
+         highWatermark_ = high;
       }
 
-      void putback_buffer() {
-         if (auto unused = streambuf_.size()) {
-            stream()->put_back(streambuf_.data());
-            streambuf_.consume(unused);
+      // Bound the payload bytes queued or in progress for a slow
+      // consumer. A message is always accepted into an empty queue.
+      // Zero is unlimited.
+      void set_send_limit(size_t nBytes, OverflowPolicy policy = drop_newest) {
+         std::lock_guard<std::mutex> lock(writeMutex_);
+         sendLimit_ = nBytes;
+         overflowPolicy_ = policy;
+      }
+      
+      // Copy runs of buffers smaller than the limit into one buffer
+      // before each write, so streams that write a buffer per call
+      // send fewer, fuller writes. Zero disables. By default this is
+      // enabled (with DefaultCoalesceLimit) where
+      // websocket::CoalesceWrites is true.
+      void set_write_coalescing(size_t nBytes) {
+         std::lock_guard<std::mutex> lock(writeMutex_);
+         coalesceLimit_ = nBytes;
+      }
+      
+      // Queue a complete message (or a fragment, if the type lacks the
+      // fin bit). Returns false if the message was dropped or once the
+      // bytes queued or in progress reach the high watermark, after
+      // which producers should wait with async_wait_writable().
+      bool queue_send(uint8_t type, std::string payload) {
+         std::unique_lock<std::mutex> deflateLock(deflateMutex_, std::defer_lock);
+#ifdef ZLIB_H
+         if (compressible(type, payload.size())) {
+            deflateLock.lock();
+            std::string compressed;
+            deflate_->compress(payload.data(), payload.size(), compressed);
+            payload.swap(compressed);
+            type |= websocket::rsv1;
          }
+#endif
+         std::unique_lock<std::mutex> lock(writeMutex_);
+         Outbound outbound(type, payload.size());
+         outbound.data = std::move(payload);
+         outbound.owned = true;
+         bool writable;
+         return enqueue(lock, outbound, &writable) && writable;
       }
       
-      // Asynchronously discard any unread body.
-      void async_discard(const Handler& handler) {
-         if (requestBytes_) {
-            auto bufferSize = std::min(requestBytes_, static_cast<size_t>(MaxDiscardBufferSize));
-            auto buffer = std::make_shared<std::vector<char> >(bufferSize);
-            boost::asio::async_read(
-               *this, boost::asio::buffer(*buffer),
-               boost::asio::transfer_exactly(requestBytes_),
-               [=](const error_code& error, size_t) {
-                  if (error) {
-                     handler(error);
-                     return;
-                  }
+      // Send a message (or fragment) asynchronously. The payload must
+      // remain valid until the handler is called; the handler gets
+      // boost::asio::error::no_buffer_space if the message is dropped
+      // by the queue limit.
+      void async_send(
+         uint8_t type,
+         const boost::asio::const_buffer& payload,
+         Handler handler) {
+         std::unique_lock<std::mutex> deflateLock(deflateMutex_, std::defer_lock);
+#ifdef ZLIB_H
+         const size_t size = boost::asio::buffer_size(payload);
+         if (compressible(type, size)) {
+            deflateLock.lock();
+            std::string compressed;
+            deflate_->compress(boost::asio::buffer_cast<const char*>(payload), size, compressed);
 
-                  async_discard(handler);
-                  buffer.get();
-               });
+            std::unique_lock<std::mutex> lock(writeMutex_);
+            Outbound outbound(type | websocket::rsv1, compressed.size());
+            outbound.data = std::move(compressed);
+            outbound.owned = true;
+            outbound.handler = std::move(handler);
+            enqueue(lock, outbound);
+            return;
          }
-         else
-            handler(error_code());
+#endif
+         std::unique_lock<std::mutex> lock(writeMutex_);
+         Outbound outbound(type, boost::asio::buffer_size(payload));
+         outbound.payload = payload;
+         outbound.handler = std::move(handler);
+         enqueue(lock, outbound);
       }
 
-      // Synchronously discard any unread body.
-      void sync_discard(const Handler& handler) {
-         while (requestBytes_) {
-            error_code error;
-            auto bufferSize = std::min(requestBytes_, static_cast<size_t>(MaxDiscardBufferSize));
-            auto buffer = std::make_shared<std::vector<char> >(bufferSize);
-            boost::asio::read(
-               *this, boost::asio::buffer(*buffer),
-               boost::asio::transfer_exactly(requestBytes_),
-               error);
-            if (error) {
-               handler(error);
+      // Invoke the handler when the bytes queued or in progress fall
+      // to the low watermark, or the session can no longer send.
+      void async_wait_writable(const Handler& handler) {
+         error_code error;
+         {
+            std::lock_guard<std::mutex> lock(writeMutex_);
+            if (queuedBytes_ > lowWatermark_ && !closeSent_) {
+               writeWaiters_.emplace_back(lowWatermark_, handler);
                return;
             }
-
-            buffer.get();
+            if (closeSent_)
+               error = make_error_code(boost::asio::error::operation_aborted);
          }
-
-         handler(error_code());
+         
+         stream_->get_io_service().post([=]() { handler(error); });
       }
-
-      // Get the next line (through CRLF) from the underlying stream.
-      // The read is via the streambuf so it should not block if
-      // the buffer has previously been loaded.
-      std::string get_line() {
-         auto nBytes = boost::asio::read_until(*stream(), streambuf_, crlf());
-         auto i = boost::asio::buffers_begin(streambuf_.data());
-         std::string s(i, i + nBytes - crlf().size());
-         streambuf_.consume(nBytes);
-         return s;
+      
+      // Payload bytes queued or in progress.
+      size_t queued_bytes() const {
+         std::lock_guard<std::mutex> lock(writeMutex_);
+         return queuedBytes_;
       }
 
-      // Common synchronous/asynchronous create() helper.
-      typedef std::function<void(const std::string&, const Handler&)> LoadBufferFunc;
-      void create(const LoadBufferFunc& loadBufferFunc, const Handler& handler) {
-         loadBufferFunc(crlf2(), [=](const error_code& error) {
-               if (error) {
-                  handler(error);
-                  return;
-               }
-               
-               if (error_code error = read_request_line()) {
-                  handler(error);
-                  return;
-               }
-                  
-               if (error_code error = read_request_headers()) {
-                  handler(error);
-                  return;
-               }
-               
-               read_length(loadBufferFunc, [=](const error_code& error) {
-                     handler(error);
-                  });
-            });
+      // Messages discarded by the queue limit.
+      size_t dropped() const {
+         return dropped_;
       }
 
-      error_code read_request_line() {
-         std::smatch requestMatch;
-         static const std::regex requestRegex("([-!#$%^&*+._'`|~0-9A-Za-z]+) (\\S+) (HTTP/\\d\\.\\d)");
-         if (!std::regex_match(get_line(), requestMatch, requestRegex))
-            return make_error_code(invalid_request_line);
-         
-         requestMethod_   = requestMatch[1];
-         requestResource_ = requestMatch[2];
-         requestVersion_  = requestMatch[3];
-
-         if (requestVersion_ != "HTTP/1.1")
-            return make_error_code(unsupported_http_version);
-
-         std::smatch resourceMatch;
-         static const std::regex resourceRegex("(/[^?#]*)(?:\\?([^#]*))?(?:#(.*))?");
-         if (std::regex_match(requestResource_, resourceMatch, resourceRegex)) {
-            requestPath_ = decode(resourceMatch[1].first, resourceMatch[1].second);
-            requestFragment_ = decode(resourceMatch[3].first, resourceMatch[3].second);
-            requestQuery_ = parse_query(resourceMatch[2].str());
-         }
-         
-         return error_code();
+      // Start the close handshake. The connection is shut down when
+      // the peer's close frame arrives.
+      void close(uint16_t code = normal_closure, const std::string& reason = std::string()) {
+         std::unique_lock<std::mutex> lock(writeMutex_);
+         queue_close(code, reason.data(), reason.size());
+         write_next(lock);
       }
 
-      error_code read_request_headers() {
-         for (auto s = get_line(); !s.empty(); s = get_line()) {
-            const auto colon = s.find_first_of(':');
-            if (colon == std::string::npos)
-               return make_error_code(invalid_request_header);
-
-            std::string key = s.substr(0, colon);
-            std::string value = s.substr(colon + 1);
-            boost::algorithm::trim_left(value);
+      // Queue a frame encoded by websocket::make_frame(), typically
+      // shared with other sessions. The queue limit applies as for
+      // queue_send(), and the return value has the same meaning.
+      bool queue_frame(const websocket::SharedFrame& frame) {
+         std::unique_lock<std::mutex> lock(writeMutex_);
+         Outbound outbound(frame);
+         bool writable;
+         return enqueue(lock, outbound, &writable) && writable;
+      }
 
-            // Coalesce values with the same key.
-            const auto i = requestHeaders_.find(key);
-            if (i != requestHeaders_.end()) {
-               i->second += ", ";
-               i->second += value;
-            }
-            else
-               requestHeaders_.insert({{std::move(key), std::move(value)}});
-         }
+#ifdef ZLIB_H
+      // Enable permessage-deflate with parameters from
+      // websocket::negotiate_deflate(). Call before start(). Whole
+      // messages of at least the threshold size are compressed;
+      // fragments and shared frames are sent as given.
+      void set_deflate(const websocket::DeflateOptions& agreed) {
+         deflate_.reset(new websocket::Deflate(agreed));
+      }
+#endif
+      
+      // Enable or disable UTF-8 validation of received text messages
+      // (enabled by default). Invalid text closes the session with
+      // status 1007.
+      void set_validate_utf8(bool validate) {
+         validateUtf8_ = validate;
+      }
+      
+      // Set a handler for received pong payloads (e.g. to measure
+      // round trips of pings sent with queue_frame()). It is called
+      // on the reading thread.
+      void set_pong_handler(PongHandler handler) {
+         std::lock_guard<std::mutex> lock(pongMutex_);
+         pongHandler_ = std::move(handler);
+      }
+      
+      // Get the status code of a received close frame (0 if none).
+      uint16_t close_code() const {
+         return closeCode_;
+      }
 
-         return error_code();
+      // Returns true once a close frame has been queued or the
+      // connection has failed, after which sends are rejected.
+      bool closing() const {
+         std::lock_guard<std::mutex> lock(writeMutex_);
+         return closeSent_;
       }
       
-      void read_length(const LoadBufferFunc& loadBufferFunc, const Handler& handler) {
-         auto contentLength = requestHeaders_.find("content-length");
-         if (contentLength != requestHeaders_.end()) {
-            boost::iostreams::filtering_istream is(
-               boost::make_iterator_range(
-                  contentLength->second.begin(),
-                  contentLength->second.end()));
-            is >> requestBytes_;
-            if (!is) {
-               handler(make_error_code(invalid_content_length));
-               return;
-            }
+   private:
+      std::shared_ptr<T> stream_;
+      MessageHandler messageHandler_;
+      std::mutex pongMutex_;
+      PongHandler pongHandler_;
+
+      // Read state, only used by the single outstanding read.
+      std::string leftover_;
+      websocket::FrameReader reader_;
+      const size_t maxMessage_;
+      uint8_t messageType_;
+      bool messageCompressed_;
+      std::vector<char> message_;
+      std::atomic<bool> validateUtf8_;
+      websocket::Utf8Validator validator_;
+#ifdef ZLIB_H
+      std::vector<char> inflated_;
+
+      // Compression state. deflateMutex_ is held from compressing a
+      // message until it is queued, so messages reach the wire in
+      // compression order.
+      std::unique_ptr<websocket::Deflate> deflate_;
+#endif
+      std::mutex deflateMutex_;
+      std::atomic<uint16_t> closeCode_;
+
+      // A queued frame, with an owned payload (queue_send()), a
+      // caller's buffer and completion handler (async_send()), or a
+      // complete shared frame (queue_frame()).
+      struct Outbound {
+         std::array<char, websocket::MaxServerHeader> header;
+         size_t headerSize;
+         size_t payloadSize;
+         bool owned;
+         std::string data;
+         boost::asio::const_buffer payload;
+         Handler handler;
+         websocket::SharedFrame shared;
+
+         Outbound(uint8_t type, size_t size)
+            : headerSize(websocket::encode_header(&header[0], type, size))
+            , payloadSize(size)
+            , owned(false) {
          }
-         
-         auto transferEncoding = requestHeaders_.find("transfer-encoding");
-         if (transferEncoding != requestHeaders_.end() &&
-             transferEncoding->second != "identity") {
-            requestBytes_ = 0U;
-            requestChunksPending_ = true;
-            read_chunk_header(loadBufferFunc, handler);
+
+         Outbound(const websocket::SharedFrame& frame)
+            : headerSize(0)
+            , payloadSize(frame->size())
+            , owned(false)
+            , shared(frame) {
+            header[0] = (*frame)[0];
          }
-         else
-            handler(error_code());
+
+         uint8_t type() const { return static_cast<uint8_t>(header[0]); }
+
+         boost::asio::const_buffer body() const {
+            if (shared)
+               return boost::asio::buffer(*shared);
+            return owned ? boost::asio::buffer(data) : payload;
+         }
+      };
+      typedef std::array<char, 2 + websocket::MaxControlPayload> ControlFrame;
+      
+      // Write state. The queue and in-flight batch swap storage, and
+      // the gather list is reused, so steady-state sends do not
+      // allocate.
+      mutable std::mutex writeMutex_;
+      bool writing_;
+      bool closeSent_;
+      bool closeReceived_;
+      bool closeWritten_;
+      std::vector<Outbound> queue_;
+      std::vector<Outbound> batch_;
+      std::vector<boost::asio::const_buffer> buffers_;
+      size_t coalesceLimit_;
+      std::vector<char> staging_;
+      std::vector<boost::asio::const_buffer> coalesced_;
+      size_t queuedBytes_;
+      size_t lowWatermark_;
+      size_t highWatermark_;
+      size_t sendLimit_;
+      OverflowPolicy overflowPolicy_;
+      std::atomic<size_t> dropped_;
+      std::vector<std::pair<size_t, Handler> > writeWaiters_;
+      size_t controlSize_;
+      size_t closeSize_;
+      ControlFrame control_;
+      ControlFrame controlOut_;
+      ControlFrame close_;
+      ControlFrame closeOut_;
+      
+      WebSocketSession(const std::shared_ptr<T>& stream, size_t bufferSize, size_t maxMessage)
+         : stream_(stream)
+         , reader_(bufferSize, maxMessage)
+         , maxMessage_(maxMessage)
+         , messageType_(0)
+         , messageCompressed_(false)
+         , validateUtf8_(true)
+         , closeCode_(0)
+         , writing_(false)
+         , closeSent_(false)
+         , closeReceived_(false)
+         , closeWritten_(false)
+         , coalesceLimit_(websocket::CoalesceWrites<T>::value ? DefaultCoalesceLimit : 0)
+         , queuedBytes_(0)
+         , lowWatermark_(DefaultLowWatermark)
+         , highWatermark_(DefaultHighWatermark)
+         , sendLimit_(0)
+         , overflowPolicy_(drop_newest)
+         , dropped_(0)
+         , controlSize_(0)
+         , closeSize_(0) {
       }
 
-      void read_chunk_header(const LoadBufferFunc& loadBufferFunc, const Handler& handler) {
-         assert(requestBytes_ == 0);
-         assert(requestChunksPending_);
-         loadBufferFunc(crlf(), [=](const error_code& error) {
+      void read() {
+         auto this_ = this->shared_from_this();
+         stream_->async_read_some(
+            reader_.prepare(),
+            [=](const error_code& error, size_t nBytes) {
                if (error) {
-                  handler(error);
-                  return;
-               }
-                  
-               // Chunk header begins with a hexadecimal chunk length.
-               std::istringstream is(get_line());
-               is >> std::hex >> requestBytes_;
-               if (!is) {
-                  handler(make_error_code(invalid_chunk_length));
+                  this_->end(error);
                   return;
                }
-               
-               if (!requestBytes_) {
-                  requestChunksPending_ = false;
-
-                  // Read trailers after the terminating chunk. The
-                  // trailers end with an empty line, i.e. consecutive
-                  // CRLF, but when there are no trailers we have
-                  // already consumed the first CRLF. We restore it
-                  // before loading the buffer through the empty line.
-                  streambuf_.sungetc();
-                  streambuf_.sungetc();
-                  loadBufferFunc(crlf2(), [=](const error_code& error) {
-                        if (error) {
-                           handler(error);
-                           return;
-                        }
 
-                        // Skip the restored CRLF to position the
-                        // stream at the start of trailers.
-                        streambuf_.snextc();
-                        streambuf_.snextc();
-                        handler(read_request_headers());
-                     });
-               }
-               else
-                  handler(error);
+               this_->reader_.commit(nBytes);
+               if (this_->receive())
+                  this_->read();
             });
       }
 
-      std::string prepare_write_prefix(size_t nBytes) {
-         // The prefix includes the status line and headers if this is
-         // the first write.
-         std::ostringstream os;
-         if (responseBytes_ == 0) {
-            // Set Date header if not already present.
-            if (response_headers().find("date") == response_headers().end()) {
-               std::time_t t;
-               std::time(&t);
-               std::tm tm = *std::gmtime(&t);
-               char s[30];
-               auto n = strftime(s, sizeof(s), "%a, %d %b %Y %T GMT", &tm);
-               response_header("Date") = std::string(s, n);
-            }
+      // Handle the complete frames in the reader, returning false to
+      // stop reading.
+      bool receive() {
+         websocket::Frame frame;
+         error_code frameError;
+         while (reader_.next(frame, frameError)) {
+            CHUNKY_PROBE(websocket__frame__receive, stream_.get(), frame.type, frame.size);
+            if (!dispatch(frame))
+               return false;
+         }
 
-            // RFC 2616 section 4.4:
-            //  Any response message which "MUST NOT" include a
-            //  message-body (such as the 1xx, 204, and 304 responses
-            //  and any response to a HEAD request) is always
-            //  terminated by the first empty line after the header
-            //  fields, regardless of the entity-header fields present
-            //  in the message.
-            auto status = response_status();
-            static const std::string head = "HEAD";
-            if (status >= 200 && status != 204 && status != 304 &&
-                request_method() != head) {
-               // Determine whether to use chunked transfer.
-               auto transferEncoding = response_headers().find("transfer-encoding");
-               if (transferEncoding != response_headers().end() &&
-                   transferEncoding->second != "identity") {
-                  responseChunked_ = true;
-                  response_headers().erase("content-length");
+         if (frameError) {
+            fail(message_too_big, frameError);
+            return false;
+         }
+         return true;
+      }
+
+      // Decode frames in the bytes read past the handshake in place
+      // before reading from the stream. Only an incomplete frame at
+      // their end is copied, into the reader's buffer.
+      void receive_leftover() {
+         reader_.assign(&leftover_[0], leftover_.size());
+         if (!receive())
+            return;
+
+         std::string().swap(leftover_);
+         read();
+      }
+
+      // Handle a received frame, returning false to stop reading.
+      bool dispatch(const websocket::Frame& frame) {
+         // Clients must mask every frame.
+         if (!frame.masked)
+            return fail(protocol_error);
+         
+         // RSV1 marks the first frame of a compressed message. Other
+         // reserved bits are unused.
+         const bool compressed = (frame.type & websocket::rsv1) != 0;
+         if ((frame.type & 0x30) ||
+             (compressed && (!deflating() || frame.is_control() || frame.opcode() == websocket::continuation)))
+            return fail(protocol_error);
+         
+         if (frame.is_control()) {
+            if (!frame.is_fin() || frame.size > websocket::MaxControlPayload)
+               return fail(protocol_error);
+            
+            switch (frame.opcode()) {
+            case websocket::ping:
+               {
+                  std::unique_lock<std::mutex> lock(writeMutex_);
+                  queue_control(websocket::fin | websocket::pong, frame.data, frame.size);
+                  write_next(lock);
                }
-               else if (response_headers().count("content-length") == 0) {
-                  responseChunked_ = true;
-                  response_header("Transfer-Encoding") = "chunked";
+               return true;
+            case websocket::pong:
+               {
+                  std::lock_guard<std::mutex> lock(pongMutex_);
+                  if (pongHandler_)
+                     pongHandler_(frame.data, frame.size);
+               }
+               return true;
+            case websocket::close:
+               {
+                  // A close payload is empty or begins with a status
+                  // code that may be sent on the wire.
+                  if (frame.size == 1)
+                     return fail(protocol_error);
+                  const uint16_t code = frame.size >= 2 ?
+                     static_cast<uint16_t>((static_cast<uint8_t>(frame.data[0]) << 8) |
+                                           static_cast<uint8_t>(frame.data[1])) :
+                     static_cast<uint16_t>(1005);
+                  if (frame.size && !valid_close_code(code))
+                     return fail(protocol_error);
+                  closeCode_ = code;
+                  
+                  // Echo the status code, then shut down the
+                  // connection once nothing remains to write.
+                  std::unique_lock<std::mutex> lock(writeMutex_);
+                  closeReceived_ = true;
+                  queue_close(0, frame.data, frame.size ? 2 : 0);
+                  write_next(lock);
                }
+               end(make_error_code(boost::asio::error::eof));
+               return false;
+            default:
+               return fail(protocol_error);
             }
+         }
 
-            write_status(os);
-            write_headers(os, response_headers());
+         switch (frame.opcode()) {
+         case websocket::continuation:
+            if (!messageType_)
+               return fail(protocol_error);
+            if (messageType_ == websocket::text && !messageCompressed_ &&
+                !valid_text(frame.data, frame.size, frame.ascii, false, frame.is_fin()))
+               return fail(invalid_payload, make_error_code(boost::system::errc::illegal_byte_sequence));
+            if (message_.size() + frame.size > maxMessage_)
+               return fail(message_too_big, make_error_code(boost::asio::error::message_size));
+            message_.insert(message_.end(), frame.data, frame.data + frame.size);
+            if (frame.is_fin()) {
+               const uint8_t type = messageType_;
+               messageType_ = 0;
+               if (!deliver(type, messageCompressed_, message_.data(), message_.size()))
+                  return false;
+               message_.clear();
+            }
+            return true;
+         case websocket::text:
+         case websocket::binary:
+            if (messageType_)
+               return fail(protocol_error);
+            if (frame.opcode() == websocket::text && !compressed &&
+                !valid_text(frame.data, frame.size, frame.ascii, true, frame.is_fin()))
+               return fail(invalid_payload, make_error_code(boost::system::errc::illegal_byte_sequence));
+            if (frame.is_fin()) {
+               // Deliver unfragmented messages in place.
+               return deliver(frame.opcode(), compressed, frame.data, frame.size);
+            }
+            else {
+               messageType_ = frame.opcode();
+               messageCompressed_ = compressed;
+               message_.assign(frame.data, frame.data + frame.size);
+            }
+            return true;
+         default:
+            return fail(protocol_error);
          }
+      }
 
-         if (responseChunked_)
-            os << boost::format("%x%s") % nBytes % crlf();
-         
-         return os.str();
+      // Returns true for a status code an endpoint may send (RFC 6455
+      // section 7.4). 1004 to 1006 and 1015 are reserved; 3000 to 4999
+      // are for libraries and applications.
+      static bool valid_close_code(uint16_t code) {
+         return (code >= 1000 && code <= 1003) ||
+            (code >= 1007 && code <= 1014) ||
+            (code >= 3000 && code <= 4999);
       }
 
-      std::string prepare_write_suffix(size_t nBytes) {
-         std::ostringstream os;
-         if (responseChunked_) {
-            // Add crlf to all chunks except the final one.
-            if (nBytes)
-               os << crlf();
+      // Deliver a complete message, decompressing if necessary.
+      bool deliver(uint8_t type, bool compressed, const char* data, size_t size) {
+#ifdef ZLIB_H
+         if (compressed) {
+            error_code error;
+            if (!deflate_->decompress(data, size, inflated_, maxMessage_, error))
+               return fail(error == boost::asio::error::message_size ? message_too_big : invalid_payload, error);
+            data = inflated_.data();
+            size = inflated_.size();
+            if (type == websocket::text && !valid_text(data, size, false, true, true))
+               return fail(invalid_payload, make_error_code(boost::system::errc::illegal_byte_sequence));
+         }
+#else
+         (void)compressed;
+#endif
+         messageHandler_(error_code(), type, data, size);
+         return true;
+      }
+
+      // Validate a text message as its frames arrive, so invalid
+      // input fails early. The ASCII flag from unmasking skips
+      // validation between characters.
+      bool valid_text(const char* data, size_t size, bool ascii, bool first, bool last) {
+         if (!validateUtf8_)
+            return true;
+         if (first)
+            validator_.reset();
+         if (!(ascii && validator_.complete()))
+            validator_.update(data, size);
+         return last ? validator_.complete() : validator_.valid();
+      }
+      
+      bool deflating() const {
+#ifdef ZLIB_H
+         return deflate_ != nullptr;
+#else
+         return false;
+#endif
+      }
+
+#ifdef ZLIB_H
+      // Returns true for an outgoing whole message to compress.
+      bool compressible(uint8_t type, size_t size) const {
+         const uint8_t opcode = type & 0x0f;
+         return deflate_ && (type & websocket::fin) &&
+            (opcode == websocket::text || opcode == websocket::binary) &&
+            size >= deflate_->options().threshold;
+      }
+#endif
+      
+      // Close the connection for a protocol violation.
+      bool fail(
+         CloseCode code,
+         const error_code& error = make_error_code(boost::system::errc::protocol_error)) {
+         {
+            std::unique_lock<std::mutex> lock(writeMutex_);
+            closeReceived_ = true;
+            queue_close(code, "", 0);
+            write_next(lock);
+         }
+         end(error);
+         return false;
+      }
+
+      // Report the end of the connection.
+      void end(const error_code& error) {
+         messageHandler_(error, 0, nullptr, 0);
+         messageHandler_ = MessageHandler();
+      }
+      
+      // Add a frame to the queue, applying the queue limit. Returns
+      // false if the frame was not queued, and optionally whether the
+      // queue is below the high watermark.
+      bool enqueue(
+         std::unique_lock<std::mutex>& lock,
+         Outbound& outbound,
+         bool* writable = nullptr) {
+         std::vector<Handler> aborted;
+         bool queued = false;
+         if (!closeSent_) {
+            // Make room under the limit.
+            const size_t size = outbound.payloadSize;
+            if (sendLimit_ && queuedBytes_ && queuedBytes_ + size > sendLimit_) {
+               switch (overflowPolicy_) {
+               case drop_newest:
+                  break;
+               case drop_oldest:
+                  // Whole messages may be dropped, but not fragments
+                  // or compressed messages (later messages may refer
+                  // to their content).
+                  for (auto i = queue_.begin(); i != queue_.end() && queuedBytes_ + size > sendLimit_;) {
+                     const uint8_t type = i->type();
+                     if ((type & websocket::fin) && !(type & websocket::rsv1) &&
+                         (type & 0x0f) != websocket::continuation) {
+                        queuedBytes_ -= i->payloadSize;
+                        if (i->handler)
+                           aborted.push_back(std::move(i->handler));
+                        i = queue_.erase(i);
+                        ++dropped_;
+                     }
+                     else
+                        ++i;
+                  }
+                  break;
+               case close_session:
+                  for (auto& unsent : queue_) {
+                     queuedBytes_ -= unsent.payloadSize;
+                     if (unsent.handler)
+                        aborted.push_back(std::move(unsent.handler));
+                     ++dropped_;
+                  }
+                  queue_.clear();
+                  queue_close(policy_violation, "", 0);
+                  break;
+               }
+            }
+
+            if (!closeSent_ && !(sendLimit_ && queuedBytes_ && queuedBytes_ + size > sendLimit_)) {
+               queuedBytes_ += size;
+               queue_.push_back(std::move(outbound));
+               queued = true;
+            }
             else
-               write_headers(os, response_trailers());
+               ++dropped_;
          }
+         const bool closed = closeSent_;
+         if (writable)
+            *writable = queuedBytes_ < highWatermark_;
+#ifdef ZLIB_H
+         // The peer never sees a dropped compressed message, so later
+         // messages must not refer to it.
+         if (!queued && (outbound.type() & websocket::rsv1))
+            deflate_->reset_compressor();
+#endif
+         write_next(lock);
+         if (lock.owns_lock())
+            lock.unlock();
 
-         return os.str();
+         // Notify handlers of messages not sent.
+         post_handlers(aborted, make_error_code(boost::asio::error::operation_aborted));
+         if (!queued && outbound.handler) {
+            aborted.assign(1, std::move(outbound.handler));
+            post_handlers(aborted, make_error_code(
+               closed ? boost::asio::error::operation_aborted : boost::asio::error::no_buffer_space));
+         }
+         return queued;
       }
 
-      void write_status(std::ostream& os) {
-         static std::map<unsigned int, std::string> reasons = {
-            { 100, "Continue" },
-            { 101, "Switching Protocols" },
-            { 200, "OK" },
-            { 201, "Created" },
-            { 202, "Accepted" },
-            { 203, "Non-Authoritative Information" },
-            { 204, "No Content" },
-            { 205, "Reset Content" },
-            { 206, "Partial Content" },
-            { 300, "Multiple Choices" },
-            { 301, "Moved Permanently" },
-            { 302, "Found" },
-            { 303, "See Other" },
-            { 304, "Not Modified" },
-            { 305, "Use Proxy" },
-            { 307, "Temporary Redirect" },
-            { 400, "Bad Request" },
-            { 401, "Unauthorized" },
-            { 402, "Payment Required" },
-            { 403, "Forbidden" },
-            { 404, "Not Found" },
-            { 405, "Method Not Allowed" },
-            { 406, "Not Acceptable" },
-            { 407, "Proxy Authentication Required" },
-            { 408, "Request Timeout" },
-            { 409, "Conflict" },
-            { 410, "Gone" },
-            { 411, "Length Required" },
-            { 412, "Precondition Failed" },
-            { 413, "Payload Too Large" },
-            { 414, "URI Too Long" },
-            { 415, "Unsupported Media Type" },
-            { 416, "Range Not Satisfiable" },
-            { 417, "Expectation Failed" },
-            { 426, "Upgrade Required" },
-            { 500, "Internal Server Error" },
-            { 501, "Not Implemented" },
-            { 502, "Bad Gateway" },
-            { 503, "Service Unavailable" },
-            { 504, "Gateway Timeout" },
-            { 505, "HTTP Version Not Supported" }
-         };
+      // Replace the gather list with runs of small buffers copied into
+      // the staging buffer (which is not touched again until the
+      // write completes) and large buffers in place.
+      void coalesce() {
+         size_t nStaged = 0;
+         for (const auto& buffer : buffers_) {
+            const size_t nBytes = boost::asio::buffer_size(buffer);
+            if (nBytes < coalesceLimit_)
+               nStaged += nBytes;
+         }
+         if (staging_.size() < nStaged)
+            staging_.resize(nStaged);
 
-         auto reason = reasons.find(responseStatus_);
-         os << boost::format("HTTP/1.1 %d %s%s")
-            % responseStatus_
-            % (reason != reasons.end() ? reason->second : std::string())
-            % crlf();
+         coalesced_.clear();
+         char* run = staging_.data();
+         char* end = run;
+         for (const auto& buffer : buffers_) {
+            const size_t nBytes = boost::asio::buffer_size(buffer);
+            if (nBytes >= coalesceLimit_) {
+               if (end != run)
+                  coalesced_.push_back(boost::asio::buffer(run, end - run));
+               coalesced_.push_back(buffer);
+               run = end;
+               continue;
+            }
+
+            if (nBytes) {
+               std::memcpy(end, boost::asio::buffer_cast<const char*>(buffer), nBytes);
+               end += nBytes;
+            }
+            if (static_cast<size_t>(end - run) >= coalesceLimit_) {
+               coalesced_.push_back(boost::asio::buffer(run, end - run));
+               run = end;
+            }
+         }
+         if (end != run)
+            coalesced_.push_back(boost::asio::buffer(run, end - run));
+         buffers_.swap(coalesced_);
+      }
+      
+      void post_handlers(std::vector<Handler>& handlers, const error_code& error) {
+         for (auto& handler : handlers) {
+            Handler h(std::move(handler));
+            stream_->get_io_service().post([=]() { h(error); });
+         }
+      }
+      
+      // Set the pending pong (replacing any unsent pong).
+      void queue_control(uint8_t type, const char* data, size_t size) {
+         if (closeSent_)
+            return;
+         const size_t nHeaderBytes = websocket::encode_header(&control_[0], type, size);
+         std::copy(data, data + size, &control_[nHeaderBytes]);
+         controlSize_ = nHeaderBytes + size;
       }
 
-      void write_headers(std::ostream& os, const Headers& headers) {
-         for (const auto& value : headers) {
-            os << boost::format("%s: %s%s")
-               % value.first
-               % value.second
-               % crlf();
+      // Set the close frame with a code and/or payload. It is written
+      // after everything already queued, and nothing more is accepted.
+      void queue_close(uint16_t code, const char* data, size_t size) {
+         if (closeSent_)
+            return;
+         char payload[websocket::MaxControlPayload];
+         size_t nBytes = 0;
+         if (code) {
+            payload[nBytes++] = static_cast<char>(code >> 8);
+            payload[nBytes++] = static_cast<char>(code & 0xff);
          }
-         os << crlf();
+         size = std::min(size, sizeof(payload) - nBytes);
+         std::copy(data, data + size, payload + nBytes);
+
+         const size_t nHeaderBytes = websocket::encode_header(
+            &close_[0], websocket::fin | websocket::close, nBytes + size);
+         std::copy(payload, payload + nBytes + size, &close_[nHeaderBytes]);
+         closeSize_ = nHeaderBytes + nBytes + size;
+         closeSent_ = true;
       }
-   };
-   
-   typedef HTTPTransaction<TCP> HTTP;
-#ifdef BOOST_ASIO_SSL_HPP
-   typedef HTTPTransaction<TLS> HTTPS;
-#endif
+      
+      // If no write is in progress, write everything pending in one
+      // gather operation: any pong, then queued frames, then any
+      // close frame. The connection is shut down when both close
+      // frames have passed.
+      void write_next(std::unique_lock<std::mutex>& lock) {
+         if (writing_)
+            return;
+         
+         buffers_.clear();
+         if (controlSize_) {
+            std::copy(control_.begin(), control_.begin() + controlSize_, controlOut_.begin());
+            buffers_.push_back(boost::asio::buffer(controlOut_, controlSize_));
+            CHUNKY_PROBE(websocket__frame__send, stream_.get(), static_cast<uint8_t>(controlOut_[0]), controlSize_ - 2);
+            controlSize_ = 0;
+         }
+         
+         batch_.swap(queue_);
+         size_t nBatchBytes = 0;
+         for (auto& outbound : batch_) {
+            if (outbound.headerSize)
+               buffers_.push_back(boost::asio::buffer(outbound.header, outbound.headerSize));
+            buffers_.push_back(outbound.body());
+            nBatchBytes += outbound.payloadSize;
+            CHUNKY_PROBE(websocket__frame__send, stream_.get(), outbound.type(), outbound.payloadSize);
+         }
+
+         const bool isClose = closeSize_ != 0;
+         if (isClose) {
+            std::copy(close_.begin(), close_.begin() + closeSize_, closeOut_.begin());
+            buffers_.push_back(boost::asio::buffer(closeOut_, closeSize_));
+            CHUNKY_PROBE(websocket__frame__send, stream_.get(), static_cast<uint8_t>(closeOut_[0]), closeSize_ - 2);
+            closeSize_ = 0;
+         }
+
+         if (buffers_.empty()) {
+            if (closeWritten_ && closeReceived_)
+               stream_->close_connection();
+            return;
+         }
+         if (coalesceLimit_ && buffers_.size() > 1)
+            coalesce();
+         
+         writing_ = true;
+         lock.unlock();
+         
+         auto this_ = this->shared_from_this();
+         boost::asio::async_write(
+            *stream_, detail::BufferView(buffers_),
+            [=](const error_code& error, size_t) {
+               std::vector<Handler> completed;
+               std::vector<Handler> ready;
+               std::unique_lock<std::mutex> lock(this_->writeMutex_);
+               for (auto& outbound : this_->batch_) {
+                  if (outbound.handler)
+                     completed.push_back(std::move(outbound.handler));
+               }
+               this_->batch_.clear();
+               this_->queuedBytes_ -= nBatchBytes;
+               this_->writing_ = false;
+               if (error) {
+                  // Nothing more can be sent.
+                  this_->closeSent_ = this_->closeReceived_ = this_->closeWritten_ = true;
+                  for (auto& outbound : this_->queue_) {
+                     if (outbound.handler)
+                        completed.push_back(std::move(outbound.handler));
+                  }
+                  this_->queue_.clear();
+                  this_->queuedBytes_ = 0;
+                  this_->controlSize_ = this_->closeSize_ = 0;
+               }
+               if (isClose)
+                  this_->closeWritten_ = true;
+
+               auto i = this_->writeWaiters_.begin();
+               while (i != this_->writeWaiters_.end()) {
+                  if (error || this_->queuedBytes_ <= i->first) {
+                     ready.push_back(std::move(i->second));
+                     i = this_->writeWaiters_.erase(i);
+                  }
+                  else
+                     ++i;
+               }
+               
+               this_->write_next(lock);
+               if (lock.owns_lock())
+                  lock.unlock();
+               for (auto& handler : completed)
+                  handler(error);
+               for (auto& handler : ready)
+                  handler(error);
+            });
+      }
+   };
 
-   template<typename Derived, typename T>
-   class BaseHTTPServer : public std::enable_shared_from_this<BaseHTTPServer<Derived, T> > {
+   // Publish/subscribe fan-out to WebSocket sessions. A published
+   // message is framed once into an immutable shared buffer that is
+   // queued to every subscriber, so the cost per subscriber is a
+   // queue entry rather than a header and payload copy.
+   //
+   // Subscribers are sharded by io_service and fan-out runs on each
+   // shard's io_service in batches, so delivery spreads across I/O
+   // threads. A subscriber whose queue is over the slow limit is
+   // skipped or disconnected by policy; closed and destroyed sessions
+   // are removed automatically.
+   template<typename T>
+   class WebSocketHub : public std::enable_shared_from_this<WebSocketHub<T> >
+                      , boost::noncopyable {
    public:
-      typedef boost::system::error_code error_code;
-      typedef HTTPTransaction<T> Transaction;
-      typedef std::function<void(const std::shared_ptr<Transaction>&)> Handler;
+      typedef WebSocketSession<T> Session;
 
-      // Create and start a new server.
-      template<typename... Args>
-      static std::shared_ptr<Derived> create(Args&&... args) {
-         return std::shared_ptr<Derived>(new Derived(std::forward<Args>(args)...));
-      }
+      // What to do with a subscriber over the slow limit.
+      enum SlowPolicy {
+         skip,                  // do not deliver this message
+         disconnect             // close with status 1008 and unsubscribe
+      };
 
-      // Stop accepting new connections. References to the server will
-      // be dropped when all existing connections close.
-      void destroy() {
-         for (auto& acceptor : acceptors_)
-            strand_.dispatch([&]() { acceptor.cancel(); });
-      }
+      enum {
+         DefaultBatchSize = 64
+      };
       
-      // Add a local address/port to bind and listen.
-      virtual unsigned short listen(const boost::asio::ip::tcp::acceptor::endpoint_type& endpoint) {
-         acceptors_.emplace_back(io_, endpoint);
-         accept(acceptors_.back());
-         return acceptors_.back().local_endpoint().port();
+      static std::shared_ptr<WebSocketHub> create(size_t batchSize = DefaultBatchSize) {
+         return std::shared_ptr<WebSocketHub>(new WebSocketHub(batchSize));
       }
 
-      // Set the handler to invoke on an HTTP URI path.
-      virtual void set_handler(const std::string& path, const Handler& handler) {
-         auto this_ = this->shared_from_this();
-         strand_.dispatch([=]() {
-               this_.get();
-               if (handler)
-                  handlers_[path] = handler;
-               else
-                  handlers_.erase(path);
-            });
-      }
-      
-      typedef std::function<void(const std::string&)> LogCallback;
-      virtual void set_logger(const LogCallback& logCallback) {
-         logCallback_ = logCallback;
+      // Set the queued bytes at which a subscriber is slow. Zero (the
+      // default) leaves limits to each session's send queue.
+      void set_slow_limit(size_t nBytes, SlowPolicy policy = skip) {
+         slowLimit_ = nBytes;
+         slowPolicy_ = policy;
       }
       
-      virtual void log(const std::string& message) {
-         if (logCallback_)
-            logCallback_(message);
+      void subscribe(const std::shared_ptr<Session>& session) {
+         boost::asio::io_service* io = &session->stream()->get_io_service();
+         std::lock_guard<std::mutex> lock(mutex_);
+         auto i = std::find_if(shards_.begin(), shards_.end(), [=](const Shard& shard) {
+               return shard.io == io;
+            });
+         if (i == shards_.end())
+            i = shards_.insert(shards_.end(), Shard(io));
+
+         auto subscribers = std::make_shared<Subscribers>(*i->subscribers);
+         subscribers->push_back(session);
+         i->subscribers = subscribers;
+         ++nSubscribers_;
       }
 
-      virtual void log(const error_code& e) {
-         log(e.message());
+      void unsubscribe(const std::shared_ptr<Session>& session) {
+         remove(session);
       }
       
-   protected:
-      typedef T Transport;
-      
-      BaseHTTPServer(boost::asio::io_service& io)
-         : io_(io)
-         , strand_(io_) {
-         handlers_[std::string()] = [this](const std::shared_ptr<Transaction>& http) {
-            default_handler(http);
-         };
+      // Publish a message to all subscribers.
+      void publish(uint8_t type, const boost::asio::const_buffer& payload) {
+         publish(websocket::make_frame(type, payload));
       }
 
-      virtual ~BaseHTTPServer() {
+      // Publish an encoded frame to all subscribers.
+      void publish(const websocket::SharedFrame& frame) {
+         ++published_;
+         auto this_ = this->shared_from_this();
+         std::lock_guard<std::mutex> lock(mutex_);
+         for (const auto& shard : shards_) {
+            std::shared_ptr<const Subscribers> subscribers = shard.subscribers;
+            for (size_t i = 0; i < subscribers->size(); i += batchSize_) {
+               const size_t end = std::min(i + batchSize_, subscribers->size());
+               shard.io->post([=]() {
+                     this_->deliver(frame, *subscribers, i, end);
+                  });
+            }
+         }
       }
 
-      virtual boost::asio::io_service& get_io_service() { return io_; }
-      
-      virtual void connect_transport(
-         boost::asio::ip::tcp::acceptor& acceptor,
-         const std::function<void(const error_code&, const std::shared_ptr<Transport>&)>& handler) = 0;
-
-      virtual void disconnect_transport(
-         const std::shared_ptr<Transport>&,
-         boost::system::error_code&) {
+      size_t subscribers() const {
+         std::lock_guard<std::mutex> lock(mutex_);
+         return nSubscribers_;
       }
+
+      // Messages published, frames queued to subscribers, and
+      // deliveries skipped for slow subscribers.
+      size_t published() const { return published_; }
+      size_t delivered() const { return delivered_; }
+      size_t skipped() const { return skipped_; }
       
-      virtual void default_handler(const std::shared_ptr<Transaction>& http) {
-         http->response_status() = 404;
-         http->response_header("Content-Type") = "text/html";
-         
-         static std::string NotFound("<title>404 - Not Found</title><h1>404 - Not Found</h1>");
-         boost::asio::async_write(
-            *http, boost::asio::buffer(NotFound),
-            [=](const boost::system::error_code& error, size_t) {
-               if (error) {
-                  log(error);
-                  return;
-               }
+   private:
+      typedef std::vector<std::weak_ptr<Session> > Subscribers;
 
-               http->async_finish([=](const boost::system::error_code& error) {
-                     if (error) {
-                        log(error);
-                        return;
-                     }
+      // Subscribers on one io_service. The list is copied on
+      // subscription changes so fan-out can use it without locking.
+      struct Shard {
+         boost::asio::io_service* io;
+         std::shared_ptr<const Subscribers> subscribers;
 
-                     http.get();
-                  });
-            });
+         Shard(boost::asio::io_service* io)
+            : io(io)
+            , subscribers(std::make_shared<Subscribers>()) {
+         }
+      };
+
+      const size_t batchSize_;
+      mutable std::mutex mutex_;
+      std::vector<Shard> shards_;
+      size_t nSubscribers_;
+      std::atomic<size_t> slowLimit_;
+      std::atomic<SlowPolicy> slowPolicy_;
+      std::atomic<size_t> published_;
+      std::atomic<size_t> delivered_;
+      std::atomic<size_t> skipped_;
+
+      WebSocketHub(size_t batchSize)
+         : batchSize_(std::max<size_t>(batchSize, 1))
+         , nSubscribers_(0)
+         , slowLimit_(0)
+         , slowPolicy_(skip)
+         , published_(0)
+         , delivered_(0)
+         , skipped_(0) {
       }
 
-   private:
-      boost::asio::io_service& io_;
-      boost::asio::io_service::strand strand_;
-      std::list<boost::asio::ip::tcp::acceptor> acceptors_;
-      
-      std::map<std::string, Handler> handlers_;
-      LogCallback logCallback_;
+      void deliver(
+         const websocket::SharedFrame& frame,
+         const Subscribers& subscribers,
+         size_t begin,
+         size_t end) {
+         const size_t slowLimit = slowLimit_;
+         for (size_t i = begin; i < end; ++i) {
+            auto session = subscribers[i].lock();
+            if (!session || session->closing()) {
+               remove(subscribers[i]);
+               continue;
+            }
 
-      void accept(boost::asio::ip::tcp::acceptor& acceptor) {
-         auto this_ = this->shared_from_this();
-         connect_transport(
-            acceptor,
-            [=, &acceptor](const error_code& error, const std::shared_ptr<Transport>& transport) {
-               if (!error) {
-                  log((boost::format("connect %s:%d")
-                       % transport->stream().lowest_layer().remote_endpoint().address().to_string()
-                       % transport->stream().lowest_layer().remote_endpoint().port()).str());
-                  create_transaction(transport);
+            if (slowLimit && session->queued_bytes() > slowLimit) {
+               ++skipped_;
+               if (slowPolicy_ == disconnect) {
+                  session->close(Session::policy_violation);
+                  remove(subscribers[i]);
                }
-               else {
-                  log(error);
+               continue;
+            }
 
-                  // Stop accepting on system errors to avoid runaway.
-                  if (error == make_error_code(boost::asio::error::operation_aborted) ||
-                      error.category() == boost::asio::error::get_system_category())
-                     return;
-               }
+            session->queue_frame(frame);
+            ++delivered_;
+         }
+      }
 
-               strand_.dispatch([=, &acceptor]() { this_->accept(acceptor); });
-            });
+      void remove(const std::weak_ptr<Session>& subscriber) {
+         std::lock_guard<std::mutex> lock(mutex_);
+         for (auto& shard : shards_) {
+            auto i = std::find_if(
+               shard.subscribers->begin(), shard.subscribers->end(),
+               [&](const std::weak_ptr<Session>& other) {
+                  return !other.owner_before(subscriber) && !subscriber.owner_before(other);
+               });
+            if (i != shard.subscribers->end()) {
+               auto subscribers = std::make_shared<Subscribers>(*shard.subscribers);
+               subscribers->erase(subscribers->begin() + (i - shard.subscribers->begin()));
+               shard.subscribers = subscribers;
+               --nSubscribers_;
+               return;
+            }
+         }
       }
+   };
 
-      void create_transaction(const std::shared_ptr<Transport>& transport) {
-         auto this_ = this->shared_from_this();
-         auto keepalive = std::make_shared<bool>(true);
-         std::shared_ptr<Transaction> http(
-            new Transaction(transport),
-            [=](Transaction* pointer) {
-               *keepalive &= keep_alive(*pointer);
-               if (*keepalive) {
-                  get_io_service().post([=]() {
-                        this_.get();
-                        create_transaction(transport);
-                     });
-               }
+   // Keepalive pings and dead peer detection for many WebSocket
+   // sessions on a shared TimerWheel. Sessions are spread across
+   // groups that each own one wheel timer, so a round of pings costs
+   // one timer operation and one encoded frame per group instead of
+   // per session. The ping payload is the send time, which the peer
+   // echoes in its pong, so round trips are measured without
+   // per-ping state. A session with a ping unanswered for the timeout
+   // is sent a close frame and its connection is shut down.
+   template<typename T>
+   class WebSocketHeartbeat : public std::enable_shared_from_this<WebSocketHeartbeat<T> >
+                            , boost::noncopyable {
+   public:
+      typedef WebSocketSession<T> Session;
+      typedef TimerWheel::Duration Duration;
 
-               delete pointer;
+      enum {
+         MaxGroups = 64
+      };
+      
+      static std::shared_ptr<WebSocketHeartbeat> create(
+         const std::shared_ptr<TimerWheel>& wheel,
+         const Duration& interval = Duration(30000),
+         const Duration& timeout = Duration(10000)) {
+         std::shared_ptr<WebSocketHeartbeat> heartbeat(new WebSocketHeartbeat(wheel, interval, timeout));
+         std::weak_ptr<WebSocketHeartbeat> weak = heartbeat;
+         for (auto& group : heartbeat->groups_) {
+            Group* g = group.get();
+            g->timer.set_callback([=]() {
+                  if (auto heartbeat = weak.lock())
+                     heartbeat->tick(*g);
+               });
+         }
+         return heartbeat;
+      }
+
+      // Start pinging a session. Groups are assigned round robin, and
+      // each group's first ping is offset so rounds spread across the
+      // interval.
+      void add(const std::shared_ptr<Session>& session) {
+         auto entry = std::make_shared<Entry>(session);
+         std::weak_ptr<WebSocketHeartbeat> weak = this->shared_from_this();
+         session->set_pong_handler([=](const char* data, size_t size) {
+               if (auto heartbeat = weak.lock())
+                  heartbeat->pong(*entry, data, size);
             });
 
-         // For convenience, issue a null read so that request
-         // metadata is already valid for the callback.
-         http->async_read_some(
-            boost::asio::null_buffers(),
-            [=](boost::system::error_code error, size_t) {
-               if (error) {
-                  disconnect_transport(http->stream(), error);
-                  log(error);
-                  *keepalive = false;
-                  return;
-               }
+         const size_t index = next_++ % groups_.size();
+         Group& group = *groups_[index];
+         std::lock_guard<std::mutex> lock(group.mutex);
+         auto members = std::make_shared<Members>(*group.members);
+         members->push_back(entry);
+         group.members = members;
+         ++nSessions_;
 
-               strand_.dispatch([=]() { dispatch_transaction(http); });
-            });
+         if (!group.running) {
+            const Duration delay = interval_ * (index + 1) / groups_.size();
+            group.running = true;
+            group.nextPing = timestamp() + std::chrono::duration_cast<std::chrono::microseconds>(delay).count();
+            wheel_->schedule(group.timer, delay);
+         }
       }
-      
-      void dispatch_transaction(const std::shared_ptr<Transaction>& transaction) {
-         auto i = handlers_.find(transaction->request_path());
-         if (i == handlers_.end())
-            i = handlers_.find(std::string());
-         i->second(transaction);
+
+      // Stop pinging a session. Closed and destroyed sessions are
+      // removed automatically.
+      void remove(const std::shared_ptr<Session>& session) {
+         session->set_pong_handler(typename Session::PongHandler());
+         for (auto& group : groups_) {
+            std::lock_guard<std::mutex> lock(group->mutex);
+            auto i = std::find_if(
+               group->members->begin(), group->members->end(),
+               [&](const std::shared_ptr<Entry>& entry) {
+                  return !entry->session.owner_before(session) && !session.owner_before(entry->session);
+               });
+            if (i != group->members->end()) {
+               erase(*group, { *i });
+               return;
+            }
+         }
       }
+
+      size_t sessions() const { return nSessions_; }
+
+      // Pings queued and sessions closed for an overdue pong.
+      size_t pings() const { return pings_; }
+      size_t timeouts() const { return timeouts_; }
+
+      // Ping to pong round trips in microseconds.
+      const Histogram& rtt() const { return rtt_; }
       
-      bool keep_alive(Transaction& http) {
-         if (http.response_status() == 101)
-            return false;
-         
-         static const std::string connection("Connection");
-         static const std::string close("close");
-         auto requestConnection = http.request_headers().find(connection);
-         if (requestConnection != http.request_headers().end() &&
-             requestConnection->second == close)
-            return false;
+   private:
+      // A session's heartbeat state. sent is the time of the oldest
+      // unanswered ping, or zero.
+      struct Entry {
+         std::weak_ptr<Session> session;
+         std::atomic<uint64_t> sent;
 
-         auto responseConnection = http.response_headers().find(connection);
-         if (responseConnection != http.response_headers().end() &&
-             responseConnection->second == close)
-            return false;
+         Entry(const std::shared_ptr<Session>& session)
+            : session(session)
+            , sent(0) {
+         }
+      };
+      typedef std::vector<std::shared_ptr<Entry> > Members;
 
-         return true;
+      // Sessions pinged together. The member list is copied on
+      // changes so a round can use it without locking.
+      struct Group {
+         std::mutex mutex;
+         std::shared_ptr<const Members> members;
+         TimerWheel::Timer timer;
+         bool running;
+         uint64_t nextPing;
+
+         Group()
+            : members(std::make_shared<Members>())
+            , running(false)
+            , nextPing(0) {
+         }
+      };
+
+      const std::shared_ptr<TimerWheel> wheel_;
+      const Duration interval_;
+      const uint64_t tickUs_;
+      const uint64_t intervalUs_;
+      const uint64_t timeoutUs_;
+      std::vector<std::unique_ptr<Group> > groups_;
+      std::atomic<size_t> next_;
+      std::atomic<size_t> nSessions_;
+      std::atomic<size_t> pings_;
+      std::atomic<size_t> timeouts_;
+      Histogram rtt_;
+
+      WebSocketHeartbeat(
+         const std::shared_ptr<TimerWheel>& wheel,
+         const Duration& interval,
+         const Duration& timeout)
+         : wheel_(wheel)
+         , interval_(std::max(interval, wheel->tick()))
+         , tickUs_(std::chrono::duration_cast<std::chrono::microseconds>(wheel->tick()).count())
+         , intervalUs_(std::chrono::duration_cast<std::chrono::microseconds>(interval_).count())
+         , timeoutUs_(std::chrono::duration_cast<std::chrono::microseconds>(timeout).count())
+         , next_(0)
+         , nSessions_(0)
+         , pings_(0)
+         , timeouts_(0) {
+         const size_t nGroups = std::min<size_t>(MaxGroups, interval_ / wheel->tick());
+         for (size_t i = 0; i < nGroups; ++i)
+            groups_.emplace_back(new Group());
       }
-   };
 
-   class SimpleHTTPServer : public BaseHTTPServer<SimpleHTTPServer, TCP> {
-   private:
-      friend class BaseHTTPServer<SimpleHTTPServer, TCP>;
-      
-      SimpleHTTPServer(boost::asio::io_service& io)
-         : BaseHTTPServer<SimpleHTTPServer, TCP>(io) {
+      static uint64_t timestamp() {
+         return std::chrono::duration_cast<std::chrono::microseconds>(
+            detail::Clock::now().time_since_epoch()).count();
       }
       
-      virtual void connect_transport(
-         boost::asio::ip::tcp::acceptor& acceptor,
-         const std::function<void(const error_code&, const std::shared_ptr<Transport>&)>& handler) {
-         Transport::async_connect(acceptor, handler);
-      }
-   };
+      // Run a group's round: close sessions with an overdue pong, ping
+      // the rest if due, and reschedule for the next ping or deadline.
+      void tick(Group& group) {
+         const uint64_t now = timestamp();
+         std::shared_ptr<const Members> members;
+         bool due;
+         {
+            std::lock_guard<std::mutex> lock(group.mutex);
+            members = group.members;
 
-#ifdef BOOST_ASIO_SSL_HPP
-   class SimpleHTTPSServer : public BaseHTTPServer<SimpleHTTPSServer, TLS> {
-   private:
-      friend class BaseHTTPServer<SimpleHTTPSServer, TLS>;
-      
-      SimpleHTTPSServer(boost::asio::io_service& io, boost::asio::ssl::context& context)
-         : BaseHTTPServer<SimpleHTTPSServer, TLS>(io)
-         , context_(context) {
+            // The wheel may fire up to a tick early.
+            due = now + tickUs_ >= group.nextPing;
+            if (due)
+               group.nextPing = now + intervalUs_;
+         }
+
+         // One frame serves every session in the group.
+         websocket::SharedFrame frame;
+         if (due) {
+            char payload[sizeof(now)];
+            for (size_t i = 0; i < sizeof(now); ++i)
+               payload[i] = static_cast<char>(now >> (8 * (sizeof(now) - 1 - i)));
+            frame = websocket::make_frame(
+               websocket::fin | websocket::ping,
+               boost::asio::buffer(payload, sizeof(payload)));
+         }
+         
+         uint64_t deadline = std::numeric_limits<uint64_t>::max();
+         std::vector<std::shared_ptr<Entry> > removed;
+         for (const auto& entry : *members) {
+            auto session = entry->session.lock();
+            if (!session || session->closing()) {
+               removed.push_back(entry);
+               continue;
+            }
+
+            uint64_t sent = entry->sent;
+            if (sent && now - sent >= timeoutUs_) {
+               ++timeouts_;
+               session->set_pong_handler(typename Session::PongHandler());
+               session->close(Session::going_away, "ping timeout");
+               session->stream()->close_connection();
+               removed.push_back(entry);
+               continue;
+            }
+
+            if (due) {
+               // Mark the ping outstanding before it can be answered,
+               // keeping the time of any older unanswered ping.
+               sent = 0;
+               if (entry->sent.compare_exchange_strong(sent, now))
+                  sent = now;
+               session->queue_frame(frame);
+               ++pings_;
+            }
+            if (sent)
+               deadline = std::min(deadline, sent + timeoutUs_);
+         }
+
+         std::lock_guard<std::mutex> lock(group.mutex);
+         if (!removed.empty())
+            erase(group, removed);
+         if (group.members->empty()) {
+            group.running = false;
+            return;
+         }
+
+         const uint64_t next = std::min(group.nextPing, deadline);
+         wheel_->schedule(
+            group.timer,
+            std::chrono::duration_cast<Duration>(std::chrono::microseconds(next > now ? next - now : 0)));
       }
 
-      boost::asio::ssl::context& context_;
-      
-      virtual void connect_transport(
-         boost::asio::ip::tcp::acceptor& acceptor,
-         const std::function<void(const error_code&, const std::shared_ptr<Transport>&)>& handler) {
-         Transport::async_connect(acceptor, context_, handler);
+      // Record the round trip of an echoed ping payload and clear the
+      // outstanding ping if it is answered.
+      void pong(Entry& entry, const char* data, size_t size) {
+         const uint64_t now = timestamp();
+         if (size != sizeof(now))
+            return;
+         uint64_t stamp = 0;
+         for (size_t i = 0; i < size; ++i)
+            stamp = (stamp << 8) | static_cast<uint8_t>(data[i]);
+         if (!stamp || stamp > now)
+            return;
+         
+         rtt_.record(std::chrono::microseconds(now - stamp));
+         uint64_t sent = entry.sent;
+         while (sent && stamp >= sent && !entry.sent.compare_exchange_weak(sent, 0))
+            ;
       }
 
-      virtual void disconnect_transport(
-         const std::shared_ptr<Transport>& transport,
-         boost::system::error_code& error) {
-         // Cleanly terminate TLS if necessary.
-         if (error.category() == boost::asio::error::get_ssl_category()) {
-            transport->stream().async_shutdown([=](const error_code&) {
-                  transport.get();
-               });
+      // Remove entries from a group (with its mutex held).
+      void erase(Group& group, const std::vector<std::shared_ptr<Entry> >& entries) {
+         auto members = std::make_shared<Members>();
+         for (const auto& member : *group.members) {
+            if (std::find(entries.begin(), entries.end(), member) == entries.end())
+               members->push_back(member);
          }
-                  
-         // Convert short read error into EOF for consistency
-         // with TCP.
-         if (error.category() == boost::asio::error::get_ssl_category() &&
-             error.value() == ERR_PACK(ERR_LIB_SSL, 0, SSL_R_SHORT_READ))
-            error = make_error_code(boost::asio::error::eof);
+         nSessions_ -= group.members->size() - members->size();
+         group.members = members;
       }
    };
-#endif
-   
 }
 
 #endif // CHUNKY_HPP
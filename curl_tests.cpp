@@ -2,6 +2,7 @@
 #define BOOST_LOG_DYN_LINK
 #define BOOST_TEST_DYN_LINK
 
+#include <fstream>
 #include <future>
 #include <iostream>
 #include <random>
@@ -11,6 +12,9 @@
 #include <boost/test/unit_test.hpp>
 
 #include <curl/curl.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #include "chunky.hpp"
 
@@ -48,6 +52,8 @@ public:
    }
    
    unsigned short port() const { return port_; }
+   boost::asio::io_service& io() { return io_; }
+   const std::shared_ptr<chunky::SimpleHTTPServer>& server() const { return server_; }
    
    void log(const std::string& message) {
       LOG(info) << message;
@@ -460,6 +466,1875 @@ BOOST_AUTO_TEST_CASE(AsyncBig) {
    curl_easy_cleanup(curl);
 }
 
+BOOST_AUTO_TEST_CASE(BodyAccess) {
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         // Report how the body was delivered.
+         const char* begin = boost::asio::buffer_cast<const char*>(*http->buffered_body().begin());
+         if (http->request_path() == "/consume")
+            http->consume(1);
+         const size_t maxBytes = http->request_path() == "/unlimited" ? std::numeric_limits<size_t>::max() : 100;
+         auto returned = std::make_shared<bool>(false);
+         http->async_read_body(maxBytes, [=](const error_code& error, const boost::asio::const_buffer& body) {
+               // Never completes inside the initiating call.
+               BOOST_CHECK(*returned);
+               
+               std::string response;
+               if (error) {
+                  BOOST_CHECK(error == make_error_code(body_too_large));
+                  http->response_status() = 413;
+                  response = error.message();
+               }
+               else {
+                  http->response_status() = 200;
+                  const char* data = boost::asio::buffer_cast<const char*>(body);
+                  response.assign(data, boost::asio::buffer_size(body));
+                  response += data == begin + (http->request_path() == "/consume") ? ":inplace" : ":copied";
+               }
+               
+               http->response_header("Content-Length") = std::to_string(response.size());
+               http->response_header("Connection") = "close";
+               boost::asio::write(*http, boost::asio::buffer(response));
+               http->finish();
+            });
+         *returned = true;
+      });
+
+   // Send a request in parts and return the response body.
+   auto exchange = [&](const std::string& head, const std::string& body) {
+      boost::asio::io_service io;
+      boost::asio::ip::tcp::socket socket(io);
+      boost::asio::ip::tcp::resolver resolver(io);
+      boost::asio::connect(socket, resolver.resolve({ "localhost", std::to_string(server.port()) }));
+      boost::asio::write(socket, boost::asio::buffer(head));
+      if (!body.empty()) {
+         std::this_thread::sleep_for(std::chrono::milliseconds(50));
+         boost::asio::write(socket, boost::asio::buffer(body));
+      }
+
+      boost::asio::streambuf response;
+      error_code error;
+      boost::asio::read(socket, response, error);
+      const std::string s(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+      return s.substr(s.find("\r\n\r\n") + 4);
+   };
+
+   // A body buffered with the head is viewed in place.
+   BOOST_CHECK_EQUAL(
+      exchange("POST /post HTTP/1.1\r\nHost: localhost\r\nContent-Length: 9\r\n\r\n{\"a\":42}\n", ""),
+      "{\"a\":42}\n:inplace");
+   BOOST_CHECK_EQUAL(
+      exchange("POST /consume HTTP/1.1\r\nHost: localhost\r\nContent-Length: 3\r\n\r\nabc", ""),
+      "bc:inplace");
+
+   // Other bodies are read into one buffer.
+   BOOST_CHECK_EQUAL(
+      exchange("POST /post HTTP/1.1\r\nHost: localhost\r\nContent-Length: 5\r\n\r\n", "hello"),
+      "hello:copied");
+   BOOST_CHECK_EQUAL(
+      exchange("POST /post HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n",
+               "5\r\nhello\r\n1\r\n,\r\n6\r\n world\r\n0\r\n\r\n"),
+      "hello, world:copied");
+   BOOST_CHECK_EQUAL(
+      exchange("POST /unlimited HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n",
+               "40\r\n" + std::string(64, 'x') + "\r\n40\r\n" + std::string(64, 'y') + "\r\n0\r\n\r\n"),
+      std::string(64, 'x') + std::string(64, 'y') + ":copied");
+
+   // Bodies over the limit are refused.
+   BOOST_CHECK_EQUAL(
+      exchange("POST /post HTTP/1.1\r\nHost: localhost\r\nContent-Length: 101\r\n\r\n", std::string(101, 'x')),
+      "Request body too large");
+   BOOST_CHECK_EQUAL(
+      exchange("POST /post HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n",
+               "40\r\n" + std::string(64, 'x') + "\r\n40\r\n" + std::string(64, 'x') + "\r\n0\r\n\r\n"),
+      "Request body too large");
+}
+
+BOOST_AUTO_TEST_CASE(Multipart) {
+   BOOST_CHECK_EQUAL(MultipartReader::boundary("multipart/form-data; boundary=\"XyZ\""), "XyZ");
+   BOOST_CHECK_EQUAL(MultipartReader::boundary("Multipart/mixed;boundary=abc ; charset=x"), "abc");
+   BOOST_CHECK_EQUAL(MultipartReader::boundary("text/plain; boundary=abc"), "");
+   BOOST_CHECK_EQUAL(
+      MultipartReader::parameter("form-data; name=\"file\"; filename=\"a \\\"b\\\".bin\"", "filename"),
+      "a \"b\".bin");
+   
+   // The file contents include near misses of the delimiter.
+   std::string file;
+   for (int i = 0; file.size() < 5000; ++i)
+      file += i % 3 ? std::string(1, static_cast<char>(i)) : std::string("\r\n--XyA\r\n-");
+   const std::string body =
+      "preamble\r\n"
+      "--XyZ\r\n"
+      "Content-Disposition: form-data; name=\"field\"\r\n"
+      "\r\n"
+      "value\r\n"
+      "--XyZ  \r\n"
+      "Content-Disposition: form-data; name=\"file\"; filename=\"a.bin\"\r\n"
+      "Content-Type: application/octet-stream\r\n"
+      "\r\n" +
+      file + "\r\n"
+      "--XyZ\r\n"
+      "\r\n"
+      "\r\n"
+      "--XyZ--\r\n"
+      "epilogue";
+
+   // Decode the body fed in pieces of each size, into part names and
+   // contents.
+   auto decode = [&](size_t nPieceBytes) {
+      std::vector<std::pair<std::string, std::string> > parts;
+      MultipartReader reader("XyZ", 128);
+      MultipartReader::Event event;
+      error_code error;
+      size_t offset = 0;
+      while (!reader.is_finished() && !error && offset < body.size()) {
+         auto buffer = reader.prepare();
+         const size_t nBytes = std::min(
+            { nPieceBytes, boost::asio::buffer_size(buffer), body.size() - offset });
+         std::memcpy(boost::asio::buffer_cast<char*>(buffer), &body[offset], nBytes);
+         reader.commit(nBytes);
+         offset += nBytes;
+         while (reader.next(event, error)) {
+            switch (event.type) {
+            case MultipartReader::part_begin:
+               {
+                  auto i = reader.headers().find("content-disposition");
+                  parts.emplace_back(
+                     i != reader.headers().end() ? MultipartReader::parameter(i->second, "name") : "",
+                     std::string());
+               }
+               break;
+            case MultipartReader::part_data:
+               BOOST_REQUIRE(!parts.empty());
+               parts.back().second.append(event.data, event.size);
+               break;
+            default:
+               break;
+            }
+         }
+      }
+      BOOST_CHECK(!error);
+      BOOST_CHECK(reader.is_finished());
+      return parts;
+   };
+
+   for (size_t nPieceBytes : { 1, 7, 64, 10000 }) {
+      auto parts = decode(nPieceBytes);
+      BOOST_REQUIRE_EQUAL(parts.size(), 3);
+      BOOST_CHECK_EQUAL(parts[0].first, "field");
+      BOOST_CHECK_EQUAL(parts[0].second, "value");
+      BOOST_CHECK_EQUAL(parts[1].first, "file");
+      BOOST_CHECK(parts[1].second == file);
+      BOOST_CHECK_EQUAL(parts[2].first, "");
+      BOOST_CHECK_EQUAL(parts[2].second, "");
+   }
+
+   // Decode an upload through a transaction.
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         auto reader = std::make_shared<MultipartReader>(
+            MultipartReader::boundary(http->request_header("Content-Type")), 256);
+         auto summary = std::make_shared<std::string>();
+         auto nBytes = std::make_shared<size_t>(0);
+         async_read_multipart(
+            http, reader,
+            [=](const MultipartReader::Event& event) {
+               if (event.type == MultipartReader::part_begin) {
+                  auto i = reader->headers().find("Content-Disposition");
+                  *summary += (i != reader->headers().end() ? i->second : "") + ":";
+               }
+               else if (event.type == MultipartReader::part_data)
+                  *nBytes += event.size;
+               else if (event.type == MultipartReader::part_end) {
+                  *summary += std::to_string(*nBytes) + ";";
+                  *nBytes = 0;
+               }
+            },
+            [=](const error_code& error) {
+               http->response_status() = error ? 400 : 200;
+               if (error)
+                  *summary = error.message();
+               http->response_header("Content-Length") = std::to_string(summary->size());
+               boost::asio::write(*http, boost::asio::buffer(*summary));
+               http->finish();
+            });
+      });
+
+   auto post = [&](const std::string& contentType, const std::string& body) {
+      boost::asio::io_service io;
+      boost::asio::ip::tcp::socket socket(io);
+      boost::asio::ip::tcp::resolver resolver(io);
+      boost::asio::connect(socket, resolver.resolve({ "localhost", std::to_string(server.port()) }));
+      boost::asio::write(socket, boost::asio::buffer(
+         "POST /upload HTTP/1.1\r\n"
+         "Host: localhost\r\n"
+         "Connection: close\r\n"
+         "Content-Type: " + contentType + "\r\n"
+         "Content-Length: " + std::to_string(body.size()) + "\r\n"
+         "\r\n" + body));
+
+      boost::asio::streambuf response;
+      error_code error;
+      boost::asio::read(socket, response, error);
+      const std::string s(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+      return s.substr(s.find("\r\n\r\n") + 4);
+   };
+   BOOST_CHECK_EQUAL(
+      post("multipart/form-data; boundary=XyZ", body),
+      "form-data; name=\"field\":5;"
+      "form-data; name=\"file\"; filename=\"a.bin\":" + std::to_string(file.size()) + ";"
+      ":0;");
+   BOOST_CHECK_EQUAL(
+      post("multipart/form-data; boundary=XyZ", body.substr(0, 200)),
+      "Invalid multipart body");
+}
+
+BOOST_AUTO_TEST_CASE(ReceiveToFile) {
+   auto pool = FileIOPool::create(1);
+   const std::string path = "/tmp/chunky_receive_" + std::to_string(::getpid());
+
+   // Small buffers make the reads and writes alternate many times.
+   FileReceiveOptions options;
+   options.sync = FileReceiveOptions::sync_data;
+   options.bufferSize = 4096;
+   options.maxBytes = 1 << 20;
+   TestServer server([=](const std::shared_ptr<HTTP>& http) {
+         // The transfer may hold the only reference to a pool.
+         async_receive_to_file(
+            http, path,
+            http->request_header("X-Temporary-Pool").empty() ? pool : FileIOPool::create(1),
+            options,
+            [=](const error_code& error, uint64_t nBytes) {
+               const std::string summary = error ? error.message() : std::to_string(nBytes);
+               http->response_status() = error ? 400 : 200;
+               http->response_header("Content-Length") = std::to_string(summary.size());
+               boost::asio::write(*http, boost::asio::buffer(summary));
+               http->finish();
+            });
+      });
+
+   auto post = [&](const std::string& header, const std::string& body) {
+      boost::asio::io_service io;
+      boost::asio::ip::tcp::socket socket(io);
+      boost::asio::ip::tcp::resolver resolver(io);
+      boost::asio::connect(socket, resolver.resolve({ "localhost", std::to_string(server.port()) }));
+      boost::asio::write(socket, boost::asio::buffer(
+         "POST /file HTTP/1.1\r\n"
+         "Host: localhost\r\n"
+         "Connection: close\r\n" +
+         header + "\r\n"
+         "\r\n" + body));
+
+      boost::asio::streambuf response;
+      error_code error;
+      boost::asio::read(socket, response, error);
+      const std::string s(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data()));
+      return s.substr(s.find("\r\n\r\n") + 4);
+   };
+   auto contents = [&]() {
+      std::ifstream f(path, std::ios::binary);
+      return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+   };
+
+   std::string data(1000000, 0);
+   std::mt19937 rng;
+   for (auto& c : data)
+      c = static_cast<char>(rng());
+   BOOST_CHECK_EQUAL(post("Content-Length: " + std::to_string(data.size()), data), std::to_string(data.size()));
+   BOOST_CHECK(contents() == data);
+
+   // A chunked body truncates the previous file.
+   std::string chunked;
+   for (size_t offset = 0; offset < 50000; offset += 3000)
+      chunked += (boost::format("%x\r\n") % 3000).str() + data.substr(offset, 3000) + "\r\n";
+   chunked += "0\r\n\r\n";
+   BOOST_CHECK_EQUAL(post("Transfer-Encoding: chunked", chunked), "51000");
+   BOOST_CHECK(contents() == data.substr(0, 51000));
+
+   BOOST_CHECK_EQUAL(post("Content-Length: 0", ""), "0");
+   BOOST_CHECK(contents().empty());
+
+   for (int i = 0; i < 20; ++i) {
+      BOOST_CHECK_EQUAL(
+         post("X-Temporary-Pool: 1\r\nContent-Length: 50000", data.substr(0, 50000)),
+         "50000");
+   }
+   BOOST_CHECK(contents() == data.substr(0, 50000));
+
+   // A declared length over the limit fails before the file is
+   // opened (or space reserved for it).
+   data.resize(options.maxBytes + 1);
+   BOOST_CHECK_EQUAL(post("Content-Length: " + std::to_string(data.size()), data), "Request body too large");
+   BOOST_CHECK(contents() == data.substr(0, 50000));
+
+   // A body over the limit fails and removes the file.
+   chunked.clear();
+   for (size_t offset = 0; offset < data.size(); offset += 65536) {
+      const size_t n = std::min<size_t>(65536, data.size() - offset);
+      chunked += (boost::format("%x\r\n") % n).str() + data.substr(offset, n) + "\r\n";
+   }
+   chunked += "0\r\n\r\n";
+   BOOST_CHECK_EQUAL(post("Transfer-Encoding: chunked", chunked), "Request body too large");
+   BOOST_CHECK(!std::ifstream(path));
+}
+
+BOOST_AUTO_TEST_CASE(Connections) {
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         BOOST_CHECK_EQUAL(http->stream()->state(), Connection::in_handler);
+         BOOST_CHECK_EQUAL(http->stream()->path(), "/Connections");
+         http->response_status() = 200;
+         http->finish();
+      });
+   server.server()->set_handler("/debug/connections", server.server()->connections_handler());
+
+   CURL *curl = curl_easy_init();
+   BOOST_REQUIRE(curl);
+
+   auto url = (boost::format("http://localhost:%d/Connections") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+
+   // The keep-alive connection is reused for the introspection request.
+   std::ostringstream os;
+   url = (boost::format("http://localhost:%d/debug/connections") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeCB);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &os);
+   BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+   LOG(info) << os.str();
+   BOOST_CHECK_EQUAL(os.str().find("[{\"peer\":"), 0);
+   BOOST_CHECK(os.str().find("\"state\":\"handler\"") != std::string::npos);
+   BOOST_CHECK(os.str().find("\"path\":\"/debug/connections\"") != std::string::npos);
+   BOOST_CHECK_EQUAL(server.server()->registry()->size(), 1);
+
+   // Wait for the connection to become idle, then close it.
+   size_t nClosed = 0;
+   for (int i = 0; i < 100 && !nClosed; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      nClosed = server.server()->close_idle_connections();
+   }
+   BOOST_CHECK_EQUAL(nClosed, 1);
+
+   // The shutdown runs on the connection's strand.
+   for (int i = 0; i < 100 && server.server()->registry()->size(); ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   BOOST_CHECK_EQUAL(server.server()->registry()->size(), 0);
+
+   curl_easy_cleanup(curl);
+}
+
+static thread_local uint64_t testAllocatedBytes;
+static uint64_t testAllocationCounter() {
+   return testAllocatedBytes;
+}
+
+BOOST_AUTO_TEST_CASE(Accounting) {
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         BOOST_ERROR("unexpected path " << http->request_path());
+         http->response_status() = 404;
+         http->finish();
+      });
+   server.server()->set_accounting(true);
+   chunky::set_allocation_counter(&testAllocationCounter);
+   server.server()->set_handler("/debug/metrics", server.server()->metrics_handler());
+   server.server()->set_handler("/Accounting", [](const std::shared_ptr<HTTP>& http) {
+         // Simulate allocation and burn some CPU.
+         testAllocatedBytes += 1000;
+         auto start = std::chrono::steady_clock::now();
+         while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(5))
+            ;
+         
+         http->response_status() = 200;
+         boost::asio::async_write(
+            *http, boost::asio::buffer(dnData),
+            [=](const error_code&, size_t) {
+               // Continuations are charged to the route.
+               testAllocatedBytes += 10;
+               http->async_finish([=](const error_code&) {
+                     http.get();
+                  });
+            });
+      });
+   
+   CURL *curl = curl_easy_init();
+   BOOST_REQUIRE(curl);
+
+   std::ostringstream os;
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeCB);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &os);
+   auto url = (boost::format("http://localhost:%d/Accounting") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+   BOOST_CHECK_EQUAL(os.str(), dnData);
+
+   os.str(std::string());
+   url = (boost::format("http://localhost:%d/debug/metrics") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+   LOG(info) << os.str();
+
+   std::smatch match;
+   static const std::regex routeRegex(
+      "\"/Accounting\":\\{\"requests\":(\\d+),\"cpu_us\":(\\d+),\"allocated_bytes\":(\\d+)\\}");
+   const std::string metrics = os.str();
+   BOOST_REQUIRE(std::regex_search(metrics, match, routeRegex));
+   BOOST_CHECK_EQUAL(std::stoi(match[1]), 1);
+   BOOST_CHECK_GE(std::stoi(match[2]), 4000);
+   BOOST_CHECK_EQUAL(std::stoi(match[3]), 1010);
+
+   chunky::set_allocation_counter(nullptr);
+   curl_easy_cleanup(curl);
+}
+
+BOOST_AUTO_TEST_CASE(LoopLag) {
+   {
+      chunky::Histogram histogram;
+      for (uint64_t i = 1; i <= 100; ++i)
+         histogram.record(i);
+      BOOST_CHECK_EQUAL(histogram.count(), 100);
+      BOOST_CHECK_EQUAL(histogram.max(), 100);
+      BOOST_CHECK_EQUAL(histogram.percentile(0.5), 63);
+      BOOST_CHECK_EQUAL(histogram.percentile(1.0), 100);
+   }
+   
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         // Block the I/O thread.
+         std::this_thread::sleep_for(std::chrono::milliseconds(50));
+         http->response_status() = 200;
+         http->finish();
+      });
+   
+   auto monitor = chunky::LoopMonitor::create(std::chrono::milliseconds(5));
+   monitor->set_blocking_threshold(std::chrono::milliseconds(20), true);
+   monitor->monitor(server.io());
+   server.server()->set_loop_monitor(monitor);
+   std::this_thread::sleep_for(std::chrono::milliseconds(20));
+   
+   CURL *curl = curl_easy_init();
+   BOOST_REQUIRE(curl);
+
+   auto url = (boost::format("http://localhost:%d/LoopLag") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+   curl_easy_cleanup(curl);
+   std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+   std::ostringstream os;
+   monitor->write_json(os);
+   LOG(info) << os.str();
+   BOOST_CHECK_EQUAL(monitor->blocking_handlers(), 1);
+   BOOST_CHECK_EQUAL(monitor->handler_time().count(), 1);
+   BOOST_CHECK_GT(monitor->lag(0).count(), 1);
+   BOOST_CHECK_GE(monitor->lag(0).max(), 20000);
+
+   monitor->stop();
+}
+
+BOOST_AUTO_TEST_CASE(BlockingCompletion) {
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->response_header("Content-Length") = "2";
+         static const std::string body("ok");
+         boost::asio::async_write(
+            *http, boost::asio::buffer(body),
+            [=](const boost::system::error_code& error, size_t) {
+               BOOST_CHECK(!error);
+               
+               // Block the I/O thread in a completion handler.
+               std::this_thread::sleep_for(std::chrono::milliseconds(50));
+               http->finish();
+            });
+      });
+   
+   auto monitor = chunky::LoopMonitor::create(std::chrono::milliseconds(5));
+   monitor->set_blocking_threshold(std::chrono::milliseconds(20), true);
+   server.server()->set_loop_monitor(monitor);
+   
+   CURL *curl = curl_easy_init();
+   BOOST_REQUIRE(curl);
+
+   auto url = (boost::format("http://localhost:%d/BlockingCompletion") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+   curl_easy_cleanup(curl);
+
+   // The body is complete before the completion handler returns.
+   auto wait_for = [](std::function<bool()> condition) {
+      for (int i = 0; i < 500 && !condition(); ++i)
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      return condition();
+   };
+   BOOST_CHECK(wait_for([=]() { return monitor->blocking_handlers() == 1; }));
+   BOOST_CHECK_GE(monitor->handler_time().count(), 2);
+   BOOST_CHECK_GE(monitor->handler_time().max(), 50000);
+}
+
+BOOST_AUTO_TEST_CASE(Timeouts) {
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->finish();
+      });
+
+   {
+      // Timers fire in order and cancelled timers do not fire.
+      auto wheel = TimerWheel::create(server.io(), std::chrono::milliseconds(5));
+      std::promise<std::string> promise;
+      std::string fired;
+      TimerWheel::Timer a([&]() { fired += "a"; });
+      TimerWheel::Timer b([&]() { fired += "b"; });
+      TimerWheel::Timer c([&]() { fired += "c"; promise.set_value(fired); });
+      wheel->schedule(c, std::chrono::milliseconds(500));
+      wheel->schedule(b, std::chrono::milliseconds(20));
+      wheel->schedule(a, std::chrono::milliseconds(10));
+      wheel->cancel(b);
+      BOOST_CHECK_EQUAL(wheel->size(), 2);
+      BOOST_CHECK_EQUAL(promise.get_future().get(), "ac");
+      BOOST_CHECK_EQUAL(wheel->size(), 0);
+   }
+
+   ConnectionTimeouts timeouts;
+   timeouts.headerRead = std::chrono::milliseconds(100);
+   server.server()->set_timeouts(timeouts);
+   server.server()->set_handler("/debug/metrics", server.server()->metrics_handler());
+
+   // Send an incomplete request head and expect the server to close.
+   boost::asio::io_service io;
+   boost::asio::ip::tcp::socket socket(io);
+   boost::asio::ip::tcp::resolver resolver(io);
+   boost::asio::connect(
+      socket, resolver.resolve({ "localhost", std::to_string(server.port()) }));
+   boost::asio::write(socket, boost::asio::buffer(std::string("GET /Timeouts HTTP/1.1\r\n")));
+
+   const auto start = std::chrono::steady_clock::now();
+   char c;
+   error_code error;
+   socket.read_some(boost::asio::buffer(&c, 1), error);
+   BOOST_CHECK_EQUAL(error, make_error_code(boost::asio::error::eof));
+   BOOST_CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(90));
+
+   CURL *curl = curl_easy_init();
+   BOOST_REQUIRE(curl);
+
+   std::ostringstream os;
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeCB);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &os);
+   auto url = (boost::format("http://localhost:%d/debug/metrics") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+   LOG(info) << os.str();
+   BOOST_CHECK(os.str().find("\"header_read\":1,") != std::string::npos);
+   curl_easy_cleanup(curl);
+}
+
+BOOST_AUTO_TEST_CASE(Admission) {
+   std::promise<std::shared_ptr<HTTP> > pending;
+   bool held = false;
+   TestServer server([&](const std::shared_ptr<HTTP>& http) {
+         // Hold the first request in flight.
+         if (!held) {
+            held = true;
+            pending.set_value(http);
+            return;
+         }
+         http->response_status() = 200;
+         http->finish();
+      });
+   server.server()->set_handler("/debug/metrics", server.server()->metrics_handler());
+
+   AdmissionLimits limits;
+   limits.maxRequests = 1;
+   limits.retryAfter = std::chrono::seconds(5);
+   server.server()->set_admission_limits(limits);
+
+   auto url = (boost::format("http://localhost:%d/Admission") % server.port()).str();
+   auto get = [=](long timeout) {
+      CURL *curl = curl_easy_init();
+      std::ostringstream os;
+      curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &writeCB);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, &os);
+      curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+      long status = 0;
+      if (curl_easy_perform(curl) == CURLE_OK)
+         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+      curl_easy_cleanup(curl);
+      return std::make_pair(status, os.str());
+   };
+
+   // The second concurrent request is shed.
+   auto first = std::async(std::launch::async, get, 5000L);
+   auto http = pending.get_future().get();
+   BOOST_CHECK_EQUAL(server.server()->requests_in_flight(), 1);
+   auto second = get(5000L);
+   BOOST_CHECK_EQUAL(second.first, 503);
+   BOOST_CHECK(second.second.find("Retry-After: 5\r\n") != std::string::npos);
+
+   // A shed request with an unread body still gets the response
+   // and a clean close rather than a reset.
+   {
+      boost::asio::io_service io;
+      boost::asio::ip::tcp::socket socket(io);
+      boost::asio::ip::tcp::resolver resolver(io);
+      boost::asio::connect(
+         socket, resolver.resolve({ "localhost", std::to_string(server.port()) }));
+      boost::asio::write(socket, boost::asio::buffer(
+         "POST /Admission HTTP/1.1\r\n"
+         "Content-Length: 16384\r\n"
+         "\r\n" + std::string(16384, 'x')));
+
+      boost::asio::streambuf response;
+      error_code error;
+      boost::asio::read(socket, response, error);
+      BOOST_CHECK_EQUAL(error, make_error_code(boost::asio::error::eof));
+      std::string text(
+         boost::asio::buffers_begin(response.data()),
+         boost::asio::buffers_end(response.data()));
+      BOOST_CHECK_EQUAL(text.compare(0, 12, "HTTP/1.1 503"), 0);
+      BOOST_CHECK(text.find("Retry-After: 5\r\n") != std::string::npos);
+   }
+
+   server.io().post([=]() {
+         http->response_status() = 200;
+         http->finish();
+      });
+   http.reset();
+   BOOST_CHECK_EQUAL(first.get().first, 200);
+
+   // Accepting pauses at the connection limit and resumes when a
+   // connection closes.
+   limits.maxRequests = 0;
+   limits.maxConnections = 1;
+   server.server()->set_admission_limits(limits);
+   {
+      boost::asio::io_service io;
+      boost::asio::ip::tcp::socket socket(io);
+      boost::asio::ip::tcp::resolver resolver(io);
+      boost::asio::connect(
+         socket, resolver.resolve({ "localhost", std::to_string(server.port()) }));
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      BOOST_CHECK_EQUAL(get(200L).first, 0);
+   }
+   std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+   CURL *curl = curl_easy_init();
+   BOOST_REQUIRE(curl);
+
+   std::ostringstream os;
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeCB);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &os);
+   url = (boost::format("http://localhost:%d/debug/metrics") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+   LOG(info) << os.str();
+   BOOST_CHECK(os.str().find("\"shed_requests\":2,") != std::string::npos);
+   BOOST_CHECK(os.str().find("\"accept_pauses\":0}") == std::string::npos);
+   curl_easy_cleanup(curl);
+}
+
+BOOST_AUTO_TEST_CASE(RateLimit) {
+   {
+      // Buckets refill at the configured rate.
+      auto limiter = RateLimiter::create(100.0, 2.0);
+      auto address = boost::asio::ip::address::from_string("192.0.2.1");
+      BOOST_CHECK(limiter->allow(address));
+      BOOST_CHECK(limiter->allow(address));
+      BOOST_CHECK(!limiter->allow(address));
+      BOOST_CHECK(limiter->allow(boost::asio::ip::address::from_string("192.0.2.2")));
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      BOOST_CHECK(limiter->allow(address));
+      BOOST_CHECK_EQUAL(limiter->limited(), 1);
+   }
+
+   {
+      // Memory is bounded when tracking many clients.
+      auto limiter = RateLimiter::create(1.0, 1.0, 64);
+      for (unsigned long i = 0; i < 10000; ++i)
+         BOOST_CHECK(limiter->allow(boost::asio::ip::address_v4(i)));
+   }
+   
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->finish();
+      });
+   server.server()->set_rate_limiter(RateLimiter::create(0.5, 2.0));
+
+   CURL *curl = curl_easy_init();
+   BOOST_REQUIRE(curl);
+
+   std::ostringstream os;
+   curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &writeCB);
+   curl_easy_setopt(curl, CURLOPT_HEADERDATA, &os);
+   auto url = (boost::format("http://localhost:%d/RateLimit") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   for (long expected : { 200, 200, 429, 429 }) {
+      long status = 0;
+      BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+      BOOST_CHECK_EQUAL(status, expected);
+   }
+   BOOST_CHECK(os.str().find("Retry-After: 2\r\n") != std::string::npos);
+
+   // The connection is kept alive for rejected requests.
+   long nConnects = 0;
+   curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &nConnects);
+   BOOST_CHECK_EQUAL(nConnects, 0);
+   BOOST_CHECK_EQUAL(server.server()->rate_limiter()->limited(), 2);
+   curl_easy_cleanup(curl);
+}
+
+BOOST_AUTO_TEST_CASE(Backpressure) {
+   static const size_t nChunks = 256;
+   static const size_t chunkSize = 4096;
+   std::atomic<size_t> maxQueued(0);
+   std::atomic<size_t> nWaits(0);
+   TestServer server([&](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 200;
+         http->set_write_watermarks(8192, 32768);
+
+         // Produce only while the queue is below the high watermark.
+         auto produce = std::make_shared<std::function<void(size_t)> >();
+         *produce = [=, &maxQueued, &nWaits](size_t i) {
+            for (; i < nChunks; ++i) {
+               const bool writable = http->queue_write(std::string(chunkSize, 'a' + i % 26));
+               maxQueued = std::max<size_t>(maxQueued, http->queued_bytes());
+               if (!i) {
+                  // The first write cannot complete before the request
+                  // handler returns, so synchronous completion fails.
+                  BOOST_CHECK_EQUAL(http->queued_bytes(), chunkSize);
+                  error_code error;
+                  http->finish(error);
+                  BOOST_CHECK(error == boost::system::errc::operation_in_progress);
+                  std::string leftover;
+                  error = error_code();
+                  http->release_stream(leftover, error);
+                  BOOST_CHECK(error == boost::system::errc::operation_in_progress);
+               }
+               if (!writable) {
+                  ++nWaits;
+                  http->async_wait_writable([=](const error_code& error) {
+                        BOOST_CHECK(!error);
+                        BOOST_CHECK_LE(http->queued_bytes(), 8192);
+                        (*produce)(i + 1);
+                     });
+                  return;
+               }
+            }
+            
+            http->async_finish([=](const error_code& error) {
+                  BOOST_CHECK(!error);
+                  BOOST_CHECK_EQUAL(http->queued_bytes(), 0);
+                  *produce = nullptr;
+               });
+         };
+         (*produce)(0);
+      });
+   server.server()->set_notsent_lowat(16384);
+
+   CURL *curl = curl_easy_init();
+   BOOST_REQUIRE(curl);
+
+   std::ostringstream os;
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeCB);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &os);
+   auto url = (boost::format("http://localhost:%d/Backpressure") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+   curl_easy_cleanup(curl);
+
+   const std::string body = os.str();
+   BOOST_REQUIRE_EQUAL(body.size(), nChunks * chunkSize);
+   for (size_t i = 0; i < nChunks; ++i)
+      BOOST_CHECK_EQUAL(body[i * chunkSize], 'a' + i % 26);
+   BOOST_CHECK_GT(nWaits, 0);
+   BOOST_CHECK_LE(maxQueued, 32768);
+}
+
+BOOST_AUTO_TEST_CASE(WriteThrottle) {
+   static const size_t nBytes = 400000;
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         // Slice writes and cap the rate.
+         http->stream()->set_write_quantum(8192);
+         http->stream()->set_bandwidth_limit(1000000, 50000);
+         
+         auto body = std::make_shared<std::string>(nBytes, 'x');
+         http->response_status() = 200;
+         http->response_header("Content-Length") = std::to_string(nBytes);
+         if (http->request_path() == "/sync") {
+            // Synchronous writes are charged but never sleep.
+            http->stream()->set_bandwidth_limit(10000, 8192);
+            boost::asio::write(*http, boost::asio::buffer(*body));
+            http->finish();
+            return;
+         }
+         
+         boost::asio::async_write(
+            *http, boost::asio::buffer(*body),
+            [=](const error_code& error, size_t) {
+               BOOST_CHECK(!error);
+               http->async_finish([=](const error_code&) {
+                     http.get();
+                     body.get();
+                  });
+            });
+      });
+
+   CURL *curl = curl_easy_init();
+   BOOST_REQUIRE(curl);
+
+   std::ostringstream os;
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeCB);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &os);
+   auto url = (boost::format("http://localhost:%d/WriteThrottle") % server.port()).str();
+   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+   const auto start = std::chrono::steady_clock::now();
+   BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+   const auto elapsed = std::chrono::steady_clock::now() - start;
+   curl_easy_cleanup(curl);
+
+   // The first burst is free, so 350 KB more at 1 MB/s.
+   BOOST_CHECK_EQUAL(os.str().size(), nBytes);
+   BOOST_CHECK(elapsed >= std::chrono::milliseconds(300));
+
+   // A synchronous write would take 40 s at 10 KB/s if it waited
+   // for tokens.
+   {
+      CURL *curl = curl_easy_init();
+      BOOST_REQUIRE(curl);
+
+      std::ostringstream os;
+      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeCB);
+      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &os);
+      auto url = (boost::format("http://localhost:%d/sync") % server.port()).str();
+      curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+      const auto start = std::chrono::steady_clock::now();
+      BOOST_CHECK_EQUAL(curl_easy_perform(curl), CURLE_OK);
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      curl_easy_cleanup(curl);
+
+      BOOST_CHECK_EQUAL(os.str().size(), nBytes);
+      BOOST_CHECK(elapsed < std::chrono::seconds(5));
+   }
+}
+
+BOOST_AUTO_TEST_CASE(EventStream) {
+   auto hub = EventStreamHub<TCP>::create(4);
+   TestServer server([=](const std::shared_ptr<HTTP>& http) {
+         hub->subscribe("news", http);
+      });
+
+   auto wait_for = [](std::function<bool()> condition) {
+      for (int i = 0; i < 500 && !condition(); ++i)
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      return condition();
+   };
+
+   // Subscribe and return the response head.
+   boost::asio::io_service io;
+   auto subscribe = [&](boost::asio::ip::tcp::socket& socket, const std::string& lastEventId) {
+      boost::asio::ip::tcp::resolver resolver(io);
+      boost::asio::connect(socket, resolver.resolve({ "localhost", std::to_string(server.port()) }));
+      std::string request = "GET /events HTTP/1.1\r\nHost: localhost\r\n";
+      if (!lastEventId.empty())
+         request += "Last-Event-ID: " + lastEventId + "\r\n";
+      boost::asio::write(socket, boost::asio::buffer(request + "\r\n"));
+
+      std::string head;
+      char c;
+      while (head.size() < 4 || head.compare(head.size() - 4, 4, "\r\n\r\n") != 0) {
+         boost::asio::read(socket, boost::asio::buffer(&c, 1));
+         head.push_back(c);
+      }
+      return head;
+   };
+
+   auto receive = [](boost::asio::ip::tcp::socket& socket, size_t nBytes) {
+      std::string data(nBytes, '\0');
+      boost::asio::read(socket, boost::asio::buffer(&data[0], data.size()));
+      return data;
+   };
+   
+   auto at_eof = [](boost::asio::ip::tcp::socket& socket) {
+      char c;
+      error_code error;
+      boost::asio::read(socket, boost::asio::buffer(&c, 1), error);
+      return error == boost::asio::error::eof;
+   };
+
+   static const std::string comment("3\r\n:\n\n\r\n");
+   boost::asio::ip::tcp::socket socket1(io);
+   const std::string head = subscribe(socket1, std::string());
+   BOOST_CHECK(boost::starts_with(head, "HTTP/1.1 200"));
+   BOOST_CHECK(head.find("Content-Type: text/event-stream\r\n") != std::string::npos);
+   BOOST_CHECK(head.find("Transfer-Encoding: chunked\r\n") != std::string::npos);
+   BOOST_CHECK_EQUAL(receive(socket1, comment.size()), comment);
+   BOOST_REQUIRE(wait_for([=]() { return hub->subscribers() == 1; }));
+
+   // Events are chunk-framed with one data field per line.
+   const std::string first("25\r\nid: 1\nevent: update\ndata: a\ndata: b\n\n\r\n");
+   BOOST_CHECK_EQUAL(hub->publish("news", "a\r\nb", "update"), 1);
+   BOOST_CHECK_EQUAL(receive(socket1, first.size()), first);
+   
+   std::string rest;
+   for (int i = 2; i <= 6; ++i) {
+      BOOST_CHECK_EQUAL(hub->publish("news", std::to_string(i)), i);
+      rest += EventStreamHub<TCP>::encode_event(i, std::string(), std::to_string(i));
+   }
+   BOOST_CHECK_EQUAL(receive(socket1, rest.size()), rest);
+
+   // A reconnecting client is sent the events after its last one.
+   boost::asio::ip::tcp::socket socket2(io);
+   subscribe(socket2, "4");
+   const std::string replay =
+      EventStreamHub<TCP>::encode_event(5, std::string(), "5") +
+      EventStreamHub<TCP>::encode_event(6, std::string(), "6");
+   BOOST_CHECK_EQUAL(receive(socket2, comment.size() + replay.size()), comment + replay);
+   BOOST_CHECK_EQUAL(hub->replayed(), 2);
+   BOOST_REQUIRE(wait_for([=]() { return hub->subscribers() == 2; }));
+
+   // Closing the channel ends each response.
+   hub->close("news");
+   BOOST_CHECK_EQUAL(receive(socket1, 5), "0\r\n\r\n");
+   BOOST_CHECK(at_eof(socket1));
+   BOOST_CHECK_EQUAL(receive(socket2, 5), "0\r\n\r\n");
+   BOOST_CHECK(at_eof(socket2));
+   BOOST_CHECK_EQUAL(hub->subscribers(), 0);
+
+   // A subscriber over the limit is disconnected.
+   boost::asio::ip::tcp::socket socket3(io);
+   subscribe(socket3, std::string());
+   BOOST_CHECK_EQUAL(receive(socket3, comment.size()), comment);
+   BOOST_REQUIRE(wait_for([=]() { return hub->subscribers() == 1; }));
+   hub->set_subscriber_limit(100);
+   BOOST_CHECK_EQUAL(hub->publish("news", std::string(200, 'x')), 1);
+   BOOST_CHECK(at_eof(socket3));
+   BOOST_CHECK_EQUAL(hub->dropped(), 1);
+   BOOST_CHECK_EQUAL(hub->subscribers(), 0);
+   BOOST_CHECK_EQUAL(hub->published(), 7);
+}
+
+BOOST_AUTO_TEST_CASE(LongPoll) {
+   static const size_t nClients = 3;
+   std::shared_ptr<SimpleHTTPServer> parking;
+   TestServer server([&](const std::shared_ptr<HTTP>& http) {
+         parking->park(http->request_path(), http, std::chrono::milliseconds(300));
+      });
+   parking = server.server();
+
+   auto wait_for = [](std::function<bool()> condition) {
+      for (int i = 0; i < 500 && !condition(); ++i)
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      return condition();
+   };
+
+   // Read a response with an optional Content-Length body.
+   auto receive = [](boost::asio::ip::tcp::socket& socket) {
+      std::string response;
+      char c;
+      while (response.size() < 4 || response.compare(response.size() - 4, 4, "\r\n\r\n") != 0) {
+         boost::asio::read(socket, boost::asio::buffer(&c, 1));
+         response.push_back(c);
+      }
+
+      static const std::string contentLength("Content-Length: ");
+      auto i = response.find(contentLength);
+      if (i != std::string::npos) {
+         std::string body(std::stoul(response.substr(i + contentLength.size())), '\0');
+         boost::asio::read(socket, boost::asio::buffer(&body[0], body.size()));
+         response += body;
+      }
+      return response;
+   };
+   
+   boost::asio::io_service io;
+   boost::asio::ip::tcp::resolver resolver(io);
+   std::vector<std::unique_ptr<boost::asio::ip::tcp::socket> > sockets;
+   for (size_t i = 0; i < nClients; ++i) {
+      sockets.emplace_back(new boost::asio::ip::tcp::socket(io));
+      boost::asio::connect(*sockets.back(), resolver.resolve({ "localhost", std::to_string(server.port()) }));
+      boost::asio::write(*sockets.back(), boost::asio::buffer(std::string("GET /wait HTTP/1.1\r\nHost: localhost\r\n\r\n")));
+   }
+   BOOST_REQUIRE(wait_for([&]() { return parking->parked() == nClients; }));
+   BOOST_CHECK_EQUAL(parking->requests_in_flight(), 0);
+
+   // Notify wakes every request on the key with the same response.
+   BOOST_CHECK_EQUAL(parking->notify("/other", PreparedResponse::create(200, "no")), 0);
+   auto response = PreparedResponse::create(200, "{\"since\":1}", "application/json");
+   BOOST_CHECK_EQUAL(response->data,
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: application/json\r\n"
+                     "Content-Length: 11\r\n"
+                     "\r\n"
+                     "{\"since\":1}");
+   BOOST_CHECK_EQUAL(parking->notify("/wait", response), nClients);
+   BOOST_CHECK_EQUAL(parking->parked(), 0);
+   for (auto& socket : sockets)
+      BOOST_CHECK_EQUAL(receive(*socket), response->data);
+
+   // Unnotified requests time out on the same connection.
+   const auto start = std::chrono::steady_clock::now();
+   boost::asio::write(*sockets[0], boost::asio::buffer(std::string("GET /wait HTTP/1.1\r\nHost: localhost\r\n\r\n")));
+   BOOST_CHECK_EQUAL(receive(*sockets[0]), "HTTP/1.1 204 No Content\r\n\r\n");
+   BOOST_CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(150));
+   BOOST_CHECK_EQUAL(parking->parked(), 0);
+   BOOST_CHECK(wait_for([&]() { return parking->requests_in_flight() == 0; }));
+   parking.reset();
+}
+
+BOOST_AUTO_TEST_CASE(WebSocketMask) {
+   std::mt19937 generator;
+   std::uniform_int_distribution<int> byte(0, 255);
+   std::vector<char> data(4096);
+   for (auto& c : data)
+      c = static_cast<char>(byte(generator));
+   const char key[4] = { '\x12', '\x34', '\x56', '\x78' };
+
+   // Every kernel matches the bytewise reference at all alignments,
+   // lengths, and starting phases, including split buffers.
+   for (const auto& function : websocket::mask_functions()) {
+      LOG(info) << "mask kernel " << function.first;
+      for (size_t offset = 0; offset < 33; ++offset) {
+         for (size_t size : { 0, 1, 3, 15, 31, 63, 64, 65, 127, 1000, 4000 }) {
+            if (offset + size > data.size())
+               continue;
+            for (size_t phase = 0; phase < 4; ++phase) {
+               std::vector<char> expected(data);
+               websocket::mask_bytewise(&expected[offset], size, key, phase);
+
+               std::vector<char> actual(data);
+               const size_t split = size / 3;
+               size_t next = function.second(&actual[offset], split, key, phase);
+               next = function.second(&actual[offset + split], size - split, key, next);
+               BOOST_CHECK_EQUAL(next, (phase + size) & 0x3);
+               BOOST_CHECK(actual == expected);
+            }
+         }
+      }
+   }
+}
+
+BOOST_AUTO_TEST_CASE(WebSocketFrames) {
+   std::mt19937 generator;
+   std::uniform_int_distribution<int> byte(0, 255);
+   const char key[4] = { '\x21', '\x43', '\x65', '\x07' };
+
+   // Encode a stream of frames of assorted sizes, some masked and
+   // some larger than the reader buffer.
+   std::vector<std::pair<uint8_t, std::string> > frames;
+   std::string wire;
+   for (size_t size : { 0, 1, 125, 126, 127, 1000, 65535, 65536, 5000, 200000, 3, 70000 }) {
+      std::string payload(size, '\0');
+      for (auto& c : payload)
+         c = static_cast<char>(byte(generator));
+      const uint8_t type = static_cast<uint8_t>(
+         (frames.size() & 1 ? websocket::continuation : websocket::fin | websocket::binary));
+      const bool masked = (frames.size() % 3) != 0;
+      frames.emplace_back(type, payload);
+
+      wire.push_back(static_cast<char>(type));
+      const char maskBit = masked ? '\x80' : '\x00';
+      if (size < 126)
+         wire.push_back(static_cast<char>(size) | maskBit);
+      else if (size < 65536) {
+         wire.push_back(static_cast<char>(126) | maskBit);
+         for (int shift = 8; shift >= 0; shift -= 8)
+            wire.push_back(static_cast<char>(size >> shift));
+      }
+      else {
+         wire.push_back(static_cast<char>(127) | maskBit);
+         for (int shift = 56; shift >= 0; shift -= 8)
+            wire.push_back(static_cast<char>(static_cast<uint64_t>(size) >> shift));
+      }
+
+      if (masked) {
+         wire.append(key, sizeof(key));
+         websocket::mask(&payload[0], payload.size(), key);
+      }
+      wire += payload;
+   }
+
+   // Feed the stream in random chunks.
+   std::uniform_int_distribution<size_t> chunk(1, 20000);
+   websocket::FrameReader reader(16384);
+   size_t index = 0;
+   size_t offset = 0;
+   while (offset < wire.size()) {
+      auto buffer = reader.prepare();
+      const size_t n = std::min({
+            chunk(generator),
+            boost::asio::buffer_size(buffer),
+            wire.size() - offset });
+      std::memcpy(boost::asio::buffer_cast<char*>(buffer), &wire[offset], n);
+      reader.commit(n);
+      offset += n;
+
+      websocket::Frame frame;
+      boost::system::error_code error;
+      while (reader.next(frame, error)) {
+         BOOST_REQUIRE_LT(index, frames.size());
+         BOOST_CHECK_EQUAL(frame.type, frames[index].first);
+         BOOST_CHECK_EQUAL(frame.masked, (index % 3) != 0);
+         BOOST_CHECK(std::string(frame.data, frame.size) == frames[index].second);
+         ++index;
+      }
+      BOOST_CHECK(!error);
+   }
+   BOOST_CHECK_EQUAL(index, frames.size());
+   BOOST_CHECK_EQUAL(reader.buffered(), 0);
+
+   // Assigned bytes are decoded in place, and an incomplete frame at
+   // their end continues in the buffer.
+   {
+      std::string leftover = wire.substr(0, wire.size() / 2);
+      websocket::FrameReader reader(16384);
+      reader.assign(&leftover[0], leftover.size());
+      size_t index = 0;
+      websocket::Frame frame;
+      boost::system::error_code error;
+      while (reader.next(frame, error)) {
+         BOOST_CHECK(frame.data >= &leftover[0] && frame.data < &leftover[0] + leftover.size());
+         BOOST_CHECK(std::string(frame.data, frame.size) == frames[index].second);
+         ++index;
+      }
+      BOOST_CHECK(!error);
+      BOOST_CHECK_GT(index, 0);
+      std::string().swap(leftover);
+
+      size_t offset = wire.size() / 2;
+      while (offset < wire.size()) {
+         auto buffer = reader.prepare();
+         const size_t n = std::min(boost::asio::buffer_size(buffer), wire.size() - offset);
+         std::memcpy(boost::asio::buffer_cast<char*>(buffer), &wire[offset], n);
+         reader.commit(n);
+         offset += n;
+         while (reader.next(frame, error)) {
+            BOOST_REQUIRE_LT(index, frames.size());
+            BOOST_CHECK(std::string(frame.data, frame.size) == frames[index].second);
+            ++index;
+         }
+      }
+      BOOST_CHECK_EQUAL(index, frames.size());
+   }
+
+   // Payloads over the limit are rejected.
+   websocket::FrameReader limited(1024, 100);
+   const char header[] = { '\x82', '\x7e', '\x00', '\x65' };
+   auto buffer = limited.prepare();
+   std::memcpy(boost::asio::buffer_cast<char*>(buffer), header, sizeof(header));
+   limited.commit(sizeof(header));
+
+   websocket::Frame frame;
+   boost::system::error_code error;
+   BOOST_CHECK(!limited.next(frame, error));
+   BOOST_CHECK(error == boost::asio::error::message_size);
+
+   // Client headers carry the mask bit and key.
+   char clientHeader[websocket::MaxClientHeader];
+   BOOST_CHECK_EQUAL(websocket::encode_client_header(clientHeader, websocket::fin | websocket::text, 70000, key), 14);
+   BOOST_CHECK(std::string(clientHeader, 14) ==
+               std::string("\x81\xff\0\0\0\0\0\x01\x11\x70", 10) + std::string(key, sizeof(key)));
+}
+
+// Open a WebSocket client connection (without validating the
+// handshake response), returning the response head.
+static std::string ws_connect(
+   boost::asio::io_service& io,
+   boost::asio::ip::tcp::socket& socket,
+   unsigned short port,
+   const std::string& path = "/ws",
+   const std::string& headers = std::string(),
+   const std::string& early = std::string()) {
+   boost::asio::ip::tcp::resolver resolver(io);
+   boost::asio::connect(socket, resolver.resolve({ "localhost", std::to_string(port) }));
+   boost::asio::write(socket, boost::asio::buffer(
+      "GET " + path + " HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+      "Sec-WebSocket-Version: 13\r\n" +
+      headers +
+      "\r\n" +
+      early));
+
+   // Read the response head a byte at a time to avoid overreading.
+   std::string head;
+   char c;
+   while (head.size() < 4 || head.compare(head.size() - 4, 4, "\r\n\r\n") != 0) {
+      boost::asio::read(socket, boost::asio::buffer(&c, 1));
+      head.push_back(c);
+   }
+   BOOST_REQUIRE(boost::starts_with(head, "HTTP/1.1 101"));
+   return head;
+}
+
+// Encode a masked client frame.
+static std::string ws_frame(uint8_t type, std::string payload) {
+   const char key[4] = { '\x0f', '\x1e', '\x2d', '\x3c' };
+   std::string frame(1, static_cast<char>(type));
+   if (payload.size() < 126)
+      frame.push_back(static_cast<char>(0x80 | payload.size()));
+   else if (payload.size() < 65536) {
+      frame.push_back(static_cast<char>(0x80 | 126));
+      frame.push_back(static_cast<char>(payload.size() >> 8));
+      frame.push_back(static_cast<char>(payload.size()));
+   }
+   else {
+      frame.push_back(static_cast<char>(0x80 | 127));
+      for (int shift = 56; shift >= 0; shift -= 8)
+         frame.push_back(static_cast<char>(static_cast<uint64_t>(payload.size()) >> shift));
+   }
+   frame.append(key, sizeof(key));
+   websocket::mask(&payload[0], payload.size(), key);
+   return frame + payload;
+}
+
+// Send a masked client frame.
+static void ws_send(boost::asio::ip::tcp::socket& socket, uint8_t type, std::string payload) {
+   boost::asio::write(socket, boost::asio::buffer(ws_frame(type, payload)));
+}
+
+// Receive an unmasked server frame.
+static std::pair<uint8_t, std::string> ws_receive(boost::asio::ip::tcp::socket& socket) {
+   unsigned char header[10];
+   boost::asio::read(socket, boost::asio::buffer(header, 2));
+   uint64_t size = header[1] & 0x7f;
+   const size_t nLengthBytes = size == 126 ? 2 : size == 127 ? 8 : 0;
+   if (nLengthBytes) {
+      boost::asio::read(socket, boost::asio::buffer(header + 2, nLengthBytes));
+      size = 0;
+      for (size_t i = 0; i < nLengthBytes; ++i)
+         size = (size << 8) | header[2 + i];
+   }
+
+   std::string payload(static_cast<size_t>(size), '\0');
+   boost::asio::read(socket, boost::asio::buffer(&payload[0], payload.size()));
+   return std::make_pair(header[0], payload);
+}
+
+BOOST_AUTO_TEST_CASE(WebSocketSessionEcho) {
+   typedef WebSocketSession<TCP> Session;
+   std::atomic<uint16_t> closeCode(0);
+   TestServer server([&](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 101;
+         http->response_header("Upgrade") = "websocket";
+         http->response_header("Connection") = "upgrade";
+         http->finish();
+
+         // Echo each message.
+         auto session = Session::create(http, 4096);
+         std::weak_ptr<Session> weak = session;
+         session->start([&, weak](const error_code& error, uint8_t type, const char* data, size_t size) {
+               auto session = weak.lock();
+               if (!session)
+                  return;
+               if (error) {
+                  if (error == boost::asio::error::eof)
+                     closeCode = session->close_code();
+                  return;
+               }
+               
+               auto message = std::make_shared<std::string>(data, size);
+               session->async_send(
+                  websocket::fin | type, boost::asio::buffer(*message),
+                  [=](const error_code& error) {
+                     BOOST_CHECK(!error);
+                     message.get();
+                  });
+            });
+      });
+
+   boost::asio::io_service io;
+   {
+      boost::asio::ip::tcp::socket socket(io);
+      ws_connect(io, socket, server.port());
+
+      ws_send(socket, websocket::fin | websocket::text, "hello");
+      auto frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::text);
+      BOOST_CHECK_EQUAL(frame.second, "hello");
+
+      // Reassemble a fragmented message with an interleaved ping.
+      ws_send(socket, websocket::text, "ab");
+      ws_send(socket, websocket::fin | websocket::ping, "p");
+      ws_send(socket, websocket::fin | websocket::continuation, "cd");
+      frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::pong);
+      BOOST_CHECK_EQUAL(frame.second, "p");
+      frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::text);
+      BOOST_CHECK_EQUAL(frame.second, "abcd");
+
+      // Messages may exceed the read buffer.
+      std::string big(100000, 'x');
+      ws_send(socket, websocket::fin | websocket::binary, big);
+      frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::binary);
+      BOOST_CHECK(frame.second == big);
+
+      // The close handshake ends the connection.
+      ws_send(socket, websocket::fin | websocket::close, std::string("\x03\xe8", 2));
+      frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::close);
+      BOOST_CHECK_EQUAL(frame.second, std::string("\x03\xe8", 2));
+
+      error_code error;
+      char c;
+      boost::asio::read(socket, boost::asio::buffer(&c, 1), error);
+      BOOST_CHECK(error == boost::asio::error::eof);
+      BOOST_CHECK_EQUAL(closeCode, 1000);
+   }
+
+   // Protocol violations close the connection with status 1002.
+   auto violate = [&](const std::string& wire) {
+      boost::asio::ip::tcp::socket socket(io);
+      ws_connect(io, socket, server.port());
+      boost::asio::write(socket, boost::asio::buffer(wire));
+      auto frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::close);
+      BOOST_CHECK_EQUAL(frame.second, std::string("\x03\xea", 2));
+   };
+   violate(ws_frame(websocket::fin | websocket::continuation, "oops"));
+
+   // Unmasked client frames, close payloads of one byte, and close
+   // codes that may not be sent are violations.
+   violate(std::string("\x81\x02hi", 4));
+   violate(ws_frame(websocket::fin | websocket::close, std::string("\x03", 1)));
+   for (const char* code : { "\x03\xed", "\x03\xee", "\x03\xf7", "\x03\xe7", "\x13\x88" })
+      violate(ws_frame(websocket::fin | websocket::close, std::string(code, 2)));
+
+   {
+      // Only the status code of a close frame is echoed, and an
+      // empty close frame is echoed empty.
+      boost::asio::ip::tcp::socket socket(io);
+      ws_connect(io, socket, server.port());
+      ws_send(socket, websocket::fin | websocket::close, std::string("\x0b\xb8", 2) + "bye");
+      auto frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::close);
+      BOOST_CHECK_EQUAL(frame.second, std::string("\x0b\xb8", 2));
+
+      boost::asio::ip::tcp::socket empty(io);
+      ws_connect(io, empty, server.port());
+      ws_send(empty, websocket::fin | websocket::close, "");
+      frame = ws_receive(empty);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::close);
+      BOOST_CHECK_EQUAL(frame.second, "");
+   }
+}
+
+BOOST_AUTO_TEST_CASE(WebSocketSendQueue) {
+   typedef WebSocketSession<TCP> Session;
+   const size_t nThreads = 4;
+   const size_t nMessages = 500;
+   TestServer server([&](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 101;
+         http->response_header("Upgrade") = "websocket";
+         http->response_header("Connection") = "upgrade";
+         http->finish();
+
+         auto session = Session::create(http);
+         if (http->request_path() == "/ws") {
+            // Send concurrently from several threads.
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < nThreads; ++i) {
+               threads.emplace_back([=]() {
+                     for (size_t j = 0; j < nMessages; ++j) {
+                        auto message = std::make_shared<std::string>(
+                           (boost::format("%d:%d") % i % j).str());
+                        if (j & 1)
+                           session->queue_send(websocket::fin | websocket::text, *message);
+                        else {
+                           session->async_send(
+                              websocket::fin | websocket::text, boost::asio::buffer(*message),
+                              [=](const error_code& error) {
+                                 BOOST_CHECK(!error);
+                                 message.get();
+                              });
+                        }
+                     }
+                  });
+            }
+            for (auto& thread : threads)
+               thread.join();
+         }
+         else if (http->request_path() == "/newest") {
+            // The first message is in flight, so the second exceeds
+            // the limit.
+            session->set_send_limit(1000, Session::drop_newest);
+            BOOST_CHECK(session->queue_send(websocket::fin | websocket::binary, std::string(600, 'a')));
+            BOOST_CHECK(!session->queue_send(websocket::fin | websocket::binary, std::string(600, 'b')));
+            session->queue_send(websocket::fin | websocket::binary, std::string(300, 'c'));
+            BOOST_CHECK_EQUAL(session->dropped(), 1);
+         }
+         else if (http->request_path() == "/oldest") {
+            session->set_send_limit(1000, Session::drop_oldest);
+            session->queue_send(websocket::fin | websocket::binary, std::string(600, 'a'));
+            session->queue_send(websocket::fin | websocket::binary, std::string(300, 'b'));
+            session->queue_send(websocket::fin | websocket::binary, std::string(300, 'c'));
+            BOOST_CHECK_EQUAL(session->dropped(), 1);
+         }
+         else if (http->request_path() == "/close") {
+            session->set_send_limit(1000, Session::close_session);
+            session->queue_send(websocket::fin | websocket::binary, std::string(600, 'a'));
+            session->async_send(
+               websocket::fin | websocket::binary, boost::asio::buffer("b", 1),
+               [](const error_code& error) {
+                  BOOST_CHECK(error == boost::asio::error::operation_aborted);
+               });
+            session->queue_send(websocket::fin | websocket::binary, std::string(600, 'c'));
+         }
+         session->start([session](const error_code&, uint8_t, const char*, size_t) {});
+      });
+
+   boost::asio::io_service io;
+   {
+      // Each thread's messages arrive intact and in order.
+      boost::asio::ip::tcp::socket socket(io);
+      ws_connect(io, socket, server.port());
+      std::vector<size_t> next(nThreads, 0);
+      for (size_t n = 0; n < nThreads*nMessages; ++n) {
+         auto frame = ws_receive(socket);
+         BOOST_REQUIRE_EQUAL(frame.first, websocket::fin | websocket::text);
+         const auto colon = frame.second.find(':');
+         const size_t i = std::stoul(frame.second.substr(0, colon));
+         const size_t j = std::stoul(frame.second.substr(colon + 1));
+         BOOST_REQUIRE_LT(i, nThreads);
+         BOOST_CHECK_EQUAL(j, next[i]++);
+      }
+   }
+
+   {
+      boost::asio::ip::tcp::socket socket(io);
+      ws_connect(io, socket, server.port(), "/newest");
+      BOOST_CHECK_EQUAL(ws_receive(socket).second, std::string(600, 'a'));
+      BOOST_CHECK_EQUAL(ws_receive(socket).second, std::string(300, 'c'));
+   }
+
+   {
+      boost::asio::ip::tcp::socket socket(io);
+      ws_connect(io, socket, server.port(), "/oldest");
+      BOOST_CHECK_EQUAL(ws_receive(socket).second, std::string(600, 'a'));
+      BOOST_CHECK_EQUAL(ws_receive(socket).second, std::string(300, 'c'));
+   }
+
+   {
+      // The slow consumer gets a policy violation close.
+      boost::asio::ip::tcp::socket socket(io);
+      ws_connect(io, socket, server.port(), "/close");
+      BOOST_CHECK_EQUAL(ws_receive(socket).second, std::string(600, 'a'));
+      auto frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::close);
+      BOOST_CHECK_EQUAL(frame.second, std::string("\x03\xf0", 2));
+   }
+}
+
+BOOST_AUTO_TEST_CASE(WebSocketBroadcast) {
+   typedef WebSocketSession<TCP> Session;
+   auto hub = WebSocketHub<TCP>::create(4);
+   TestServer server([=](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 101;
+         http->response_header("Upgrade") = "websocket";
+         http->response_header("Connection") = "upgrade";
+         http->finish();
+
+         auto session = Session::create(http);
+         hub->subscribe(session);
+         session->start([session](const error_code&, uint8_t, const char*, size_t) {});
+      });
+
+   auto wait_for = [](std::function<bool()> condition) {
+      for (int i = 0; i < 500 && !condition(); ++i)
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      return condition();
+   };
+   
+   // Every subscriber gets every message in order.
+   boost::asio::io_service io;
+   std::vector<std::unique_ptr<boost::asio::ip::tcp::socket> > sockets;
+   for (size_t i = 0; i < 10; ++i) {
+      sockets.emplace_back(new boost::asio::ip::tcp::socket(io));
+      ws_connect(io, *sockets.back(), server.port());
+   }
+   BOOST_REQUIRE(wait_for([=]() { return hub->subscribers() == 10; }));
+
+   for (int i = 0; i < 5; ++i)
+      hub->publish(websocket::fin | websocket::text, boost::asio::buffer(std::to_string(i)));
+   for (auto& socket : sockets) {
+      for (int i = 0; i < 5; ++i) {
+         auto frame = ws_receive(*socket);
+         BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::text);
+         BOOST_CHECK_EQUAL(frame.second, std::to_string(i));
+      }
+   }
+   BOOST_CHECK_EQUAL(hub->published(), 5);
+   BOOST_CHECK_EQUAL(hub->delivered(), 50);
+
+   // Closed sessions are removed.
+   sockets.pop_back();
+   hub->publish(websocket::fin | websocket::text, boost::asio::buffer(std::string("x")));
+   BOOST_CHECK(wait_for([=]() {
+            hub->publish(websocket::fin | websocket::text, boost::asio::buffer(std::string("x")));
+            return hub->subscribers() == 9;
+         }));
+
+   // A subscriber that stops reading is disconnected.
+   hub->set_slow_limit(65536, WebSocketHub<TCP>::disconnect);
+   hub->publish(websocket::fin | websocket::binary, boost::asio::buffer(std::string(32 << 20, 'x')));
+   BOOST_CHECK(wait_for([=]() {
+            hub->publish(websocket::fin | websocket::text, boost::asio::buffer(std::string("y")));
+            return hub->subscribers() == 0;
+         }));
+   BOOST_CHECK(hub->skipped() >= 9);
+}
+
+BOOST_AUTO_TEST_CASE(WebSocketPingTimeout) {
+   typedef WebSocketSession<TCP> Session;
+   std::shared_ptr<WebSocketHeartbeat<TCP> > heartbeat;
+   TestServer server([&](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 101;
+         http->response_header("Upgrade") = "websocket";
+         http->response_header("Connection") = "upgrade";
+         http->finish();
+
+         auto session = Session::create(http);
+         heartbeat->add(session);
+         session->start([session](const error_code&, uint8_t, const char*, size_t) {});
+      });
+   heartbeat = WebSocketHeartbeat<TCP>::create(
+      server.server()->timer_wheel(),
+      std::chrono::milliseconds(200),
+      std::chrono::milliseconds(300));
+
+   auto wait_for = [](std::function<bool()> condition) {
+      for (int i = 0; i < 500 && !condition(); ++i)
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      return condition();
+   };
+   
+   // Answered pings are measured.
+   boost::asio::io_service io;
+   {
+      boost::asio::ip::tcp::socket socket(io);
+      ws_connect(io, socket, server.port());
+      for (int i = 0; i < 2; ++i) {
+         auto frame = ws_receive(socket);
+         BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::ping);
+         BOOST_CHECK_EQUAL(frame.second.size(), 8);
+         ws_send(socket, websocket::fin | websocket::pong, frame.second);
+      }
+      BOOST_CHECK(wait_for([=]() { return heartbeat->rtt().count() == 2; }));
+      BOOST_CHECK_LT(heartbeat->rtt().max(), 1000000);
+
+      ws_send(socket, websocket::fin | websocket::close, std::string("\x03\xe8", 2));
+      while (ws_receive(socket).first != (websocket::fin | websocket::close))
+         ;
+   }
+   BOOST_CHECK(wait_for([=]() { return heartbeat->sessions() == 0; }));
+   BOOST_CHECK_EQUAL(heartbeat->timeouts(), 0);
+
+   // A peer that does not answer is closed.
+   boost::asio::ip::tcp::socket socket(io);
+   ws_connect(io, socket, server.port());
+   std::pair<uint8_t, std::string> frame;
+   do {
+      frame = ws_receive(socket);
+   } while (frame.first == (websocket::fin | websocket::ping));
+   BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::close);
+   BOOST_CHECK_EQUAL(frame.second.substr(0, 2), std::string("\x03\xe9", 2));
+   BOOST_CHECK_EQUAL(heartbeat->timeouts(), 1);
+   BOOST_CHECK(wait_for([=]() { return heartbeat->sessions() == 0; }));
+   BOOST_CHECK(heartbeat->pings() >= 3);
+
+   // Release the server's timer wheel before its io_service.
+   heartbeat.reset();
+}
+
+BOOST_AUTO_TEST_CASE(WebSocketCoalesce) {
+   typedef WebSocketSession<TCP> Session;
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 101;
+         http->response_header("Upgrade") = "websocket";
+         http->response_header("Connection") = "upgrade";
+         http->finish();
+
+         // Answer each message with many small frames around a large
+         // one, coalesced as for TLS.
+         auto session = Session::create(http);
+         session->set_write_coalescing(Session::DefaultCoalesceLimit);
+         std::weak_ptr<Session> weak = session;
+         session->start([=](const error_code& error, uint8_t, const char* data, size_t size) {
+               auto session = weak.lock();
+               if (!session || error)
+                  return;
+               const std::string message(data, size);
+               for (int i = 0; i < 200; ++i) {
+                  if (i == 100)
+                     session->queue_send(websocket::fin | websocket::binary, std::string(100000, 'z'));
+                  session->queue_send(websocket::fin | websocket::text, message + std::to_string(i));
+               }
+            });
+      });
+
+   // A frame sent along with the handshake request is received.
+   boost::asio::io_service io;
+   boost::asio::ip::tcp::socket socket(io);
+   ws_connect(io, socket, server.port(), "/ws", "", ws_frame(websocket::fin | websocket::text, "early"));
+   for (const std::string message : { "early", "later" }) {
+      if (message == "later")
+         ws_send(socket, websocket::fin | websocket::text, message);
+      for (int i = 0; i < 200; ++i) {
+         if (i == 100) {
+            auto frame = ws_receive(socket);
+            BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::binary);
+            BOOST_CHECK(frame.second == std::string(100000, 'z'));
+         }
+         auto frame = ws_receive(socket);
+         BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::text);
+         BOOST_CHECK_EQUAL(frame.second, message + std::to_string(i));
+      }
+   }
+}
+
+BOOST_AUTO_TEST_CASE(ReleaseStream) {
+   typedef WebSocketSession<TCP> Session;
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 101;
+         http->response_header("Upgrade") = "websocket";
+         http->response_header("Connection") = "upgrade";
+         std::string leftover;
+         auto stream = http->release_stream(leftover);
+
+         // Report the leftover bytes in place of another protocol.
+         if (http->request_path() == "/raw") {
+            boost::asio::write(*stream, boost::asio::buffer("got:" + leftover));
+            stream->close_connection();
+            return;
+         }
+         
+         // Use a small frame buffer so the leftover spans reads.
+         auto session = Session::create(stream, std::move(leftover), 256);
+         std::weak_ptr<Session> weak = session;
+         session->start([=](const error_code& error, uint8_t type, const char* data, size_t size) {
+               if (auto session = weak.lock()) {
+                  if (!error)
+                     session->queue_send(websocket::fin | type, std::string(data, size));
+               }
+            });
+      });
+
+   // A pipelined request is not read by the server.
+   boost::asio::io_service io;
+   {
+      boost::asio::ip::tcp::socket socket(io);
+      ws_connect(io, socket, server.port(), "/raw", "", "GET / HTTP/1.1\r\n\r\n");
+      boost::asio::streambuf response;
+      error_code error;
+      boost::asio::read(socket, response, error);
+      BOOST_CHECK(error == boost::asio::error::eof);
+      BOOST_CHECK_EQUAL(
+         std::string(boost::asio::buffers_begin(response.data()), boost::asio::buffers_end(response.data())),
+         "got:GET / HTTP/1.1\r\n\r\n");
+   }
+
+   // Frames sent with the handshake, larger than the frame buffer,
+   // are received by the session before frames read later.
+   boost::asio::ip::tcp::socket socket(io);
+   ws_connect(
+      io, socket, server.port(), "/ws", "",
+      ws_frame(websocket::fin | websocket::binary, std::string(1000, 'a')) +
+      ws_frame(websocket::fin | websocket::text, "b"));
+   ws_send(socket, websocket::fin | websocket::text, "c");
+   auto frame = ws_receive(socket);
+   BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::binary);
+   BOOST_CHECK(frame.second == std::string(1000, 'a'));
+   BOOST_CHECK_EQUAL(ws_receive(socket).second, "b");
+   BOOST_CHECK_EQUAL(ws_receive(socket).second, "c");
+   ws_send(socket, websocket::fin | websocket::close, std::string("\x03\xe8", 2));
+   BOOST_CHECK_EQUAL(ws_receive(socket).first, websocket::fin | websocket::close);
+}
+
+BOOST_AUTO_TEST_CASE(WebSocketUtf8) {
+   // Check every split point of each sample.
+   auto validate = [](const std::string& text) {
+      bool result = true;
+      for (size_t split = 0; split <= text.size(); ++split) {
+         websocket::Utf8Validator validator;
+         validator.update(text.data(), split);
+         validator.update(text.data() + split, text.size() - split);
+         if (split == 0)
+            result = validator.complete();
+         BOOST_CHECK_EQUAL(validator.complete(), result);
+      }
+      return result;
+   };
+   BOOST_CHECK(validate(""));
+   BOOST_CHECK(validate("plain ASCII text that is longer than one vector of bytes"));
+   BOOST_CHECK(validate("caf\xc3\xa9 \xe2\x82\xac \xf0\x9d\x84\x9e \xed\x9f\xbf \xf4\x8f\xbf\xbf"));
+   BOOST_CHECK(!validate("\xc0\xaf"));
+   BOOST_CHECK(!validate("\xe0\x80\xaf"));
+   BOOST_CHECK(!validate("\xed\xa0\x80"));
+   BOOST_CHECK(!validate("\xf4\x90\x80\x80"));
+   BOOST_CHECK(!validate("abc\xff"));
+   BOOST_CHECK(!validate("\xe2\x82"));
+   BOOST_CHECK(!validate("\x80"));
+
+   // Vector kernels agree with the reference implementations.
+   std::mt19937 generator;
+   std::uniform_int_distribution<int> byte(0, 255);
+   const char key[4] = { '\x5a', '\x00', '\x7f', '\x13' };
+   for (size_t size : { 0, 7, 16, 33, 64, 100, 1000 }) {
+      for (size_t position : { size_t(0), size / 2, size - 1 }) {
+         std::string data(size, 'a');
+         if (size)
+            data[position] = static_cast<char>(0x80 | byte(generator));
+         for (const auto& function : websocket::ascii_functions())
+            BOOST_CHECK_EQUAL(function.second(data.data(), size), websocket::ascii_bytewise(data.data(), size));
+
+         std::string masked(data);
+         websocket::mask_bytewise(&masked[0], size, key, 1);
+         for (const auto& function : websocket::mask_ascii_functions()) {
+            std::string actual(masked);
+            bool ascii;
+            BOOST_CHECK_EQUAL(function.second(&actual[0], size, key, 1, &ascii), (1 + size) & 0x3);
+            BOOST_CHECK(actual == data);
+            BOOST_CHECK_EQUAL(ascii, size == 0);
+         }
+      }
+   }
+
+   // Fused unmasking and validation.
+   std::string text;
+   for (int i = 0; i < 200; ++i)
+      text += i % 7 ? "ascii " : "\xe2\x82\xac";
+   std::string masked(text);
+   websocket::mask(&masked[0], masked.size(), key);
+   websocket::Utf8Validator validator;
+   validator.update_masked(&masked[0], masked.size(), key, 0);
+   BOOST_CHECK(masked == text);
+   BOOST_CHECK(validator.complete());
+
+   // Sessions close on invalid text, including across fragments.
+   typedef WebSocketSession<TCP> Session;
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         http->response_status() = 101;
+         http->response_header("Upgrade") = "websocket";
+         http->response_header("Connection") = "upgrade";
+         http->finish();
+
+         auto session = Session::create(http);
+         std::weak_ptr<Session> weak = session;
+         session->start([=](const error_code& error, uint8_t type, const char* data, size_t size) {
+               if (auto session = weak.lock()) {
+                  if (!error)
+                     session->queue_send(websocket::fin | type, std::string(data, size));
+               }
+            });
+      });
+
+   boost::asio::io_service io;
+   {
+      boost::asio::ip::tcp::socket socket(io);
+      ws_connect(io, socket, server.port());
+      ws_send(socket, websocket::text, "caf\xc3");
+      ws_send(socket, websocket::fin | websocket::continuation, "\xa9");
+      auto frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::text);
+      BOOST_CHECK_EQUAL(frame.second, "caf\xc3\xa9");
+
+      // Binary messages are not validated.
+      ws_send(socket, websocket::fin | websocket::binary, "\xff");
+      BOOST_CHECK_EQUAL(ws_receive(socket).second, "\xff");
+      
+      ws_send(socket, websocket::text, "caf\xc3");
+      ws_send(socket, websocket::fin | websocket::continuation, "");
+      frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::close);
+      BOOST_CHECK_EQUAL(frame.second, std::string("\x03\xef", 2));
+   }
+}
+
+#ifdef ZLIB_H
+BOOST_AUTO_TEST_CASE(WebSocketDeflate) {
+   using websocket::DeflateOptions;
+   using websocket::negotiate_deflate;
+   
+   // Negotiation.
+   DeflateOptions agreed;
+   BOOST_CHECK_EQUAL(
+      negotiate_deflate("permessage-deflate; client_max_window_bits", DeflateOptions(), agreed),
+      "permessage-deflate");
+   BOOST_CHECK_EQUAL(
+      negotiate_deflate(
+         "x-webkit-deflate-frame, permessage-deflate; server_max_window_bits=10; client_max_window_bits=12",
+         DeflateOptions(), agreed),
+      "permessage-deflate; server_max_window_bits=10; client_max_window_bits=12");
+   BOOST_CHECK_EQUAL(agreed.serverMaxWindowBits, 10);
+   BOOST_CHECK_EQUAL(agreed.clientMaxWindowBits, 12);
+   BOOST_CHECK_EQUAL(
+      negotiate_deflate(
+         "permessage-deflate; server_max_window_bits=8, permessage-deflate; server_no_context_takeover",
+         DeflateOptions(), agreed),
+      "permessage-deflate; server_no_context_takeover");
+   BOOST_CHECK(agreed.serverNoContextTakeover);
+   BOOST_CHECK_EQUAL(negotiate_deflate("permessage-deflate; foo", DeflateOptions(), agreed), "");
+   BOOST_CHECK_EQUAL(negotiate_deflate("", DeflateOptions(), agreed), "");
+
+   // Echo compressed messages.
+   typedef WebSocketSession<TCP> Session;
+   TestServer server([](const std::shared_ptr<HTTP>& http) {
+         DeflateOptions config;
+         config.threshold = 100;
+         DeflateOptions agreed;
+         const auto extensions = negotiate_deflate(
+            http->request_header("Sec-WebSocket-Extensions"), config, agreed);
+         http->response_status() = 101;
+         http->response_header("Upgrade") = "websocket";
+         http->response_header("Connection") = "upgrade";
+         http->response_header("Sec-WebSocket-Extensions") = extensions;
+         http->finish();
+
+         auto session = Session::create(http);
+         session->set_deflate(agreed);
+         std::weak_ptr<Session> weak = session;
+         session->start([=](const error_code& error, uint8_t type, const char* data, size_t size) {
+               if (auto session = weak.lock()) {
+                  if (!error)
+                     session->queue_send(websocket::fin | type, std::string(data, size));
+               }
+            });
+      });
+
+   boost::asio::io_service io;
+   boost::asio::ip::tcp::socket socket(io);
+   const auto head = ws_connect(
+      io, socket, server.port(), "/ws",
+      "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n");
+   BOOST_CHECK(head.find("Sec-WebSocket-Extensions: permessage-deflate\r\n") != std::string::npos);
+
+   websocket::Deflate client((DeflateOptions()));
+   std::string message;
+   for (int i = 0; i < 20; ++i)
+      message += (boost::format("{\"sensor\":%d,\"value\":%d,\"status\":\"ok\"},") % i % (i*i)).str();
+   for (int i = 0; i < 3; ++i) {
+      std::string compressed;
+      client.compress(message.data(), message.size(), compressed);
+      ws_send(socket, websocket::fin | websocket::rsv1 | websocket::text, compressed);
+
+      auto frame = ws_receive(socket);
+      BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::rsv1 | websocket::text);
+      BOOST_CHECK_LT(frame.second.size(), message.size());
+
+      std::vector<char> inflated;
+      error_code error;
+      BOOST_CHECK(client.decompress(frame.second.data(), frame.second.size(), inflated, 1 << 20, error));
+      BOOST_CHECK(std::string(inflated.begin(), inflated.end()) == message);
+   }
+
+   // Short messages are sent uncompressed.
+   ws_send(socket, websocket::fin | websocket::text, "hi");
+   auto frame = ws_receive(socket);
+   BOOST_CHECK_EQUAL(frame.first, websocket::fin | websocket::text);
+   BOOST_CHECK_EQUAL(frame.second, "hi");
+}
+#endif
+
 BOOST_AUTO_TEST_CASE(Query) {
    {
       HTTP::Query query = HTTP::parse_query("");
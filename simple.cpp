@@ -14,6 +14,7 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 #define BOOST_LOG_DYN_LINK
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/log/trivial.hpp>
 
 #include "chunky.hpp"
@@ -35,6 +36,11 @@ int main() {
             "<li><a href=\"async\">asynchronous</a></li>"
             "<li><a href=\"query?foo=chunky+web+server&bar=baz\">query</a></li>"
             "<li><form id=\"f\" action=\"post\" method=\"post\"><input type=\"hidden\" name=\"a\" value=\"Lorem ipsum dolor sit amet\"><input type=\"hidden\" name=\"foo\" value=\"bar\"><input type=\"hidden\" name=\"special\" value=\"~`!@#$%^&*()-_=+[]{}\\|;:,.<>\"></form><a href=\"javascript:{}\" onclick=\"document.getElementById('f').submit(); return false;\">post</a></li>"
+            "<li><form action=\"upload\" method=\"post\" enctype=\"multipart/form-data\"><input type=\"file\" name=\"file\" multiple><input type=\"submit\" value=\"upload\"></form></li>"
+            "<li><a href=\"events\">server-sent events</a></li>"
+            "<li><a href=\"wait\">long poll</a></li>"
+            "<li><a href=\"debug/connections\">connections</a></li>"
+            "<li><a href=\"debug/metrics\">metrics</a></li>"
             "<li><a href=\"invalid\">invalid link</a></li>"
             "</ul>";
 
@@ -131,13 +137,12 @@ int main() {
          http->response_status() = 200;
          http->response_headers()["Content-Type"] = "text/html";
 
-         // Read through end of payload.
-         auto streambuf = std::make_shared<boost::asio::streambuf>();
-         boost::asio::async_read(
-            *http, *streambuf,
-            [=](const boost::system::error_code& error, size_t) {
-               // EOF is not an error here.
-               if (error && error != make_error_code(boost::asio::error::eof)) {
+         // Read the whole payload into one buffer (in place if it
+         // arrived with the request head).
+         http->async_read_body(
+            65536,
+            [=](const boost::system::error_code& error, const boost::asio::const_buffer& body) {
+               if (error) {
                   BOOST_LOG_TRIVIAL(error) << error.message();
                   return;
                }
@@ -148,8 +153,8 @@ int main() {
                   << "<h1>Post parameters</h1>"
                   << "<ul>";
 
-               std::string s(boost::asio::buffers_begin(streambuf->data()),
-                             boost::asio::buffers_end(streambuf->data()));
+               std::string s(boost::asio::buffer_cast<const char*>(body),
+                             boost::asio::buffer_size(body));
                for (const auto& value : chunky::HTTP::parse_query(s)) {
                   os << boost::format("<li>%s = \"%s\"</li>")
                      % value.first
@@ -179,6 +184,143 @@ int main() {
             });
       });
    
+   server->set_handler("/upload", [](const std::shared_ptr<chunky::HTTP>& http) {
+         const std::string boundary =
+            chunky::MultipartReader::boundary(http->request_header("Content-Type"));
+         if (boundary.empty()) {
+            http->response_status() = 400;
+            http->finish();
+            return;
+         }
+
+         // Decode the parts as they arrive, counting the bytes of
+         // each file without holding the upload in memory.
+         auto reader = std::make_shared<chunky::MultipartReader>(boundary);
+         auto os = std::make_shared<std::ostringstream>();
+         auto nBytes = std::make_shared<size_t>(0);
+         *os << "<!DOCTYPE html>"
+             << "<title>upload</title>"
+             << "<h1>Uploaded files</h1>"
+             << "<ul>";
+         chunky::async_read_multipart(
+            http, reader,
+            [=](const chunky::MultipartReader::Event& event) {
+               switch (event.type) {
+               case chunky::MultipartReader::part_begin:
+                  {
+                     auto disposition = reader->headers().find("Content-Disposition");
+                     if (disposition != reader->headers().end())
+                        *os << "<li>" << chunky::MultipartReader::parameter(disposition->second, "filename");
+                     *nBytes = 0;
+                  }
+                  break;
+               case chunky::MultipartReader::part_data:
+                  *nBytes += event.size;
+                  break;
+               case chunky::MultipartReader::part_end:
+                  *os << boost::format(" (%d bytes)</li>") % *nBytes;
+                  break;
+               default:
+                  break;
+               }
+            },
+            [=](const boost::system::error_code& error) {
+               if (error) {
+                  BOOST_LOG_TRIVIAL(error) << error.message();
+                  http->response_status() = 400;
+                  http->finish();
+                  return;
+               }
+               
+               *os << "</ul>";
+               *os << "<p><a href=\"/\">back</a></p>";
+               http->response_status() = 200;
+               http->response_headers()["Content-Type"] = "text/html";
+               boost::asio::write(*http, boost::asio::buffer(os->str()));
+               http->finish();
+            });
+      });
+   
+   // Save a raw request body (e.g. curl -T file) to a temporary
+   // file, with disk writes on a separate thread.
+   auto files = chunky::FileIOPool::create();
+   server->set_handler("/save", [=](const std::shared_ptr<chunky::HTTP>& http) {
+         chunky::async_receive_to_file(
+            http, "/tmp/chunky_save", files, chunky::FileReceiveOptions(),
+            [=](const boost::system::error_code& error, uint64_t nBytes) {
+               if (error) {
+                  BOOST_LOG_TRIVIAL(error) << error.message();
+                  http->response_status() = 500;
+                  http->finish();
+                  return;
+               }
+
+               const std::string body = (boost::format("saved %d bytes\n") % nBytes).str();
+               http->response_status() = 200;
+               http->response_headers()["Content-Type"] = "text/plain";
+               http->response_headers()["Content-Length"] = std::to_string(body.size());
+               boost::asio::write(*http, boost::asio::buffer(body));
+               http->finish();
+            });
+      });
+   
+   // Stream the time once per second as server-sent events.
+   auto events = chunky::EventStreamHub<chunky::TCP>::create();
+   server->set_handler("/events", [=](const std::shared_ptr<chunky::HTTP>& http) {
+         events->subscribe("clock", http);
+      });
+   
+   // Hold long-poll requests until the next tick (or 30 seconds).
+   auto parking = server.get();
+   server->set_handler("/wait", [=](const std::shared_ptr<chunky::HTTP>& http) {
+         parking->park("clock", http, std::chrono::seconds(30));
+      });
+   
+   boost::asio::deadline_timer clock(io);
+   std::function<void(const boost::system::error_code&)> tick =
+      [&](const boost::system::error_code& error) {
+      if (error)
+         return;
+
+      const std::string time =
+         boost::posix_time::to_simple_string(boost::posix_time::second_clock::local_time());
+      events->publish("clock", time, "time");
+      server->notify("clock", chunky::PreparedResponse::create(200, time));
+      clock.expires_from_now(boost::posix_time::seconds(1));
+      clock.async_wait(tick);
+   };
+   tick(boost::system::error_code());
+   
+   // Report live connections and per-route CPU usage as JSON.
+   server->set_handler("/debug/connections", server->connections_handler());
+   server->set_handler("/debug/metrics", server->metrics_handler());
+   server->set_accounting(true);
+
+   // Monitor I/O thread responsiveness and log handlers that block it.
+   auto monitor = chunky::LoopMonitor::create();
+   monitor->set_blocking_threshold(std::chrono::milliseconds(10), true);
+   monitor->monitor(io);
+   server->set_loop_monitor(monitor);
+   
+   // Close connections that stall while reading a request, writing a
+   // response, or waiting idle between keep-alive requests.
+   chunky::ConnectionTimeouts timeouts;
+   timeouts.headerRead = std::chrono::seconds(10);
+   timeouts.bodyRead = std::chrono::seconds(30);
+   timeouts.writeStall = std::chrono::seconds(30);
+   timeouts.keepAliveIdle = std::chrono::seconds(120);
+   server->set_timeouts(timeouts);
+   
+   // Shed load with fast 503 responses when too many requests are
+   // in progress, and stop accepting at too many connections.
+   chunky::AdmissionLimits limits;
+   limits.maxConnections = 1000;
+   limits.maxRequests = 100;
+   server->set_admission_limits(limits);
+
+   // Limit each client address to 20 requests per second on average.
+   server->set_rate_limiter(chunky::RateLimiter::create(20.0, 40.0));
+   
    // Set the optional logging callback.
    server->set_logger([](const std::string& message) {
          BOOST_LOG_TRIVIAL(info) << message;
@@ -191,12 +333,17 @@ int main() {
    
    // Accept new connections for 60 seconds. After that, the server
    // destructor will block until all existing TCP connections are
-   // completed. Note that browsers may leave a connection open for
-   // several minutes.
+   // completed. Idle keep-alive connections are closed immediately,
+   // but note that browsers may leave a connection open for several
+   // minutes.
    boost::asio::deadline_timer timer(io, boost::posix_time::seconds(60));
-   timer.async_wait([=](const boost::system::error_code&) mutable {
+   timer.async_wait([=, &clock](const boost::system::error_code&) mutable {
          BOOST_LOG_TRIVIAL(info) << "exiting (blocks until existing connections close)";
          server->destroy();
+         server->close_idle_connections();
+         clock.cancel();
+         events->close("clock");
+         monitor->stop();
       });
    
    BOOST_LOG_TRIVIAL(info) << "listening on port 8800";
@@ -0,0 +1,295 @@
+/*
+Copyright 2015 Shoestring Research, LLC.  All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <iostream>
+#include <random>
+#include <sstream>
+
+#include <boost/asio/ssl.hpp>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#include "chunky.hpp"
+
+// Microbenchmarks for the WebSocket payload kernels in chunky.hpp.
+// Each kernel is run repeatedly over a buffer and its throughput is
+// reported in GB/s. UTF-8 validation is measured separately from and
+// fused with unmasking. With zlib, permessage-deflate settings are
+// compared by compression throughput and bytes saved.
+//
+// Session throughput is then measured end to end over loopback, ws
+// (TCP) against wss (TLS, which requires server.pem in the current
+// directory), with and without write coalescing.
+
+template<typename F>
+static double measure(size_t nBytes, F f) {
+   typedef std::chrono::steady_clock Clock;
+   
+   // Repeat until at least 200 ms have elapsed.
+   size_t nIterations = 0;
+   const auto start = Clock::now();
+   auto elapsed = Clock::duration::zero();
+   while (elapsed < std::chrono::milliseconds(200)) {
+      f();
+      ++nIterations;
+      elapsed = Clock::now() - start;
+   }
+
+   return nIterations * nBytes / std::chrono::duration<double>(elapsed).count() / 1e9;
+}
+
+static void bench_mask(size_t nBytes) {
+   // Offset the payload by 1 byte to include an unaligned head.
+   std::vector<char> buffer(nBytes + 1, 'x');
+   const char key[4] = { 0x12, 0x34, 0x56, 0x78 };
+   for (const auto& function : chunky::websocket::mask_functions()) {
+      const double rate = measure(nBytes, [&]() {
+            function.second(&buffer[1], nBytes, key, 0);
+         });
+      std::cout << boost::format("mask %-10s %8d bytes %8.2f GB/s\n")
+         % function.first % nBytes % rate;
+   }
+}
+
+// Compare unmasking followed by UTF-8 validation with the fused
+// single pass, for ASCII and mixed text. Rates include copying the
+// masked payload into place.
+static void bench_utf8(size_t nBytes, bool ascii) {
+   std::string text;
+   while (text.size() < nBytes)
+      text += ascii ? "status: ok; " : "temp: 21\xc2\xb0""C \xe2\x82\xac ";
+   text.resize(nBytes - (ascii ? 0 : nBytes % 16));
+   const char key[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+   // Each pass starts from a fresh copy of the masked payload.
+   std::string masked(text);
+   chunky::websocket::mask(&masked[0], masked.size(), key);
+   std::string buffer(masked);
+   const double separate = measure(text.size(), [&]() {
+         std::memcpy(&buffer[0], masked.data(), masked.size());
+         chunky::websocket::Utf8Validator validator;
+         chunky::websocket::mask(&buffer[0], buffer.size(), key);
+         if (!validator.update(buffer.data(), buffer.size()))
+            throw std::runtime_error("invalid");
+      });
+   const double fused = measure(text.size(), [&]() {
+         std::memcpy(&buffer[0], masked.data(), masked.size());
+         chunky::websocket::Utf8Validator validator;
+         validator.update_masked(&buffer[0], buffer.size(), key, 0);
+         if (!validator.complete())
+            throw std::runtime_error("invalid");
+      });
+   std::cout << boost::format("utf8 %-5s %8d bytes %8.2f GB/s separate %8.2f GB/s fused\n")
+      % (ascii ? "ascii" : "mixed") % nBytes % separate % fused;
+}
+
+#ifdef ZLIB_H
+// Compress a stream of JSON telemetry-like messages and report
+// compression throughput against the fraction of bytes saved.
+static void bench_deflate(int level, int memLevel, bool contextTakeover) {
+   std::vector<std::string> messages;
+   std::mt19937 generator;
+   std::uniform_int_distribution<int> reading(0, 9999);
+   for (int i = 0; i < 64; ++i) {
+      std::ostringstream os;
+      os << "{\"seq\":" << i << ",\"sensors\":[";
+      for (int j = 0; j < 16; ++j) {
+         os << boost::format("%s{\"id\":\"sensor-%02d\",\"value\":%d,\"status\":\"ok\"}")
+            % (j ? "," : "") % j % reading(generator);
+      }
+      os << "]}";
+      messages.push_back(os.str());
+   }
+   
+   size_t nBytes = 0;
+   for (const auto& message : messages)
+      nBytes += message.size();
+
+   chunky::websocket::DeflateOptions options;
+   options.level = level;
+   options.memLevel = memLevel;
+   options.serverNoContextTakeover = !contextTakeover;
+   chunky::websocket::Deflate deflate(options);
+   std::string compressed;
+   size_t nCompressed = 0;
+   const double rate = measure(nBytes, [&]() {
+         nCompressed = 0;
+         for (const auto& message : messages) {
+            deflate.compress(message.data(), message.size(), compressed);
+            nCompressed += compressed.size();
+         }
+      });
+   std::cout << boost::format("deflate level %d memLevel %d %-18s %8.1f MB/s %5.1f%% saved\n")
+      % level % memLevel
+      % (contextTakeover ? "context takeover" : "no takeover")
+      % (rate*1000.0) % (100.0*(nBytes - nCompressed)/nBytes);
+}
+#endif
+
+// Queue messages as fast as the session's send queue allows.
+template<typename T>
+static void stream_messages(
+   const std::shared_ptr<chunky::WebSocketSession<T> >& ws,
+   const std::shared_ptr<size_t>& remaining,
+   const std::shared_ptr<const std::string>& message) {
+   while (*remaining) {
+      --*remaining;
+      if (!ws->queue_send(chunky::websocket::fin | chunky::websocket::binary, *message)) {
+         ws->async_wait_writable([=](const boost::system::error_code& error) {
+               if (!error)
+                  stream_messages(ws, remaining, message);
+            });
+         return;
+      }
+   }
+}
+
+// Accept the upgrade and start streaming messages.
+template<typename T>
+static void serve_messages(
+   const std::shared_ptr<chunky::HTTPTransaction<T> >& http,
+   size_t nMessages,
+   size_t nMessageBytes,
+   size_t coalesceLimit) {
+   http->response_status() = 101;
+   http->response_header("Upgrade") = "websocket";
+   http->response_header("Connection") = "upgrade";
+   std::string leftover;
+   auto stream = http->release_stream(leftover);
+
+   auto ws = chunky::WebSocketSession<T>::create(stream, std::move(leftover));
+   ws->set_write_coalescing(coalesceLimit);
+   ws->start([](const boost::system::error_code&, uint8_t, const char*, size_t) {});
+   stream_messages(
+      ws,
+      std::make_shared<size_t>(nMessages),
+      std::make_shared<const std::string>(nMessageBytes, 'x'));
+}
+
+// Perform a client handshake and read the expected number of bytes,
+// returning the elapsed seconds.
+template<typename Socket>
+static double receive_messages(Socket& socket, size_t nBytes) {
+   const auto start = std::chrono::steady_clock::now();
+   boost::asio::write(socket, boost::asio::buffer(std::string(
+      "GET /ws HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Upgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+      "Sec-WebSocket-Version: 13\r\n"
+      "\r\n")));
+
+   boost::asio::streambuf streambuf;
+   const size_t nHeadBytes = boost::asio::read_until(socket, streambuf, "\r\n\r\n");
+   size_t nReceived = streambuf.size() - nHeadBytes;
+
+   std::vector<char> buffer(65536);
+   while (nReceived < nBytes)
+      nReceived += socket.read_some(boost::asio::buffer(buffer));
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Client TLS handshake (none for TCP).
+static void handshake(boost::asio::ip::tcp::socket&) {
+}
+
+static void handshake(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& socket) {
+   socket.handshake(boost::asio::ssl::stream_base::client);
+}
+
+template<typename Server, typename Socket>
+static void bench_session(
+   const char* scheme,
+   boost::asio::io_service& io,
+   const std::shared_ptr<Server>& server,
+   Socket& socket,
+   size_t nMessageBytes,
+   size_t coalesceLimit) {
+   const size_t nMessages = std::max<size_t>((64 << 20) / nMessageBytes, 1);
+   server->set_handler("/ws", [=](const std::shared_ptr<typename Server::Transaction>& http) {
+         serve_messages(http, nMessages, nMessageBytes, coalesceLimit);
+      });
+
+   using boost::asio::ip::tcp;
+   const auto port = server->listen(tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+   std::thread thread([&]() { io.run(); });
+   
+   socket.lowest_layer().connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+   handshake(socket);
+   const size_t nHeaderBytes = nMessageBytes < 126 ? 2 : nMessageBytes < 65536 ? 4 : 10;
+   const double seconds = receive_messages(socket, nMessages * (nHeaderBytes + nMessageBytes));
+   socket.lowest_layer().close();
+
+   server->destroy();
+   thread.join();
+   io.reset();
+   
+   std::cout << boost::format("session %-3s %-9s %6d bytes %8.1f MB/s %9.0f msg/s\n")
+      % scheme % (coalesceLimit ? "coalesced" : "gather") % nMessageBytes
+      % (nMessages*nMessageBytes/seconds/1e6) % (nMessages/seconds);
+}
+
+static void bench_ws(size_t nMessageBytes, size_t coalesceLimit) {
+   boost::asio::io_service io;
+   auto server = chunky::SimpleHTTPServer::create(io);
+   boost::asio::io_service clientIO;
+   boost::asio::ip::tcp::socket socket(clientIO);
+   bench_session("ws", io, server, socket, nMessageBytes, coalesceLimit);
+}
+
+static void bench_wss(size_t nMessageBytes, size_t coalesceLimit) {
+   boost::asio::ssl::context context(boost::asio::ssl::context::sslv23);
+   context.use_certificate_chain_file("server.pem");
+   context.use_private_key_file("server.pem", boost::asio::ssl::context::pem);
+   boost::asio::ssl::context clientContext(boost::asio::ssl::context::sslv23);
+
+   boost::asio::io_service io;
+   auto server = chunky::SimpleHTTPSServer::create(io, context);
+   boost::asio::io_service clientIO;
+   boost::asio::ssl::stream<boost::asio::ip::tcp::socket> socket(clientIO, clientContext);
+   bench_session("wss", io, server, socket, nMessageBytes, coalesceLimit);
+}
+
+int main() {
+   for (size_t nBytes : { 125, 4096, 262144 })
+      bench_mask(nBytes);
+   for (size_t nBytes : { 4096, 262144 }) {
+      bench_utf8(nBytes, true);
+      bench_utf8(nBytes, false);
+   }
+#ifdef ZLIB_H
+   for (bool contextTakeover : { true, false }) {
+      for (int level : { 1, 6, 9 }) {
+         for (int memLevel : { 1, 8 })
+            bench_deflate(level, memLevel, contextTakeover);
+      }
+   }
+#endif
+
+   typedef chunky::WebSocketSession<chunky::TCP> Session;
+   for (size_t nBytes : { 64, 1024, 65536 }) {
+      for (size_t coalesceLimit : { size_t(0), size_t(Session::DefaultCoalesceLimit) }) {
+         bench_ws(nBytes, coalesceLimit);
+         try {
+            bench_wss(nBytes, coalesceLimit);
+         }
+         catch (const std::exception& e) {
+            std::cout << "session wss skipped: " << e.what() << "\n";
+         }
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,471 @@
+/*
+Copyright 2015 Shoestring Research, LLC.  All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <iostream>
+#include <random>
+
+#include "chunky.hpp"
+
+// Load generator for chunky WebSocket sessions. It starts a chunky
+// server on a loopback port and opens sessions to it with a native
+// asio client that uses the same frame codec
+// (websocket::FrameReader and websocket::encode_client_header()).
+// Traffic runs in one of three modes:
+//
+//   echo       Each client sends messages that the server echoes.
+//              Latency is the round trip.
+//   broadcast  The server publishes messages to every session with a
+//              WebSocketHub. Latency is from publication to receipt.
+//   oneway     Clients send messages that the server only counts.
+//
+// Parameters are name=value arguments, e.g.
+//
+//   websocket_load mode=echo sessions=100 size=64 rate=1000 seconds=5
+//
+// The rate is messages per second per client (per server for
+// broadcast). A rate of 0 sends as fast as possible; an echo client
+// then waits for each echo before sending again. Each payload starts
+// with its send time, so sizes below 8 bytes are raised to 8.
+
+typedef boost::system::error_code error_code;
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+   std::string mode;
+   size_t sessions;
+   size_t size;
+   double rate;
+   double seconds;
+   size_t threads;
+
+   Options()
+      : mode("echo")
+      , sessions(10)
+      , size(64)
+      , rate(1000)
+      , seconds(5)
+      , threads(1) {
+   }
+};
+
+// Counters for the measurement interval.
+struct Stats {
+   std::atomic<bool> running;
+   std::atomic<uint64_t> messages;
+   std::atomic<uint64_t> bytes;
+   chunky::Histogram latency;
+
+   Stats()
+      : running(false)
+      , messages(0)
+      , bytes(0) {
+   }
+
+   void record(const char* data, size_t size, bool timed) {
+      if (!running)
+         return;
+      ++messages;
+      bytes += size;
+      if (timed && size >= 8) {
+         uint64_t stamp = 0;
+         for (size_t i = 0; i < 8; ++i)
+            stamp = (stamp << 8) | static_cast<uint8_t>(data[i]);
+         latency.record(std::chrono::microseconds(timestamp() - stamp));
+      }
+   }
+
+   static uint64_t timestamp() {
+      return std::chrono::duration_cast<std::chrono::microseconds>(
+         Clock::now().time_since_epoch()).count();
+   }
+};
+
+// Write the current time into the first 8 bytes of a payload.
+static void stamp(char* payload) {
+   const uint64_t now = Stats::timestamp();
+   for (size_t i = 0; i < 8; ++i)
+      payload[i] = static_cast<char>(now >> (56 - 8*i));
+}
+
+// One client session. Frames sent while a write is in progress are
+// appended to a pending buffer and written together next.
+class Client : public std::enable_shared_from_this<Client>
+             , boost::noncopyable {
+public:
+   Client(boost::asio::io_service& io, const Options& options, Stats& stats)
+      : io_(io)
+      , options_(options)
+      , stats_(stats)
+      , socket_(io)
+      , timer_(io)
+      , message_(options.size, 'x')
+      , writing_(false)
+      , generator_(std::random_device()()) {
+   }
+
+   // Connect and perform the handshake, then call the handler.
+   void connect(unsigned short port, const std::string& path, std::function<void(const error_code&)> handler) {
+      using boost::asio::ip::tcp;
+      auto this_ = shared_from_this();
+      socket_.async_connect(
+         tcp::endpoint(boost::asio::ip::address_v4::loopback(), port),
+         [=](const error_code& error) {
+            if (error) {
+               handler(error);
+               return;
+            }
+
+            auto request = std::make_shared<std::string>(
+               "GET " + path + " HTTP/1.1\r\n"
+               "Host: localhost\r\n"
+               "Upgrade: websocket\r\n"
+               "Connection: Upgrade\r\n"
+               "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+               "Sec-WebSocket-Version: 13\r\n"
+               "\r\n");
+            boost::asio::async_write(
+               this_->socket_, boost::asio::buffer(*request),
+               [=](const error_code& error, size_t) {
+                  (void)request;
+                  if (error) {
+                     handler(error);
+                     return;
+                  }
+                  this_->read_head(handler);
+               });
+         });
+   }
+
+   // Start sending at the configured rate (or as fast as possible).
+   void start() {
+      if (options_.mode == "broadcast")
+         return;
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (options_.rate > 0) {
+         period_ = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(1.0 / options_.rate));
+         timer_.expires_from_now(period_);
+         tick();
+      }
+      else if (options_.mode == "echo")
+         queue(1);
+      else
+         queue(batch_size());
+   }
+
+   void stop() {
+      auto this_ = shared_from_this();
+      io_.post([=]() {
+            error_code error;
+            this_->timer_.cancel(error);
+            this_->socket_.close(error);
+         });
+   }
+
+private:
+   boost::asio::io_service& io_;
+   const Options& options_;
+   Stats& stats_;
+   boost::asio::ip::tcp::socket socket_;
+   boost::asio::steady_timer timer_;
+   Clock::duration period_;
+   boost::asio::streambuf head_;
+   chunky::websocket::FrameReader reader_;
+   std::string message_;
+
+   std::mutex mutex_;
+   bool writing_;
+   std::string pending_;
+   std::string written_;
+   std::mt19937 generator_;
+
+   // Read the 101 response, keeping any frame bytes read past it.
+   void read_head(std::function<void(const error_code&)> handler) {
+      auto this_ = shared_from_this();
+      boost::asio::async_read_until(
+         socket_, head_, "\r\n\r\n",
+         [=](const error_code& error, size_t nBytes) {
+            if (error) {
+               handler(error);
+               return;
+            }
+
+            const std::string head(
+               boost::asio::buffers_begin(this_->head_.data()),
+               boost::asio::buffers_begin(this_->head_.data()) + nBytes);
+            this_->head_.consume(nBytes);
+            if (head.compare(0, 12, "HTTP/1.1 101") != 0) {
+               handler(make_error_code(boost::system::errc::protocol_error));
+               return;
+            }
+
+            const size_t nLeftover = boost::asio::buffer_copy(this_->reader_.prepare(), this_->head_.data());
+            this_->reader_.commit(nLeftover);
+            this_->head_.consume(nLeftover);
+            handler(error_code());
+            this_->receive();
+         });
+   }
+
+   void receive() {
+      chunky::websocket::Frame frame;
+      error_code error;
+      while (reader_.next(frame, error)) {
+         switch (frame.opcode()) {
+         case chunky::websocket::text:
+         case chunky::websocket::binary:
+            stats_.record(frame.data, frame.size, options_.mode != "oneway");
+            if (options_.mode == "echo" && options_.rate <= 0) {
+               std::lock_guard<std::mutex> lock(mutex_);
+               queue(1);
+            }
+            break;
+         case chunky::websocket::close:
+            return;
+         default:
+            break;
+         }
+      }
+      if (error)
+         return;
+
+      auto this_ = shared_from_this();
+      socket_.async_read_some(
+         reader_.prepare(),
+         [=](const error_code& error, size_t nBytes) {
+            if (error)
+               return;
+            this_->reader_.commit(nBytes);
+            this_->receive();
+         });
+   }
+
+   void tick() {
+      auto this_ = shared_from_this();
+      timer_.async_wait([=](const error_code& error) {
+            if (error)
+               return;
+            std::lock_guard<std::mutex> lock(this_->mutex_);
+            this_->queue(1);
+            this_->timer_.expires_at(this_->timer_.expires_at() + this_->period_);
+            this_->tick();
+         });
+   }
+
+   // Messages per write for a one-way client without a rate.
+   size_t batch_size() const {
+      return std::max<size_t>(65536 / options_.size, 1);
+   }
+
+   // Append masked frames to the pending buffer (with the mutex held).
+   void queue(size_t nMessages) {
+      for (size_t i = 0; i < nMessages; ++i) {
+         char header[chunky::websocket::MaxClientHeader];
+         const uint32_t key = generator_();
+         const size_t nHeaderBytes = chunky::websocket::encode_client_header(
+            header, chunky::websocket::fin | chunky::websocket::binary, message_.size(),
+            reinterpret_cast<const char*>(&key));
+         pending_.append(header, nHeaderBytes);
+
+         const size_t offset = pending_.size();
+         pending_.append(message_);
+         stamp(&pending_[offset]);
+         chunky::websocket::mask(&pending_[offset], message_.size(), reinterpret_cast<const char*>(&key));
+      }
+      write();
+   }
+
+   void write() {
+      if (writing_ || pending_.empty())
+         return;
+      writing_ = true;
+      written_.swap(pending_);
+      pending_.clear();
+
+      auto this_ = shared_from_this();
+      boost::asio::async_write(
+         socket_, boost::asio::buffer(written_),
+         [=](const error_code& error, size_t) {
+            std::lock_guard<std::mutex> lock(this_->mutex_);
+            this_->writing_ = false;
+            if (error)
+               return;
+            if (this_->options_.mode == "oneway" && this_->options_.rate <= 0 && this_->stats_.running)
+               this_->queue(this_->batch_size());
+            else
+               this_->write();
+         });
+   }
+};
+
+// Publish timestamped messages to the hub at the configured rate.
+static void publish(
+   boost::asio::io_service& io,
+   const std::shared_ptr<chunky::WebSocketHub<chunky::TCP> >& hub,
+   const std::shared_ptr<boost::asio::steady_timer>& timer,
+   const Options& options,
+   const Stats& stats) {
+   if (!stats.running)
+      return;
+
+   std::string payload(options.size, 'x');
+   stamp(&payload[0]);
+   hub->publish(chunky::websocket::fin | chunky::websocket::binary, boost::asio::buffer(payload));
+
+   if (options.rate > 0) {
+      timer->expires_at(timer->expires_at() + std::chrono::duration_cast<Clock::duration>(
+         std::chrono::duration<double>(1.0 / options.rate)));
+      timer->async_wait([&, hub, timer](const error_code& error) {
+            if (!error)
+               publish(io, hub, timer, options, stats);
+         });
+   }
+   else {
+      io.post([&, hub, timer]() {
+            publish(io, hub, timer, options, stats);
+         });
+   }
+}
+
+static bool parse(int argc, char* argv[], Options& options) {
+   for (int i = 1; i < argc; ++i) {
+      const std::string arg(argv[i]);
+      const auto equals = arg.find('=');
+      if (equals == std::string::npos)
+         return false;
+
+      const std::string name = arg.substr(0, equals);
+      const std::string value = arg.substr(equals + 1);
+      try {
+         if (name == "mode")
+            options.mode = value;
+         else if (name == "sessions")
+            options.sessions = std::stoul(value);
+         else if (name == "size")
+            options.size = std::stoul(value);
+         else if (name == "rate")
+            options.rate = std::stod(value);
+         else if (name == "seconds")
+            options.seconds = std::stod(value);
+         else if (name == "threads")
+            options.threads = std::stoul(value);
+         else
+            return false;
+      }
+      catch (const std::exception&) {
+         return false;
+      }
+   }
+
+   options.size = std::max<size_t>(options.size, 8);
+   options.threads = std::max<size_t>(options.threads, 1);
+   return options.mode == "echo" || options.mode == "broadcast" || options.mode == "oneway";
+}
+
+int main(int argc, char* argv[]) {
+   Options options;
+   if (!parse(argc, argv, options)) {
+      std::cerr << "usage: websocket_load [mode=echo|broadcast|oneway] [sessions=N] [size=BYTES]\n"
+                << "                      [rate=PER_SECOND] [seconds=S] [threads=N]\n";
+      return 1;
+   }
+
+   typedef chunky::WebSocketSession<chunky::TCP> Session;
+   Stats stats;
+   boost::asio::io_service io;
+   auto server = chunky::SimpleHTTPServer::create(io);
+   auto hub = chunky::WebSocketHub<chunky::TCP>::create();
+   hub->set_slow_limit(1 << 20);
+   server->set_handler("/", [&](const std::shared_ptr<chunky::HTTP>& http) {
+         http->response_status() = 101;
+         http->response_header("Upgrade") = "websocket";
+         http->response_header("Connection") = "upgrade";
+         std::string leftover;
+         auto stream = http->release_stream(leftover);
+
+         auto session = Session::create(stream, std::move(leftover));
+         session->set_validate_utf8(false);
+         std::weak_ptr<Session> weak = session;
+         if (options.mode == "broadcast")
+            hub->subscribe(session);
+         session->start([&, weak](const error_code& error, uint8_t type, const char* data, size_t size) {
+               if (error)
+                  return;
+               if (options.mode == "echo") {
+                  if (auto session = weak.lock())
+                     session->queue_send(chunky::websocket::fin | type, std::string(data, size));
+               }
+               else if (options.mode == "oneway")
+                  stats.record(data, size, false);
+            });
+      });
+
+   using boost::asio::ip::tcp;
+   const auto port = server->listen(tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+
+   std::vector<std::thread> threads;
+   std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io));
+   for (size_t i = 0; i < options.threads; ++i)
+      threads.emplace_back([&]() { io.run(); });
+
+   // Open all sessions before starting traffic.
+   std::vector<std::shared_ptr<Client> > clients;
+   std::atomic<size_t> nConnected(0);
+   std::atomic<size_t> nFailed(0);
+   for (size_t i = 0; i < options.sessions; ++i) {
+      clients.push_back(std::make_shared<Client>(io, options, stats));
+      clients.back()->connect(port, "/", [&](const error_code& error) {
+            ++(error ? nFailed : nConnected);
+         });
+   }
+   while (nConnected + nFailed < options.sessions)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   while (hub->subscribers() < nConnected && options.mode == "broadcast")
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+   // Run traffic for the measurement interval.
+   stats.running = true;
+   const auto start = Clock::now();
+   for (auto& client : clients)
+      client->start();
+   auto timer = std::make_shared<boost::asio::steady_timer>(io);
+   if (options.mode == "broadcast") {
+      timer->expires_from_now(Clock::duration::zero());
+      io.post([&]() { publish(io, hub, timer, options, stats); });
+   }
+   std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+   stats.running = false;
+   const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+   // Shut down.
+   for (auto& client : clients)
+      client->stop();
+   io.post([=]() {
+         error_code error;
+         timer->cancel(error);
+      });
+   server->destroy();
+   work.reset();
+   for (auto& thread : threads)
+      thread.join();
+
+   std::cout << boost::format("%s sessions %d (%d failed) size %d rate %g: %.0f msg/s %.2f MB/s latency_us ")
+      % options.mode % nConnected % nFailed % options.size % options.rate
+      % (stats.messages / seconds) % (stats.bytes / seconds / 1e6);
+   stats.latency.write_json(std::cout);
+   std::cout << "\n";
+   return 0;
+}